@@ -0,0 +1,78 @@
+#include "system/loggerd/drain_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+void DrainScheduler::addSocket(SubSocket *sock, const std::string &name, float frequency, size_t queue_size) {
+  auto &s = sockets_[sock];
+  s.stats.name = name;
+  s.quantum_messages = std::max(DRAIN_MIN_MESSAGES, (int)std::ceil(frequency * DRAIN_ROUND_SECONDS));
+  s.quantum_bytes = std::max(DRAIN_MIN_BYTES, queue_size / DRAIN_QUEUE_FRACTION);
+  s.stats.budget_bytes = s.quantum_bytes;
+}
+
+void DrainScheduler::activate(const std::vector<SubSocket *> &ready) {
+  for (auto sock : ready) {
+    auto &s = sockets_.at(sock);
+    if (!s.active) {
+      s.active = true;
+      active_.push_back(sock);
+    }
+  }
+}
+
+void DrainScheduler::drain(Poller *poller, int timeout_ms, const std::function<void(SubSocket *, Message *)> &handle,
+                           const std::function<bool()> &stop) {
+  activate(poller->poll(timeout_ms));
+
+  while (!active_.empty() && !stop()) {
+    // one round over the sockets backlogged at its start
+    for (size_t n = active_.size(); n > 0 && !stop(); --n) {
+      SubSocket *sock = active_.front();
+      active_.pop_front();
+      auto &s = sockets_.at(sock);
+      ++s.stats.rounds;
+      s.deficit_bytes += s.quantum_bytes;
+
+      bool empty = false;
+      size_t round_bytes = 0;
+      for (int count = 0; count < s.quantum_messages && s.deficit_bytes > 0 && !stop(); ++count) {
+        Message *msg = sock->receive(true);
+        if (!msg) {
+          empty = true;
+          break;
+        }
+        const size_t size = msg->getSize();
+        s.deficit_bytes -= size;
+        round_bytes += size;
+        ++s.stats.messages;
+        s.stats.bytes += size;
+        handle(sock, msg);
+      }
+
+      s.stats.max_round_bytes = std::max(s.stats.max_round_bytes, round_bytes);
+
+      if (empty) {
+        s.active = false;
+        s.deficit_bytes = 0;
+      } else {
+        // a socket limited by its message budget doesn't save up more than one round of bytes
+        s.deficit_bytes = std::min(s.deficit_bytes, s.quantum_bytes);
+        ++s.stats.deferred;
+        active_.push_back(sock);
+      }
+    }
+
+    // sockets that became ready during the round join the next one
+    activate(poller->poll(0));
+  }
+}
+
+std::vector<DrainScheduler::SocketStats> DrainScheduler::stats() const {
+  std::vector<SocketStats> result;
+  result.reserve(sockets_.size());
+  for (const auto &[_, s] : sockets_) {
+    result.push_back(s.stats);
+  }
+  return result;
+}
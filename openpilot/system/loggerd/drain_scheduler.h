@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "openpilot/cereal/messaging/messaging.h"
+
+// the message budget of a socket per round covers this much of its expected traffic
+constexpr double DRAIN_ROUND_SECONDS = 0.1;
+constexpr int DRAIN_MIN_MESSAGES = 8;
+// the byte budget is this fraction of its queue
+constexpr size_t DRAIN_QUEUE_FRACTION = 16;
+constexpr size_t DRAIN_MIN_BYTES = 64 * 1024;
+
+// Drains ready sockets in deficit round robin. In every round each backlogged socket gets a message
+// budget from its service frequency and a byte budget from its queue size, plus the bytes it didn't use
+// last round. A high rate service can't hold up the others for longer than its budget.
+class DrainScheduler {
+public:
+  struct SocketStats {
+    std::string name;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    size_t budget_bytes = 0;     // byte budget per round
+    uint64_t rounds = 0;         // rounds the socket was served in
+    uint64_t deferred = 0;       // rounds that ran out of budget before the socket was empty
+    size_t max_round_bytes = 0;  // most bytes drained in a single round
+    // how much of its byte budget the socket needed at most in one round
+    double maxBudgetUse() const { return budget_bytes > 0 ? (double)max_round_bytes / budget_bytes : 0; }
+    // share of the rounds the socket was still backlogged after using up its budget
+    double deferredRatio() const { return rounds > 0 ? (double)deferred / rounds : 0; }
+  };
+
+  void addSocket(SubSocket *sock, const std::string &name, float frequency, size_t queue_size);
+  // Serves the sockets that become ready within timeout_ms until they are all empty or stop() is true.
+  // handle() takes ownership of the messages.
+  void drain(Poller *poller, int timeout_ms, const std::function<void(SubSocket *, Message *)> &handle,
+             const std::function<bool()> &stop);
+  std::vector<SocketStats> stats() const;
+
+private:
+  struct SocketState {
+    SocketStats stats;
+    int quantum_messages = DRAIN_MIN_MESSAGES;
+    int64_t quantum_bytes = DRAIN_MIN_BYTES;
+    int64_t deficit_bytes = 0;
+    bool active = false;
+  };
+  void activate(const std::vector<SubSocket *> &ready);
+
+  std::unordered_map<SubSocket *, SocketState> sockets_;
+  std::deque<SubSocket *> active_;
+};
@@ -1,5 +1,12 @@
 #include "system/loggerd/logger.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <map>
 #include <vector>
@@ -7,6 +14,8 @@
 #include <sstream>
 #include <random>
 
+#include <capnp/schema.h>
+
 #include "common/params.h"
 #include "common/swaglog.h"
 #include "common/version.h"
@@ -161,42 +170,204 @@ static void log_sentinel(LoggerState *log, SentinelType type, int exit_signal =
   log->write(msg.toBytes(), true);
 }
 
+static void log_writer_stats(const char *name, const ZstdFileWriter &writer) {
+  const auto stats = writer.stats();
+  if (stats.stalls > 0) {
+    LOGW("%s: compression fell behind, %" PRIu64 " writes waited %.1f ms in total", name, stats.stalls, stats.stall_ns / 1e6);
+  }
+  LOGD("%s: %" PRIu64 " KB compressed to %" PRIu64 " KB in %.1f ms, max queue depth %zu, level %d (%" PRIu64 " changes)", name,
+       stats.bytes_in / 1024, stats.bytes_out / 1024, stats.compress_ns / 1e6, stats.max_queue_depth,
+       stats.level, stats.level_changes);
+}
+
+void StallHistogram::add(uint64_t ns) {
+  const double ms = ns / 1e6;
+  size_t i = 0;
+  while (i < STALL_BUCKETS_MS.size() && ms >= STALL_BUCKETS_MS[i]) ++i;
+  ++buckets[i];
+  ++count;
+  total_ns += ns;
+  max_ns = std::max(max_ns, ns);
+}
+
+std::string StallHistogram::toString() const {
+  std::string out;
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    out += i < STALL_BUCKETS_MS.size() ? util::string_format("<%gms:%" PRIu64 " ", STALL_BUCKETS_MS[i], buckets[i])
+                                       : util::string_format(">=%gms:%" PRIu64, STALL_BUCKETS_MS.back(), buckets[i]);
+  }
+  return out + util::string_format(", max %.2f ms, mean %.2f ms", max_ns / 1e6, count > 0 ? total_ns / 1e6 / count : 0.);
+}
+
+// the lock goes last, so the uploader never sees logs that are still being written
+static void close_segment(LogSegment *segment) {
+  segment->rlog.reset();
+  segment->qlog.reset();
+  std::remove(segment->lock_file.c_str());
+}
+
+// segments prepared by a loggerd that didn't exit cleanly are empty, and lose their lock when the uploader starts
+static void remove_stale_segments(const std::string &log_root) {
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(log_root, ec)) {
+    if (entry.is_directory(ec) && util::ends_with(entry.path().filename().string(), ".tmp")) {
+      LOGW("removing stale segment %s", entry.path().c_str());
+      std::filesystem::remove_all(entry.path(), ec);
+    }
+  }
+}
+
 LoggerState::LoggerState(const std::string &log_root) {
+  remove_stale_segments(log_root);
   route_name = logger_get_identifier("RouteCount");
   route_path = log_root + "/" + route_name;
   init_data = logger_build_init_data(true);
+  background_thread = std::thread(&LoggerState::backgroundThread, this);
 }
 
 LoggerState::~LoggerState() {
   if (rlog) {
     log_sentinel(this, SentinelType::END_OF_ROUTE, exit_signal);
-    std::remove(lock_file.c_str());
+    auto last = std::make_shared<LogSegment>(LogSegment{segment_path, lock_file, std::move(rlog), std::move(qlog)});
+    runInBackground([last]() { close_segment(last.get()); });
+    LOGW("rotation stalls: %s", rotation_stalls.toString().c_str());
+  }
+
+  {
+    std::lock_guard lk(tasks_lock);
+    exit_background = true;
+  }
+  tasks_cv.notify_one();
+  background_thread.join();
+
+  // remove the segment prepared for a rotation that didn't happen
+  if (next_segment.valid()) {
+    auto unused = next_segment.get();
+    close_segment(unused.get());
+    std::remove((unused->path + "/rlog.zst").c_str());
+    std::remove((unused->path + "/qlog.zst").c_str());
+    rmdir(unused->path.c_str());
+  }
+}
+
+void LoggerState::runInBackground(std::function<void()> task) {
+  {
+    std::lock_guard lk(tasks_lock);
+    tasks.push_back(std::move(task));
   }
+  tasks_cv.notify_one();
+}
+
+void LoggerState::backgroundThread() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock lk(tasks_lock);
+      tasks_cv.wait(lk, [this]() { return exit_background || !tasks.empty(); });
+      // queued tasks still run on exit
+      if (tasks.empty()) break;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+// Opens the logs of a segment in a directory that only gets the segment's name when it's started,
+// so the prepared segment doesn't look like the latest one. Its lock keeps the uploader and deleter out.
+std::unique_ptr<LogSegment> LoggerState::prepareSegment(int segment_part) {
+  auto segment = std::make_unique<LogSegment>();
+  segment->path = route_path + "--" + std::to_string(segment_part) + ".tmp";
+  bool ret = util::create_directories(segment->path, 0775);
+  assert(ret == true);
+
+  segment->lock_file = segment->path + "/rlog.lock";
+  std::ofstream{segment->lock_file};
+
+  segment->rlog.reset(new ZstdFileWriter(segment->path + "/rlog.zst", LOG_COMPRESSION_CONFIG));
+  segment->qlog.reset(new ZstdFileWriter(segment->path + "/qlog.zst", LOG_COMPRESSION_CONFIG));
+  return segment;
 }
 
 bool LoggerState::next() {
+  const uint64_t start_ts = nanos_since_boot();
   if (rlog) {
     log_sentinel(this, SentinelType::END_OF_SEGMENT);
-    std::remove(lock_file.c_str());
+    log_writer_stats("rlog", *rlog);
+    log_writer_stats("qlog", *qlog);
   }
 
+  // only the first segment is prepared here, the others are ready unless the last rotation was very recent
+  std::unique_ptr<LogSegment> segment = next_segment.valid() ? next_segment.get() : prepareSegment(part + 1);
+  const uint64_t wait_ns = nanos_since_boot() - start_ts;
+
+  const std::string prev_segment_path = segment_path;
   segment_path = route_path + "--" + std::to_string(++part);
-  bool ret = util::create_directories(segment_path, 0775);
-  assert(ret == true);
+  int err = rename(segment->path.c_str(), segment_path.c_str());
+  assert(err == 0);
 
-  lock_file = segment_path + "/rlog.lock";
-  std::ofstream{lock_file};
+  // the previous segment is closed in the background, then the following one is prepared
+  if (rlog) {
+    auto prev = std::make_shared<LogSegment>(LogSegment{prev_segment_path, lock_file, std::move(rlog), std::move(qlog)});
+    runInBackground([prev]() { close_segment(prev.get()); });
+  }
+  auto promise = std::make_shared<std::promise<std::unique_ptr<LogSegment>>>();
+  next_segment = promise->get_future();
+  runInBackground([this, promise, next_part = part + 1]() { promise->set_value(prepareSegment(next_part)); });
 
-  rlog.reset(new ZstdFileWriter(segment_path + "/rlog.zst", LOG_COMPRESSION_LEVEL));
-  qlog.reset(new ZstdFileWriter(segment_path + "/qlog.zst", LOG_COMPRESSION_LEVEL));
+  lock_file = segment_path + "/rlog.lock";
+  rlog = std::move(segment->rlog);
+  qlog = std::move(segment->qlog);
 
   // log init data & sentinel type.
   write(init_data.asBytes(), true);
   log_sentinel(this, part > 0 ? SentinelType::START_OF_SEGMENT : SentinelType::START_OF_ROUTE);
+
+  const uint64_t stall_ns = nanos_since_boot() - start_ts;
+  if (part > 0) {
+    rotation_stalls.add(stall_ns);
+  }
+  LOGD("segment %d: rotation took %.2f ms, %.2f ms waiting for the segment", part, stall_ns / 1e6, wait_ns / 1e6);
+  return true;
+}
+
+// Reads logMonoTime and the union discriminant of an Event from the capnp wire layout, without a message reader.
+// Only the root struct of a single segment message is read, as serialized by MessageBuilder.
+static bool read_event_header(const uint8_t *data, size_t size, uint64_t &mono_time, int &service) {
+  static const uint32_t discriminant_offset =
+      capnp::Schema::from<cereal::Event>().getProto().getStruct().getDiscriminantOffset();
+
+  auto read_le = [data](size_t offset, auto value) {
+    memcpy(&value, data + offset, sizeof(value));
+    return value;
+  };
+  // segment table of a single segment, then the root struct pointer
+  if (size < 2 * sizeof(capnp::word) || read_le(0, uint32_t{}) != 0) return false;
+  const size_t segment_words = read_le(4, uint32_t{});
+  const uint64_t root = read_le(8, uint64_t{});
+  if ((segment_words + 1) * sizeof(capnp::word) > size || root == 0 || (root & 3) != 0) return false;
+
+  const int64_t start = 1 + ((int32_t)(uint32_t)root >> 2);
+  const size_t data_words = (root >> 32) & 0xffff;
+  const size_t pointer_words = root >> 48;
+  if (start < 1 || start + data_words + pointer_words > segment_words) return false;
+
+  // fields beyond the encoded data section hold their default value
+  const size_t data_offset = (1 + start) * sizeof(capnp::word);
+  const size_t data_bytes = data_words * sizeof(capnp::word);
+  mono_time = data_bytes >= sizeof(uint64_t) ? read_le(data_offset, uint64_t{}) : 0;
+  service = data_bytes >= (discriminant_offset + 1) * sizeof(uint16_t)
+                ? read_le(data_offset + discriminant_offset * sizeof(uint16_t), uint16_t{}) : 0;
   return true;
 }
 
 void LoggerState::write(uint8_t* data, size_t size, bool in_qlog) {
-  rlog->write(data, size);
-  if (in_qlog) qlog->write(data, size);
+  // the log index records the time range and services of each frame.
+  // other layouts are logged as is, their frame is indexed as holding any service.
+  uint64_t mono_time = 0;
+  int service = -1;
+  read_event_header(data, size, mono_time, service);
+
+  rlog->write(data, size, mono_time, service);
+  if (in_qlog) qlog->write(data, size, mono_time, service);
 }
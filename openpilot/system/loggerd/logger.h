@@ -1,8 +1,15 @@
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include "openpilot/cereal/messaging/messaging.h"
 #include "common/util.h"
@@ -10,26 +17,69 @@
 #include "system/loggerd/zstd_writer.h"
 
 constexpr int LOG_COMPRESSION_LEVEL = 10;
+// rlog and qlog compress harder when loggerd is idle, and faster when it falls behind.
+// They are seekable, made of independent frames of about 1 MB of messages.
+const ZstdWriterConfig LOG_COMPRESSION_CONFIG = {
+  .level = LOG_COMPRESSION_LEVEL,
+  .min_level = 3,
+  .max_level = 15,
+  .workers = 0,
+  .frame_size = 1024 * 1024,
+};
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
+// upper bounds of the stall histogram buckets, the last bucket holds longer stalls
+constexpr std::array<double, 7> STALL_BUCKETS_MS = {1, 2, 5, 10, 20, 50, 100};
+
+struct StallHistogram {
+  std::array<uint64_t, STALL_BUCKETS_MS.size() + 1> buckets = {};
+  uint64_t count = 0, total_ns = 0, max_ns = 0;
+
+  void add(uint64_t ns);
+  std::string toString() const;
+};
+
+// a segment directory with open logs
+struct LogSegment {
+  std::string path, lock_file;
+  std::unique_ptr<ZstdFileWriter> rlog, qlog;
+};
+
 class LoggerState {
 public:
   LoggerState(const std::string& log_root = Path::log_root());
   ~LoggerState();
+  // Starts the next segment. It is prepared on the background thread while the current one is written,
+  // and the current one is closed there after the switch.
   bool next();
+  // runs on the background thread after the tasks queued before it, e.g. closing the video files of the last segment
+  void runInBackground(std::function<void()> task);
   void write(uint8_t* data, size_t size, bool in_qlog);
   inline int segment() const { return part; }
   inline const std::string& segmentPath() const { return segment_path; }
   inline const std::string& routeName() const { return route_name; }
   inline void write(kj::ArrayPtr<kj::byte> bytes, bool in_qlog) { write(bytes.begin(), bytes.size(), in_qlog); }
   inline void setExitSignal(int signal) { exit_signal = signal; }
+  // time spent in next()
+  inline const StallHistogram& rotationStalls() const { return rotation_stalls; }
 
 protected:
+  std::unique_ptr<LogSegment> prepareSegment(int segment_part);
+  void backgroundThread();
+
   int part = -1, exit_signal = 0;
   std::string route_path, route_name, segment_path, lock_file;
   kj::Array<capnp::word> init_data;
   std::unique_ptr<ZstdFileWriter> rlog, qlog;
+  std::future<std::unique_ptr<LogSegment>> next_segment;
+  StallHistogram rotation_stalls;
+
+  std::mutex tasks_lock;
+  std::condition_variable tasks_cv;
+  std::deque<std::function<void()>> tasks;
+  bool exit_background = false;
+  std::thread background_thread;
 };
 
 kj::Array<capnp::word> logger_build_init_data(bool route_log = false);
@@ -19,6 +19,7 @@ struct LoggerdState {
   std::atomic<int> ready_to_rotate{0};  // count of encoders ready to rotate
   int max_waiting = 0;
   double last_rotate_tms = 0.;      // last rotate time in ms
+  StallHistogram writer_stalls;     // time to switch a video file at rotation
 };
 
 void logger_rotate(LoggerdState *s) {
@@ -53,6 +54,24 @@ void rotate_if_needed(LoggerdState *s) {
   }
 }
 
+kj::ArrayPtr<capnp::byte> IdxEventBuilder::build(cereal::Event::Reader event, cereal::EncodeIndex::Reader idx,
+                                                  void (cereal::Event::Builder::*set_encode_idx_func)(::cereal::EncodeIndex::Reader)) {
+  capnp::MallocMessageBuilder bmsg(kj::arrayPtr(segment_.data(), segment_.size()));
+  auto evt = bmsg.initRoot<cereal::Event>();
+  evt.setValid(event.getValid());
+  evt.setLogMonoTime(event.getLogMonoTime());
+  (evt.*set_encode_idx_func)(idx);
+
+  const size_t words = capnp::computeSerializedSizeInWords(bmsg);
+  if (buffer_.size() < words) {
+    buffer_.resize(words);
+  }
+  auto bytes = kj::arrayPtr((capnp::byte *)buffer_.data(), words * sizeof(capnp::word));
+  kj::ArrayOutputStream out(bytes);
+  capnp::writeMessage(out, bmsg);
+  return bytes;
+}
+
 struct RemoteEncoder {
   std::unique_ptr<VideoWriter> writer;
   int encoderd_segment_offset;
@@ -63,6 +82,7 @@ struct RemoteEncoder {
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
   bool audio_initialized = false;
+  IdxEventBuilder idx_builder;
 };
 
 size_t write_encode_data(LoggerdState *s, cereal::Event::Reader event, RemoteEncoder &re, const EncoderInfo &encoder_info) {
@@ -102,14 +122,10 @@ size_t write_encode_data(LoggerdState *s, cereal::Event::Reader event, RemoteEnc
     re.writer->write((uint8_t *)data.begin(), data.size(), idx.getTimestampEof() / 1000, false, flags & V4L2_BUF_FLAG_KEYFRAME);
   }
 
-  // put it in log stream as the idx packet
-  MessageBuilder bmsg;
-  auto evt = bmsg.initEvent(event.getValid());
-  evt.setLogMonoTime(event.getLogMonoTime());
-  (evt.*(encoder_info.set_encode_idx_func))(idx);
-  auto new_msg = bmsg.toBytes();
-  s->logger.write((uint8_t *)new_msg.begin(), new_msg.size(), true);  // always in qlog?
-  return new_msg.size();
+  // put it in log stream as the idx packet.
+  auto bytes = re.idx_builder.build(event, idx, encoder_info.set_encode_idx_func);
+  s->logger.write(bytes, true);  // always in qlog?
+  return bytes.size();
 }
 
 int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
@@ -138,9 +154,16 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
       // if we aren't actually recording, don't create the writer
       if (encoder_info.record) {
         assert(encoder_info.filename != NULL);
+        const uint64_t start_ts = nanos_since_boot();
+        // the last segment's file is finished in the background
+        if (re.writer) {
+          std::shared_ptr<VideoWriter> prev = std::move(re.writer);
+          s->logger.runInBackground([prev]() mutable { prev.reset(); });
+        }
         re.writer.reset(new VideoWriter(s->logger.segmentPath().c_str(),
                                         encoder_info.filename, idx.getType() != cereal::EncodeIndex::Type::FULL_H_E_V_C,
                                         edata.getWidth(), edata.getHeight(), encoder_info.fps, idx.getType()));
+        s->writer_stalls.add(nanos_since_boot() - start_ts);
         re.recording = false;
         re.audio_initialized = false;
       }
@@ -218,7 +241,20 @@ void handle_preserve_segment(LoggerdState *s) {
   prev_segment = s->logger.segment();
 }
 
-void loggerd_thread() {
+void log_drain_stats(const DrainScheduler &scheduler, bool all) {
+  for (const auto &stats : scheduler.stats()) {
+    // a socket that keeps running out of budget receives faster than its share of the drain loop
+    if (stats.deferredRatio() > 0.5) {
+      LOGW_100("%s: over budget in %.0f%% of %" PRIu64 " rounds", stats.name.c_str(), stats.deferredRatio() * 100, stats.rounds);
+    }
+    if (all) {
+      LOGD("%s: %" PRIu64 " messages, %" PRIu64 " bytes, %" PRIu64 " rounds (%" PRIu64 " over budget), max %zu of %zu bytes per round",
+           stats.name.c_str(), stats.messages, stats.bytes, stats.rounds, stats.deferred, stats.max_round_bytes, stats.budget_bytes);
+    }
+  }
+}
+
+void loggerd_thread(LoggerdStats *stats) {
   // setup messaging
   struct ServiceState {
     std::string name;
@@ -230,6 +266,7 @@ void loggerd_thread() {
 
   std::unique_ptr<Context> ctx(Context::create());
   std::unique_ptr<Poller> poller(Poller::create());
+  DrainScheduler scheduler;
 
   // subscribe to all socks
   for (const auto& [_, it] : services) {
@@ -242,6 +279,7 @@ void loggerd_thread() {
       SubSocket * sock = SubSocket::create(ctx.get(), it.name, "127.0.0.1", false, true, it.queue_size);
       assert(sock != NULL);
       poller->registerSocket(sock);
+      scheduler.addSocket(sock, it.name, it.frequency, it.queue_size);
       service_state[sock] = {
         .name = it.name,
         .counter = 0,
@@ -275,58 +313,48 @@ void loggerd_thread() {
 
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
-  while (!do_exit) {
-    // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
-      if (do_exit) break;
-
-      ServiceState &service = service_state[sock];
-      if (service.preserve_segment) {
-        handle_preserve_segment(&s);
-      }
-
-      // drain socket
-      int count = 0;
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
-
-        if (service.record_audio) {
-          capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
-          auto event = cmsg.getRoot<cereal::Event>();
-          auto audio_data = event.getRawAudioData().getData();
-          auto sample_rate = event.getRawAudioData().getSampleRate();
-          for (auto* encoder : encoders_with_audio) {
-            if (encoder && encoder->writer) {
-              encoder->writer->write_audio((uint8_t*)audio_data.begin(), audio_data.size(), event.getLogMonoTime() / 1000, sample_rate);
-              encoder->audio_initialized = true;
-            }
-          }
-        }
+  auto handle_msg = [&](SubSocket *sock, Message *msg) {
+    ServiceState &service = service_state[sock];
+    if (service.preserve_segment) {
+      handle_preserve_segment(&s);
+    }
 
-        if (service.encoder) {
-          s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
-        } else {
-          s.logger.write((uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-          bytes_count += msg->getSize();
-          delete msg;
+    const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
+
+    if (service.record_audio) {
+      capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
+      auto event = cmsg.getRoot<cereal::Event>();
+      auto audio_data = event.getRawAudioData().getData();
+      auto sample_rate = event.getRawAudioData().getSampleRate();
+      for (auto* encoder : encoders_with_audio) {
+        if (encoder && encoder->writer) {
+          encoder->writer->write_audio((uint8_t*)audio_data.begin(), audio_data.size(), event.getLogMonoTime() / 1000, sample_rate);
+          encoder->audio_initialized = true;
         }
+      }
+    }
 
-        rotate_if_needed(&s);
+    if (service.encoder) {
+      s.last_camera_seen_tms = millis_since_boot();
+      bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
+    } else {
+      s.logger.write((uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+      bytes_count += msg->getSize();
+      delete msg;
+    }
 
-        if ((++msg_count % 10000) == 0) {
-          double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%" PRIu64 " messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
-        }
+    rotate_if_needed(&s);
 
-        count++;
-        if (count >= 200) {
-          LOGD("large volume of '%s' messages", service.name.c_str());
-          break;
-        }
-      }
+    if ((++msg_count % 10000) == 0) {
+      double seconds = (millis_since_boot() - start_ts) / 1000.0;
+      LOGD("%" PRIu64 " messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+      log_drain_stats(scheduler, false);
     }
+  };
+
+  // ready sockets are drained in turns, within per service budgets
+  while (!do_exit) {
+    scheduler.drain(poller.get(), 1000, handle_msg, []() { return (bool)do_exit; });
   }
 
   LOGW("closing logger");
@@ -338,21 +366,14 @@ void loggerd_thread() {
     LOGE("sync done");
   }
 
-  // messaging cleanup
-  for (auto &[sock, service] : service_state) delete sock;
-}
-
-int main(int argc, char** argv) {
-  if (!Hardware::PC()) {
-    int ret;
-    ret = util::set_core_affinity({0, 1, 2, 3});
-    assert(ret == 0);
-    // TODO: why does this impact camerad timings?
-    //ret = util::set_realtime_priority(1);
-    //assert(ret == 0);
+  log_drain_stats(scheduler, true);
+  LOGW("video file switch stalls: %s", s.writer_stalls.toString().c_str());
+  if (stats) {
+    stats->sockets = scheduler.stats();
+    stats->rotation_stalls = s.logger.rotationStalls();
+    stats->writer_stalls = s.writer_stalls;
   }
 
-  loggerd_thread();
-
-  return 0;
+  // messaging cleanup
+  for (auto &[sock, service] : service_state) delete sock;
 }
@@ -12,6 +12,7 @@
 #include "common/swaglog.h"
 #include "common/util.h"
 
+#include "system/loggerd/drain_scheduler.h"
 #include "system/loggerd/logger.h"
 
 constexpr int MAIN_FPS = 20;
@@ -197,3 +198,29 @@ const LogCameraInfo stream_cabin_camera_info{
 
 const LogCameraInfo cameras_logged[] = {narrow_road_camera_info, wide_road_camera_info, cabin_camera_info};
 const LogCameraInfo stream_cameras_logged[] = {stream_road_camera_info, stream_wide_road_camera_info, stream_cabin_camera_info};
+
+extern ExitHandler do_exit;
+
+// Builds the idx events of encoded packets in buffers that are reused for every packet
+class IdxEventBuilder {
+public:
+  // the serialized event, valid until the next call
+  kj::ArrayPtr<capnp::byte> build(cereal::Event::Reader event, cereal::EncodeIndex::Reader idx,
+                                  void (cereal::Event::Builder::*set_encode_idx_func)(::cereal::EncodeIndex::Reader));
+
+private:
+  static constexpr size_t SEGMENT_WORDS = 128;  // more than an idx event needs
+  // the builder zeroes its first segment again when it's destroyed, so the segment can be reused
+  std::vector<capnp::word> segment_ = std::vector<capnp::word>(SEGMENT_WORDS);
+  std::vector<capnp::word> buffer_;
+};
+
+// what loggerd_thread measured, for benchmarks
+struct LoggerdStats {
+  std::vector<DrainScheduler::SocketStats> sockets;
+  StallHistogram rotation_stalls;  // LoggerState::next()
+  StallHistogram writer_stalls;    // video file switches
+};
+
+// logs until do_exit is set
+void loggerd_thread(LoggerdStats *stats = nullptr);
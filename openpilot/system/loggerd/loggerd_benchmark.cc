@@ -0,0 +1,537 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <capnp/dynamic.h>
+
+#include "common/timing.h"
+#include "json11/json11.hpp"
+#include "system/loggerd/encoder/encoder.h"
+#include "system/loggerd/loggerd.h"
+
+// Runs loggerd_thread against fake publishers and encoder streams, then reads back the logs it wrote.
+// It measures the ingest rate loggerd sustains for a service mix, so changes to the logger can be
+// compared on a dev box.
+
+const std::string helpText =
+R"(Usage: loggerd_benchmark [options] <log root>
+Logs to a new directory in <log root>, e.g. on a tmpfs like /dev/shm or on the disk under test
+Options:
+  -d, --duration        Seconds to publish. Default is 30
+  -r, --rate            Multiplier for all publish rates. Default is 1
+  -s, --services        Services to publish as name[:hz], comma-separated. The rate defaults to the service frequency
+                        Default is every logged service with a frequency
+  -e, --encoders        Encoder streams to publish, comma-separated
+                        Default is narrowRoadEncodeData,wideRoadEncodeData,cabinEncodeData,qNarrowRoadEncodeData
+  -l, --segment-length  Seconds of video per segment. Default is 10
+  -n, --list-size       Elements in each list of the synthetic messages. Default is 8
+      --json            Write the results as JSON to <file>, or - for stdout
+      --keep            Keep the logs and params
+  -h, --help            Show this help message
+)";
+
+const double DRAIN_SECONDS = 1.0;  // for loggerd to catch up after publishing stops
+const int MAX_FILL_DEPTH = 4;      // nested structs of the synthetic messages
+
+struct BenchmarkConfig {
+  std::string log_root;
+  double duration = 30;
+  double rate = 1;
+  std::vector<std::pair<std::string, double>> services;
+  std::vector<std::string> encoders = {"narrowRoadEncodeData", "wideRoadEncodeData", "cabinEncodeData", "qNarrowRoadEncodeData"};
+  int segment_length = 10;
+  int list_size = 8;
+  std::string json;
+  bool keep = false;
+};
+
+std::vector<std::string> split(const std::string &source, char delimiter) {
+  std::vector<std::string> fields;
+  std::stringstream ss(source);
+  std::string field;
+  while (std::getline(ss, field, delimiter)) {
+    if (!field.empty()) fields.push_back(field);
+  }
+  return fields;
+}
+
+bool parseArgs(int argc, char *argv[], BenchmarkConfig &config) {
+  const struct option cli_options[] = {
+      {"duration", required_argument, nullptr, 'd'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"services", required_argument, nullptr, 's'},
+      {"encoders", required_argument, nullptr, 'e'},
+      {"segment-length", required_argument, nullptr, 'l'},
+      {"list-size", required_argument, nullptr, 'n'},
+      {"json", required_argument, nullptr, 0},
+      {"keep", no_argument, nullptr, 0},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  std::string service_list;
+  int opt, option_index = 0;
+  while ((opt = getopt_long(argc, argv, "d:r:s:e:l:n:h", cli_options, &option_index)) != -1) {
+    switch (opt) {
+      case 'd': config.duration = std::max(1.0, std::atof(optarg)); break;
+      case 'r': config.rate = std::atof(optarg); break;
+      case 's': service_list = optarg; break;
+      case 'e': config.encoders = split(optarg, ','); break;
+      case 'l': config.segment_length = std::max(1, std::atoi(optarg)); break;
+      case 'n': config.list_size = std::max(0, std::atoi(optarg)); break;
+      case 0: {
+        std::string name = cli_options[option_index].name;
+        if (name == "json") config.json = optarg;
+        else if (name == "keep") config.keep = true;
+        break;
+      }
+      case 'h': std::cout << helpText; return false;
+      default: return false;
+    }
+  }
+  if (optind >= argc || config.rate <= 0) {
+    std::cout << helpText;
+    return false;
+  }
+  config.log_root = argv[optind];
+
+  const auto event_schema = capnp::Schema::from<cereal::Event>();
+  auto is_event = [&](const std::string &name) {
+    for (auto field : event_schema.getUnionFields()) {
+      if (field.getProto().getName() == name.c_str()) return field.getType().isStruct() || field.getType().isList();
+    }
+    return false;
+  };
+
+  if (service_list.empty()) {
+    for (const auto &[name, service] : services) {
+      if (service.should_log && service.frequency > 0 && !util::ends_with(name, "EncodeData") && is_event(name)) {
+        config.services.emplace_back(name, service.frequency);
+      }
+    }
+  }
+  for (const auto &item : split(service_list, ',')) {
+    auto fields = split(item, ':');
+    const std::string &name = fields[0];
+    auto it = services.find(name);
+    double hz = fields.size() > 1 ? std::atof(fields[1].c_str()) : (it != services.end() ? it->second.frequency : 0);
+    if (it == services.end() || hz <= 0 || !is_event(name)) {
+      std::cerr << "unknown service or rate: " << item << "\n";
+      return false;
+    }
+    config.services.emplace_back(name, hz);
+  }
+  for (const auto &name : config.encoders) {
+    if (!util::ends_with(name, "EncodeData") || services.count(name) == 0 || !is_event(name)) {
+      std::cerr << "unknown encoder stream: " << name << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Fills a message with values like the ones sensors and models produce. Floats are random,
+// so the logs don't compress much better than real ones.
+class EventFiller {
+public:
+  EventFiller(int list_size, uint32_t seed) : list_size_(list_size), rng_(seed), data_(64) {}
+
+  void fill(cereal::Event::Builder event, const std::string &name) {
+    capnp::DynamicStruct::Builder dynamic_event = event;
+    auto field = dynamic_event.getSchema().getFieldByName(name);
+    if (field.getType().isList()) {
+      fillList(dynamic_event.init(field, list_size_).as<capnp::DynamicList>(), 0);
+    } else {
+      fillStruct(dynamic_event.init(field).as<capnp::DynamicStruct>(), 0);
+    }
+  }
+
+private:
+  void fillStruct(capnp::DynamicStruct::Builder builder, int depth) {
+    for (auto field : builder.getSchema().getNonUnionFields()) {
+      fillField(builder, field, depth);
+    }
+    // a union holds its first member
+    auto union_fields = builder.getSchema().getUnionFields();
+    if (union_fields.size() > 0) {
+      fillField(builder, union_fields[0], depth);
+    }
+  }
+
+  void fillField(capnp::DynamicStruct::Builder builder, capnp::StructSchema::Field field, int depth) {
+    if (util::ends_with(field.getProto().getName().cStr(), "DEPRECATED")) return;
+
+    auto type = field.getType();
+    if (type.isStruct()) {
+      if (depth < MAX_FILL_DEPTH) fillStruct(builder.init(field).as<capnp::DynamicStruct>(), depth + 1);
+    } else if (type.isList()) {
+      if (depth < MAX_FILL_DEPTH) fillList(builder.init(field, list_size_).as<capnp::DynamicList>(), depth + 1);
+    } else if (isValue(type)) {
+      builder.set(field, value(type));
+    }
+  }
+
+  void fillList(capnp::DynamicList::Builder list, int depth) {
+    auto type = list.getSchema().getElementType();
+    for (uint32_t i = 0; i < list.size(); ++i) {
+      if (type.isStruct()) {
+        fillStruct(list[i].as<capnp::DynamicStruct>(), depth);
+      } else if (isValue(type)) {
+        list.set(i, value(type));
+      }
+    }
+  }
+
+  static bool isValue(capnp::Type type) {
+    return !type.isStruct() && !type.isList() && !type.isEnum() && !type.isInterface() &&
+           !type.isAnyPointer() && !type.isVoid();
+  }
+
+  capnp::DynamicValue::Reader value(capnp::Type type) {
+    if (type.isBool()) return rng_() % 8 == 0;
+    if (type.isFloat32() || type.isFloat64()) return std::uniform_real_distribution<double>(-100, 100)(rng_);
+    if (type.isText()) return capnp::Text::Reader("synthetic");
+    if (type.isData()) {
+      for (auto &b : data_) b = rng_();
+      return capnp::Data::Reader(data_.data(), data_.size());
+    }
+    return (int64_t)(rng_() % 100);  // in range of all integer types
+  }
+
+  const int list_size_;
+  std::mt19937 rng_;
+  std::vector<uint8_t> data_;
+};
+
+struct PublishStats {
+  std::map<std::string, uint64_t> published;  // by Event member, the idx member for encoder streams
+  uint64_t max_lag_ns = 0;                    // behind schedule, the publishers can't keep up when this grows
+  uint64_t cpu_ns = 0;                        // spent in the publisher threads
+};
+
+uint64_t thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t ts) {
+  const uint64_t now = nanos_since_boot();
+  if (ts > now) std::this_thread::sleep_for(std::chrono::nanoseconds(ts - now));
+}
+
+// publishes all services from one thread, each at its rate
+void publishServices(Context *ctx, const BenchmarkConfig &config, uint64_t end_ts, PublishStats &stats) {
+  std::vector<std::unique_ptr<PubSocket>> sockets;
+  std::vector<uint64_t> intervals;
+  using Next = std::pair<uint64_t, size_t>;  // (publish time, service)
+  std::priority_queue<Next, std::vector<Next>, std::greater<Next>> schedule;
+  const uint64_t start_ts = nanos_since_boot();
+  for (const auto &[name, hz] : config.services) {
+    sockets.emplace_back(PubSocket::create(ctx, name, true, services.at(name).queue_size));
+    assert(sockets.back());
+    intervals.push_back(1e9 / (hz * config.rate));
+    schedule.push({start_ts + intervals.back() * (schedule.size() % 10) / 10, sockets.size() - 1});
+  }
+
+  EventFiller filler(config.list_size, 1);
+  std::vector<uint64_t> counts(sockets.size());
+  while (!do_exit && !schedule.empty()) {
+    auto [ts, i] = schedule.top();
+    if (ts >= end_ts) break;
+    schedule.pop();
+    sleep_until(ts);
+
+    MessageBuilder msg;
+    filler.fill(msg.initEvent(), config.services[i].first);
+    auto bytes = msg.toBytes();
+    sockets[i]->send((char *)bytes.begin(), bytes.size());
+    ++counts[i];
+    stats.max_lag_ns = std::max(stats.max_lag_ns, nanos_since_boot() - ts);
+    schedule.push({ts + intervals[i], i});
+  }
+
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    stats.published[config.services[i].first] += counts[i];
+  }
+  stats.cpu_ns = thread_cpu_ns();
+}
+
+// publishes packets like encoderd, rolling over to the next segment every segment_length seconds
+void publishEncoder(Context *ctx, const BenchmarkConfig &config, const std::string &name, uint64_t end_ts, PublishStats &stats) {
+  const bool qcam = name == "qNarrowRoadEncodeData";
+  const auto settings = qcam ? EncoderSettings::QcamEncoderSettings() : EncoderSettings::MainEncoderSettings(1928);
+  // main streams are written as they come on device, qcamera is remuxed into a .ts file
+  const auto type = qcam ? cereal::EncodeIndex::Type::QCAMERA_H264 : cereal::EncodeIndex::Type::FULL_H_E_V_C;
+  const int width = qcam ? qcam_encoder_info.frame_width : 1928;
+  const int height = qcam ? qcam_encoder_info.frame_height : 1208;
+  const int frames_per_segment = config.segment_length * MAIN_FPS;
+  const size_t packet_size = settings.bitrate / 8 / MAIN_FPS;
+
+  std::unique_ptr<PubSocket> sock(PubSocket::create(ctx, name, true, services.at(name).queue_size));
+  assert(sock);
+
+  // compressed video doesn't compress further, the packets are random bytes behind an Annex B start code
+  std::mt19937 rng(std::hash<std::string>{}(name));
+  std::vector<uint8_t> pool(packet_size * 4);
+  for (auto &b : pool) b = rng();
+  const uint8_t header[] = {0, 0, 0, 1, 0x67, 0x42, 0, 0x1f};
+
+  const uint64_t interval = 1e9 / (MAIN_FPS * config.rate);
+  const uint64_t start_ts = nanos_since_boot();
+  uint32_t frame_id = 0;
+  for (uint64_t ts = start_ts; ts < end_ts && !do_exit; ts += interval, ++frame_id) {
+    sleep_until(ts);
+
+    const bool keyframe = frame_id % settings.gop_size == 0;
+    uint8_t *data = pool.data() + (frame_id % (pool.size() - packet_size));
+    data[0] = data[1] = data[2] = 0;
+    data[3] = 1;
+    data[4] = keyframe ? 0x65 : 0x41;
+
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    capnp::DynamicStruct::Builder dynamic_event = event;
+    auto edata = dynamic_event.init(name).as<cereal::EncodeData>();
+    auto idx = edata.initIdx();
+    idx.setFrameId(frame_id);
+    idx.setEncodeId(frame_id);
+    idx.setType(type);
+    idx.setSegmentNum(frame_id / frames_per_segment);
+    idx.setSegmentId(frame_id % frames_per_segment);
+    idx.setFlags(keyframe ? V4L2_BUF_FLAG_KEYFRAME : 0);
+    idx.setTimestampSof(ts);
+    idx.setTimestampEof(ts);
+    idx.setLen(packet_size);
+    edata.setData(kj::arrayPtr(data, packet_size));
+    if (keyframe) edata.setHeader(kj::arrayPtr(header, sizeof(header)));
+    edata.setWidth(width);
+    edata.setHeight(height);
+
+    auto bytes = msg.toBytes();
+    sock->send((char *)bytes.begin(), bytes.size());
+    stats.max_lag_ns = std::max(stats.max_lag_ns, nanos_since_boot() - ts);
+  }
+
+  stats.published[name.substr(0, name.size() - strlen("Data")) + "Idx"] += frame_id;
+  stats.cpu_ns = thread_cpu_ns();
+}
+
+std::vector<std::string> listDir(const std::string &path) {
+  std::vector<std::string> names;
+  if (DIR *dir = opendir(path.c_str())) {
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+  }
+  return names;
+}
+
+struct LogStats {
+  uint64_t raw_bytes = 0, compressed_bytes = 0;
+  double ratio() const { return compressed_bytes > 0 ? (double)raw_bytes / compressed_bytes : 0; }
+};
+
+// decompresses a log and counts its messages by Event member
+LogStats readLog(const std::string &file, std::map<std::string, uint64_t> *logged) {
+  LogStats stats;
+  const std::string compressed = util::read_file(file);
+  const std::string raw = zstd_decompress(compressed);
+  stats.compressed_bytes = compressed.size();
+  stats.raw_bytes = raw.size();
+  if (!logged) return stats;
+
+  auto words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), words.size() * sizeof(capnp::word));
+  static std::map<uint16_t, std::string> member_names;
+  if (member_names.empty()) {
+    for (auto field : capnp::Schema::from<cereal::Event>().getUnionFields()) {
+      member_names[field.getProto().getDiscriminantValue()] = field.getProto().getName();
+    }
+  }
+
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  try {
+    while (remaining.size() > 0) {
+      capnp::FlatArrayMessageReader reader(remaining);
+      ++(*logged)[member_names[(uint16_t)reader.getRoot<cereal::Event>().which()]];
+      remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+    }
+  } catch (const kj::Exception &e) {
+    std::cerr << file << ": " << e.getDescription().cStr() << "\n";
+  }
+  return stats;
+}
+
+json11::Json histogramJson(const StallHistogram &histogram) {
+  json11::Json::object buckets;
+  for (size_t i = 0; i < histogram.buckets.size(); ++i) {
+    const std::string label = i < STALL_BUCKETS_MS.size() ? util::string_format("<%g", STALL_BUCKETS_MS[i])
+                                                          : util::string_format(">=%g", STALL_BUCKETS_MS.back());
+    buckets[label] = (double)histogram.buckets[i];
+  }
+  return json11::Json::object{
+    {"count", (double)histogram.count},
+    {"mean_ms", histogram.count > 0 ? histogram.total_ns / 1e6 / histogram.count : 0.0},
+    {"max_ms", histogram.max_ns / 1e6},
+    {"buckets_ms", buckets},
+  };
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkConfig config;
+  if (!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  // like OpenpilotPrefix, the benchmark gets its own params and sockets, so it can run next to openpilot
+  std::string work_dir = config.log_root + "/loggerd_benchmark_XXXXXX";
+  if (!util::create_directories(config.log_root, 0775) || !mkdtemp(work_dir.data())) {
+    std::cerr << "failed to create a directory in " << config.log_root << "\n";
+    return 1;
+  }
+  const std::string prefix = work_dir.substr(work_dir.rfind('/') + 1);
+  const std::string msgq_path = Path::shm_path() + "/msgq_" + prefix;
+  const std::string log_root = work_dir + "/realdata";
+  if (!util::create_directories(msgq_path, 0775) || !util::create_directories(log_root, 0775)) {
+    std::cerr << "failed to create " << msgq_path << " and " << log_root << "\n";
+    return 1;
+  }
+  setenv("OPENPILOT_PREFIX", prefix.c_str(), 1);
+  setenv("PARAMS_ROOT", (work_dir + "/params").c_str(), 1);
+  setenv("LOG_ROOT", log_root.c_str(), 1);
+
+  LoggerdStats loggerd_stats;
+  std::thread loggerd(loggerd_thread, &loggerd_stats);
+  // loggerd subscribes before it creates the first segment
+  while (listDir(log_root).empty() && !do_exit) {
+    util::sleep_for(10);
+  }
+
+  std::unique_ptr<Context> ctx(Context::create());
+  const uint64_t start_ts = nanos_since_boot();
+  const uint64_t end_ts = start_ts + config.duration * 1e9;
+  std::vector<PublishStats> publish_stats(config.encoders.size() + 1);
+  std::vector<std::thread> publishers;
+  publishers.emplace_back(publishServices, ctx.get(), std::cref(config), end_ts, std::ref(publish_stats[0]));
+  for (size_t i = 0; i < config.encoders.size(); ++i) {
+    publishers.emplace_back(publishEncoder, ctx.get(), std::cref(config), std::cref(config.encoders[i]), end_ts,
+                            std::ref(publish_stats[i + 1]));
+  }
+  for (auto &t : publishers) t.join();
+  const double seconds = (nanos_since_boot() - start_ts) / 1e9;
+
+  util::sleep_for(DRAIN_SECONDS * 1000);
+  do_exit = true;
+  loggerd.join();
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  uint64_t cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+                    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+  std::map<std::string, uint64_t> published;
+  uint64_t max_lag_ns = 0;
+  for (const auto &stats : publish_stats) {
+    cpu_ns -= std::min(cpu_ns, stats.cpu_ns);
+    max_lag_ns = std::max(max_lag_ns, stats.max_lag_ns);
+    for (const auto &[name, count] : stats.published) published[name] += count;
+  }
+
+  // read back the segments
+  const std::string route = Params().get("CurrentRoute");
+  std::map<std::string, uint64_t> logged;
+  LogStats rlog, qlog;
+  int segments = 0;
+  for (; util::file_exists(log_root + "/" + route + "--" + std::to_string(segments) + "/rlog.zst"); ++segments) {
+    const std::string segment_path = log_root + "/" + route + "--" + std::to_string(segments);
+    LogStats r = readLog(segment_path + "/rlog.zst", &logged);
+    LogStats q = readLog(segment_path + "/qlog.zst", nullptr);
+    rlog.raw_bytes += r.raw_bytes;
+    rlog.compressed_bytes += r.compressed_bytes;
+    qlog.raw_bytes += q.raw_bytes;
+    qlog.compressed_bytes += q.compressed_bytes;
+  }
+
+  uint64_t messages = 0, bytes = 0;
+  json11::Json::object budget_use;
+  for (const auto &s : loggerd_stats.sockets) {
+    messages += s.messages;
+    bytes += s.bytes;
+    if (s.messages > 0) budget_use[s.name] = s.maxBudgetUse();
+  }
+  uint64_t total_published = 0, total_dropped = 0;
+  json11::Json::object drops;
+  for (const auto &[name, count] : published) {
+    const uint64_t dropped = count - std::min(count, logged[name]);
+    total_published += count;
+    total_dropped += dropped;
+    if (dropped > 0) drops[name] = (double)dropped;
+  }
+
+  printf("%d segments, %.1f s, %.2fx rates\n", segments, seconds, config.rate);
+  printf("ingest: %" PRIu64 " messages, %.0f msg/s, %.2f MB/s\n", messages, messages / seconds, bytes / seconds / 1e6);
+  printf("dropped: %" PRIu64 " of %" PRIu64 " published\n", total_dropped, total_published);
+  for (const auto &[name, dropped] : drops) {
+    printf("  %s: %.0f\n", name.c_str(), dropped.number_value());
+  }
+  printf("rotation stalls: %s\n", loggerd_stats.rotation_stalls.toString().c_str());
+  printf("video file switch stalls: %s\n", loggerd_stats.writer_stalls.toString().c_str());
+  printf("loggerd cpu: %.2f s, %.0f%% of a core\n", cpu_ns / 1e9, cpu_ns / 1e7 / (seconds + DRAIN_SECONDS));
+  printf("compression: rlog %.2fx (%.1f MB), qlog %.2fx (%.1f MB)\n", rlog.ratio(), rlog.compressed_bytes / 1e6,
+         qlog.ratio(), qlog.compressed_bytes / 1e6);
+  printf("publishers max lag: %.2f ms\n", max_lag_ns / 1e6);
+
+  int ret = 0;
+  if (!config.json.empty()) {
+    json11::Json result = json11::Json::object{
+      {"segments", segments},
+      {"seconds", seconds},
+      {"rate", config.rate},
+      {"messages", (double)messages},
+      {"messages_per_second", messages / seconds},
+      {"bytes_per_second", bytes / seconds},
+      {"published", (double)total_published},
+      {"dropped", (double)total_dropped},
+      {"drops", drops},
+      {"max_budget_use", budget_use},
+      {"rotation_stalls", histogramJson(loggerd_stats.rotation_stalls)},
+      {"video_file_switch_stalls", histogramJson(loggerd_stats.writer_stalls)},
+      {"cpu_seconds", cpu_ns / 1e9},
+      {"rlog_compression_ratio", rlog.ratio()},
+      {"qlog_compression_ratio", qlog.ratio()},
+      {"publisher_max_lag_ms", max_lag_ns / 1e6},
+    };
+    const std::string output = result.dump() + "\n";
+    if (config.json == "-") {
+      std::cout << output;
+    } else if (util::write_file(config.json.c_str(), output.data(), output.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+      std::cerr << "failed to write " << config.json << "\n";
+      ret = 1;
+    }
+  }
+
+  std::filesystem::remove_all(msgq_path);
+  if (!config.keep) {
+    std::filesystem::remove_all(work_dir);
+  }
+  return ret;
+}
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/tests/native_test.h"
+#include "system/loggerd/drain_scheduler.h"
+
+namespace {
+
+class FakeMessage : public Message {
+public:
+  explicit FakeMessage(size_t size) : data_(size) {}
+  void init(size_t size) override { data_.resize(size); }
+  void init(char *data, size_t size) override { data_.assign(data, data + size); }
+  void close() override { data_.clear(); }
+  size_t getSize() override { return data_.size(); }
+  char *getData() override { return data_.data(); }
+
+private:
+  std::vector<char> data_;
+};
+
+// Hands out queued messages of the given sizes
+class FakeSubSocket : public SubSocket {
+public:
+  int connect(Context *, std::string, std::string, bool, bool, size_t) override { return 0; }
+  void setTimeout(int) override {}
+  void *getRawSocket() override { return nullptr; }
+  Message *receive(bool) override {
+    if (queue.empty()) return nullptr;
+    auto msg = new FakeMessage(queue.front());
+    queue.pop_front();
+    return msg;
+  }
+  void push(size_t size, int count = 1) { queue.insert(queue.end(), count, size); }
+
+  std::deque<size_t> queue;
+};
+
+class FakePoller : public Poller {
+public:
+  void registerSocket(SubSocket *sock) override { sockets.push_back((FakeSubSocket *)sock); }
+  std::vector<SubSocket *> poll(int) override {
+    std::vector<SubSocket *> ready;
+    for (auto sock : sockets) {
+      if (!sock->queue.empty()) ready.push_back(sock);
+    }
+    return ready;
+  }
+
+  std::vector<FakeSubSocket *> sockets;
+};
+
+struct Harness {
+  Harness(size_t count) : sockets(count) {
+    for (auto &sock : sockets) poller.registerSocket(&sock);
+  }
+  // drains everything and returns the index of the socket of each handled message
+  std::vector<int> drain() {
+    std::vector<int> order;
+    scheduler.drain(&poller, 0, [&](SubSocket *sock, Message *msg) {
+      order.push_back((FakeSubSocket *)sock - sockets.data());
+      delete msg;
+    }, []() { return false; });
+    return order;
+  }
+  DrainScheduler::SocketStats stats(const std::string &name) const {
+    for (const auto &s : scheduler.stats()) {
+      if (s.name == name) return s;
+    }
+    throw std::runtime_error("no stats for " + name);
+  }
+
+  std::vector<FakeSubSocket> sockets;
+  FakePoller poller;
+  DrainScheduler scheduler;
+};
+
+// lengths of the runs of messages from one socket
+std::vector<int> runs(const std::vector<int> &order, int socket) {
+  std::vector<int> result;
+  for (size_t i = 0; i < order.size(); ++i) {
+    if (order[i] == socket && (i == 0 || order[i - 1] != socket)) result.push_back(0);
+    if (order[i] == socket) ++result.back();
+  }
+  return result;
+}
+
+void test_budget_fairness() {
+  Harness h(2);
+  // 100 Hz gets 10 messages per round, 1 Hz the minimum of DRAIN_MIN_MESSAGES
+  h.scheduler.addSocket(&h.sockets[0], "busy", 100, 10 * 1024 * 1024);
+  h.scheduler.addSocket(&h.sockets[1], "quiet", 1, 1024 * 1024);
+  h.sockets[0].push(100, 1000);
+  h.sockets[1].push(100, 5);
+
+  auto order = h.drain();
+  REQUIRE(order.size() == 1005);
+  // the quiet socket is served after one round of the busy one, not after its whole backlog
+  auto last_quiet = std::find(order.rbegin(), order.rend(), 1);
+  CHECK(order.rend() - last_quiet == 15);
+  CHECK(runs(order, 0).front() == 10);
+
+  auto busy = h.stats("busy");
+  CHECK(busy.messages == 1000);
+  CHECK(busy.bytes == 100000);
+  CHECK(busy.rounds == 101);  // the last round finds the socket empty
+  CHECK(busy.deferred == 100);
+  CHECK(busy.max_round_bytes == 1000);
+  CHECK(busy.budget_bytes == 10 * 1024 * 1024 / DRAIN_QUEUE_FRACTION);
+
+  auto quiet = h.stats("quiet");
+  CHECK(quiet.rounds == 1);
+  CHECK(quiet.deferred == 0);
+  CHECK(quiet.max_round_bytes == 500);
+  CHECK(quiet.budget_bytes == DRAIN_MIN_BYTES);
+}
+
+void test_deficit_carry_over() {
+  Harness h(2);
+  // limited by its byte budget of DRAIN_MIN_BYTES, each message is 5/8 of it
+  const size_t size = DRAIN_MIN_BYTES * 5 / 8;
+  h.scheduler.addSocket(&h.sockets[0], "large", 1000, 0);
+  h.scheduler.addSocket(&h.sockets[1], "small", 0, 0);
+  h.sockets[0].push(size, 16);
+  h.sockets[1].push(1, 1000);
+
+  auto order = h.drain();
+  // the bytes over budget in one round are taken from the next one: 8 messages every 5 rounds
+  auto large_runs = runs(order, 0);
+  REQUIRE(large_runs.size() >= 10);
+  const std::vector<int> expected = {2, 2, 1, 2, 1, 2, 2, 1, 2, 1};
+  CHECK(std::equal(expected.begin(), expected.end(), large_runs.begin()));
+  // while both are backlogged, the small socket gets its message budget every round
+  auto small_runs = runs(order, 1);
+  for (size_t i = 0; i + 1 < expected.size(); ++i) CHECK(small_runs[i] == DRAIN_MIN_MESSAGES);
+  CHECK(h.stats("large").max_round_bytes == 2 * size);
+  CHECK(h.stats("small").max_round_bytes == DRAIN_MIN_MESSAGES);
+}
+
+void test_no_saved_budget() {
+  Harness h(2);
+  const size_t size = DRAIN_MIN_BYTES * 5 / 8;
+  h.scheduler.addSocket(&h.sockets[0], "large", 1000, 0);
+  h.scheduler.addSocket(&h.sockets[1], "small", 0, 0);
+
+  // a socket that runs empty doesn't keep its unused budget for later
+  h.sockets[0].push(1);
+  CHECK(h.drain().size() == 1);
+  CHECK(h.stats("large").deferred == 0);
+
+  h.sockets[0].push(size, 3);
+  h.sockets[1].push(1, 100);
+  auto large_runs = runs(h.drain(), 0);
+  REQUIRE(large_runs.size() == 2);
+  CHECK(large_runs[0] == 2);
+  CHECK(large_runs[1] == 1);
+}
+
+void test_drain_scheduler() {
+  test_budget_fairness();
+  test_deficit_carry_over();
+  test_no_saved_budget();
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_drain_scheduler);
+}
@@ -0,0 +1,83 @@
+#include <cstring>
+
+#include "common/tests/native_test.h"
+#include "system/loggerd/loggerd.h"
+
+namespace {
+
+struct Packet {
+  bool valid;
+  uint64_t mono_time;
+  uint32_t frame_id;
+  int32_t segment_num;
+  uint32_t flags;
+  uint32_t len;
+};
+
+capnp::MallocMessageBuilder &fillEncodeData(capnp::MallocMessageBuilder &msg, const Packet &p,
+                                            cereal::EncodeData::Builder (cereal::Event::Builder::*init_encode_data_func)()) {
+  auto event = msg.initRoot<cereal::Event>();
+  event.setValid(p.valid);
+  event.setLogMonoTime(p.mono_time);
+  auto idx = (event.*init_encode_data_func)().initIdx();
+  idx.setFrameId(p.frame_id);
+  idx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+  idx.setEncodeId(p.frame_id);
+  idx.setSegmentNum(p.segment_num);
+  idx.setSegmentId(p.frame_id % 1200);
+  idx.setFlags(p.flags);
+  idx.setLen(p.len);
+  idx.setTimestampEof(p.mono_time);
+  return msg;
+}
+
+// the idx event built the usual way, with a fresh builder
+kj::Array<capnp::word> expectedIdxEvent(cereal::Event::Reader event, const EncoderInfo &info) {
+  capnp::MallocMessageBuilder msg;
+  auto evt = msg.initRoot<cereal::Event>();
+  evt.setValid(event.getValid());
+  evt.setLogMonoTime(event.getLogMonoTime());
+  (evt.*(info.set_encode_idx_func))((event.*(info.get_encode_data_func))().getIdx());
+  return capnp::messageToFlatArray(msg);
+}
+
+const capnp::byte *checkIdxEvent(IdxEventBuilder &builder, const Packet &p, const EncoderInfo &info, const capnp::byte *expected_data) {
+  capnp::MallocMessageBuilder msg;
+  auto event = fillEncodeData(msg, p, info.init_encode_data_func).getRoot<cereal::Event>().asReader();
+  auto bytes = builder.build(event, (event.*(info.get_encode_data_func))().getIdx(), info.set_encode_idx_func);
+
+  // byte for byte what a fresh builder writes, nothing is left over from earlier events
+  auto expected = expectedIdxEvent(event, info);
+  REQUIRE(bytes.size() == expected.asBytes().size());
+  CHECK(memcmp(bytes.begin(), expected.asBytes().begin(), bytes.size()) == 0);
+  if (expected_data) CHECK(bytes.begin() == expected_data);
+
+  capnp::FlatArrayMessageReader reader(kj::arrayPtr((capnp::word *)bytes.begin(), bytes.size() / sizeof(capnp::word)));
+  auto evt = reader.getRoot<cereal::Event>();
+  CHECK(evt.getValid() == p.valid);
+  CHECK(evt.getLogMonoTime() == p.mono_time);
+  REQUIRE(evt.isNarrowRoadEncodeIdx() || evt.isWideRoadEncodeIdx());
+  auto idx = evt.isNarrowRoadEncodeIdx() ? evt.getNarrowRoadEncodeIdx() : evt.getWideRoadEncodeIdx();
+  CHECK(idx.getFrameId() == p.frame_id);
+  CHECK(idx.getSegmentNum() == p.segment_num);
+  CHECK(idx.getFlags() == p.flags);
+  CHECK(idx.getLen() == p.len);
+  return bytes.begin();
+}
+
+void test_idx_event() {
+  IdxEventBuilder builder;
+  const Packet first = {.valid = true, .mono_time = 123456789, .frame_id = 4000, .segment_num = 3, .flags = 8, .len = 200000};
+  const capnp::byte *data = checkIdxEvent(builder, first, main_road_encoder_info, nullptr);
+
+  // the following events reuse the buffers of the first one
+  checkIdxEvent(builder, {.valid = false, .mono_time = 1, .frame_id = 0, .segment_num = 0, .flags = 0, .len = 0}, main_road_encoder_info, data);
+  checkIdxEvent(builder, {.valid = true, .mono_time = 987654321, .frame_id = 7, .segment_num = 1, .flags = 0, .len = 1000}, main_wide_road_encoder_info, data);
+  checkIdxEvent(builder, first, main_road_encoder_info, data);
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_idx_event);
+}
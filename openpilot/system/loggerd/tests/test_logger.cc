@@ -0,0 +1,87 @@
+#include <stdlib.h>
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <set>
+#include <string>
+
+#include "common/prefix.h"
+#include "common/tests/native_test.h"
+#include "common/util.h"
+#include "system/loggerd/logger.h"
+
+namespace {
+
+bool exists(const std::string &path) { return std::filesystem::exists(path); }
+
+// the background thread runs its tasks in order, so this waits for everything queued before
+void waitForBackground(LoggerState &logger) {
+  std::promise<void> done;
+  logger.runInBackground([&done]() { done.set_value(); });
+  done.get_future().wait();
+}
+
+std::set<std::string> listDir(const std::string &dir) {
+  std::set<std::string> names;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    names.insert(entry.path().filename().string());
+  }
+  return names;
+}
+
+void test_logger() {
+  OpenpilotPrefix prefix;
+  char dir_template[] = "/tmp/test_logger_XXXXXX";
+  const std::string log_root = mkdtemp(dir_template);
+
+  // prepared by a loggerd that didn't exit cleanly
+  const std::string stale = log_root + "/00000000--0123456789--5.tmp";
+  REQUIRE(util::create_directories(stale, 0775));
+  std::ofstream{stale + "/rlog.lock"};
+
+  std::string route;
+  {
+    LoggerState logger(log_root);
+    CHECK(!exists(stale));
+    route = log_root + "/" + logger.routeName();
+
+    // the first segment is started right away, the next one is prepared under a temporary name
+    REQUIRE(logger.next());
+    CHECK(logger.segment() == 0);
+    CHECK(logger.segmentPath() == route + "--0");
+    CHECK(exists(route + "--0/rlog.lock"));
+    waitForBackground(logger);
+    CHECK(exists(route + "--1.tmp/rlog.lock"));
+    CHECK(exists(route + "--1.tmp/rlog.zst"));
+    CHECK(exists(route + "--1.tmp/qlog.zst"));
+
+    // rotating renames the prepared segment and closes the previous one
+    REQUIRE(logger.next());
+    CHECK(logger.segment() == 1);
+    CHECK(logger.segmentPath() == route + "--1");
+    CHECK(!exists(route + "--1.tmp"));
+    CHECK(exists(route + "--1/rlog.lock"));
+    waitForBackground(logger);
+    CHECK(!exists(route + "--0/rlog.lock"));
+    CHECK(exists(route + "--2.tmp/rlog.lock"));
+  }
+
+  // the last segment is closed and the unused prepared one removed
+  const std::string route_name = route.substr(log_root.size() + 1);
+  CHECK(listDir(log_root) == std::set<std::string>({route_name + "--0", route_name + "--1"}));
+  for (const std::string segment : {route + "--0", route + "--1"}) {
+    CHECK(!exists(segment + "/rlog.lock"));
+    // init data and sentinels
+    CHECK(!zstd_decompress(util::read_file(segment + "/rlog.zst")).empty());
+    CHECK(!zstd_decompress(util::read_file(segment + "/qlog.zst")).empty());
+  }
+
+  std::filesystem::remove_all(log_root);
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_logger);
+}
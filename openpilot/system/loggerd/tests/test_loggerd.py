@@ -301,6 +301,17 @@ class TestLoggerd(OpenpilotTestCase):
       sent.clear_write_flag()
       assert sent.to_bytes() == m.as_builder().to_bytes()
 
+  def test_remove_stale_segments(self):
+    stale_segment = Path(Paths.log_root()) / "0000000a--0123456789--3.tmp"
+    stale_segment.mkdir(parents=True)
+    (stale_segment / "rlog.zst").write_bytes(b"")
+
+    services = random.sample(CEREAL_SERVICES, random.randint(5, 10))
+    self._publish_random_messages(services)
+
+    assert not stale_segment.exists()
+    assert not any(d.name.endswith(".tmp") for d in Path(Paths.log_root()).iterdir()), "prepared segment left behind"
+
   def test_preserving_bookmarked_segments(self):
     services = set(random.sample(CEREAL_SERVICES, random.randint(5, 10))) | {"userBookmark"}
     self._publish_random_messages(services)
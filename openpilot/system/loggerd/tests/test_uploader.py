@@ -157,6 +157,13 @@ class TestUploader(UploaderTestCase):
       fn = f_path.with_suffix(f_path.suffix.replace(".zst", ""))
       assert all(candidate[2] != str(fn) for candidate in uploader.list_upload_files(metered=False)), "Locked file selected for upload"
 
+  def test_no_upload_prepared_segment(self):
+    prepared_dir = f"{self.seg_dir}.tmp"
+    f_paths = [self.make_file_with_data(prepared_dir, t, 1) for t in ["qlog.zst", "rlog.zst"]]
+    uploader = Uploader("0000000000000000", Paths.log_root())
+    upload_candidates = {candidate[2] for candidate in uploader.list_upload_files(metered=False)}
+    assert upload_candidates.isdisjoint(map(str, f_paths)), "Prepared segment selected for upload"
+
   def test_no_upload_with_xattr(self):
     f_paths = self.gen_files(lock=False, xattr=UPLOAD_ATTR_VALUE)
     uploader = Uploader("0000000000000000", Paths.log_root())
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "common/tests/native_test.h"
+#include "common/util.h"
+#include "system/loggerd/zstd_seekable.h"
+#include "system/loggerd/zstd_writer.h"
+
+namespace {
+
+constexpr int MESSAGES = 200;
+constexpr size_t MESSAGE_SIZE = 1000;
+constexpr size_t FRAME_SIZE = 16 * 1024;
+constexpr int RARE_SERVICE = 7;
+
+uint64_t monoTime(int i) { return 1000 + i * 10; }
+int service(int i) { return (i >= 100 && i < 110) ? RARE_SERVICE : i % 4; }
+
+std::string message(int i) {
+  std::string msg(MESSAGE_SIZE, 'a' + i % 26);
+  memcpy(msg.data(), &i, sizeof(i));
+  return msg;
+}
+
+// ids of the messages in decompressed data, which always holds whole messages
+std::vector<int> messageIds(const std::string &data) {
+  REQUIRE(data.size() % MESSAGE_SIZE == 0);
+  std::vector<int> ids;
+  for (size_t pos = 0; pos < data.size(); pos += MESSAGE_SIZE) {
+    int id = 0;
+    memcpy(&id, data.data() + pos, sizeof(id));
+    REQUIRE(data.compare(pos, MESSAGE_SIZE, message(id)) == 0);
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+bool containsRange(const std::vector<int> &ids, int first, int last) {
+  for (int i = first; i <= last; ++i) {
+    if (std::find(ids.begin(), ids.end(), i) == ids.end()) return false;
+  }
+  return true;
+}
+
+void test_zstd_seekable() {
+  char dir_template[] = "/tmp/test_zstd_seekable_XXXXXX";
+  const std::string dir = mkdtemp(dir_template);
+  const std::string file = dir + "/rlog.zst";
+
+  std::string expected;
+  {
+    ZstdFileWriter writer(file, ZstdWriterConfig{.level = 3, .frame_size = FRAME_SIZE});
+    for (int i = 0; i < MESSAGES; ++i) {
+      std::string msg = message(i);
+      writer.write(msg.data(), msg.size(), monoTime(i), service(i));
+      expected += msg;
+    }
+  }
+
+  // the footer frames are skipped by readers of the whole file
+  const std::string compressed = util::read_file(file);
+  std::string decompressed(expected.size(), '\0');
+  size_t ret = ZSTD_decompress(decompressed.data(), decompressed.size(), compressed.data(), compressed.size());
+  REQUIRE(!ZSTD_isError(ret) && ret == expected.size());
+  CHECK(decompressed == expected);
+
+  ZstdSeekableReader reader;
+  REQUIRE(reader.open(file));
+  const auto &frames = reader.frames();
+  REQUIRE(frames.size() > 4);
+
+  // frames are contiguous standalone zstd frames, cut at message boundaries
+  uint64_t offset = 0, decompressed_offset = 0;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const SeekableFrame &frame = frames[i];
+    CHECK(frame.offset == offset);
+    CHECK(ZSTD_findFrameCompressedSize(compressed.data() + frame.offset, compressed.size() - frame.offset) == frame.compressed_size);
+    CHECK(frame.decompressed_size % MESSAGE_SIZE == 0);
+    if (i + 1 < frames.size()) CHECK(frame.decompressed_size >= FRAME_SIZE);
+
+    const std::string data = reader.readFrame(i);
+    CHECK(data == expected.substr(decompressed_offset, frame.decompressed_size));
+    const auto ids = messageIds(data);
+    CHECK(frame.first_mono_time == monoTime(ids.front()));
+    CHECK(frame.last_mono_time == monoTime(ids.back()));
+    for (int id : ids) CHECK(frame.hasService(service(id)));
+
+    offset += frame.compressed_size;
+    decompressed_offset += frame.decompressed_size;
+  }
+  CHECK(decompressed_offset == expected.size());
+  // followed by the log index and the seek table
+  CHECK(offset < compressed.size());
+
+  // a time range only decompresses the frames overlapping it
+  const auto range_ids = messageIds(reader.read(monoTime(50), monoTime(60)));
+  CHECK(containsRange(range_ids, 50, 60));
+  CHECK(range_ids.size() < MESSAGES);
+  const int messages_per_frame = FRAME_SIZE / MESSAGE_SIZE + 1;
+  for (int id : range_ids) CHECK(id >= 50 - messages_per_frame && id <= 60 + messages_per_frame);
+
+  // so does a single service
+  const auto service_ids = messageIds(reader.read(0, UINT64_MAX, RARE_SERVICE));
+  CHECK(containsRange(service_ids, 100, 109));
+  CHECK(service_ids.size() < MESSAGES);
+  std::bitset<LOG_INDEX_SERVICE_BITS> services;
+  services.set(RARE_SERVICE);
+  CHECK(messageIds(reader.read(0, UINT64_MAX, services)) == service_ids);
+
+  CHECK(messageIds(reader.read(0, UINT64_MAX)).size() == MESSAGES);
+  CHECK(reader.read(monoTime(MESSAGES), UINT64_MAX).empty());
+
+  std::filesystem::remove_all(dir);
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_zstd_seekable);
+}
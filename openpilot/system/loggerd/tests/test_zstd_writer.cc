@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <zstd.h>
+
+#include <filesystem>
+#include <random>
+#include <string>
+
+#include "common/tests/native_test.h"
+#include "common/util.h"
+#include "system/loggerd/zstd_writer.h"
+
+namespace {
+
+// text-like data that compresses, but not for free
+std::string makeData(size_t size, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<int> word_length(1, 8), letter(0, 15);
+  std::string data;
+  data.reserve(size + 8);
+  while (data.size() < size) {
+    for (int n = word_length(gen); n > 0; --n) data.push_back('a' + letter(gen));
+    data.push_back(' ');
+  }
+  data.resize(size);
+  return data;
+}
+
+std::string decompressFile(const std::string &file, size_t size) {
+  const std::string compressed = util::read_file(file);
+  std::string out(size, '\0');
+  size_t ret = ZSTD_decompress(out.data(), out.size(), compressed.data(), compressed.size());
+  REQUIRE(!ZSTD_isError(ret));
+  out.resize(ret);
+  return out;
+}
+
+void test_round_trip(const std::string &dir) {
+  const std::string file = dir + "/round_trip.zst";
+  const size_t buffer_size = ZSTD_CStreamInSize();
+  // empty, small and larger than an input buffer, ending exactly on a buffer boundary or not
+  const std::string data = makeData(5 * buffer_size, 1);
+  const size_t sizes[] = {0, 1, 100, buffer_size - 101, buffer_size, 3 * buffer_size / 2, 7, buffer_size + 1};
+
+  std::string expected;
+  ZstdFileWriter::Stats stats;
+  {
+    ZstdFileWriter writer(file, 3);
+    size_t pos = 0;
+    for (size_t size : sizes) {
+      writer.write((void *)(data.data() + pos), size);
+      expected.append(data, pos, size);
+      pos += size;
+    }
+    writer.write(kj::ArrayPtr<capnp::byte>((capnp::byte *)data.data(), (size_t)1000));
+    expected.append(data, 0, 1000);
+    stats = writer.stats();
+  }
+  CHECK(decompressFile(file, expected.size() + 1) == expected);
+  CHECK(stats.level == 3);
+  CHECK(stats.level_changes == 0);
+  CHECK(stats.max_queue_depth <= ZSTD_WRITER_BUFFERS);
+}
+
+void test_stall_stats(const std::string &dir) {
+  const std::string file = dir + "/stalls.zst";
+  const std::string data = makeData(4 * ZSTD_WRITER_BUFFERS * ZSTD_CStreamInSize(), 2);
+
+  ZstdFileWriter::Stats stats;
+  {
+    // writes are a copy, the compressor at level 19 falls behind and write() waits for free buffers
+    ZstdFileWriter writer(file, 19);
+    for (size_t pos = 0; pos < data.size(); pos += 4096) {
+      writer.write((void *)(data.data() + pos), 4096);
+    }
+    stats = writer.stats();
+  }
+  CHECK(stats.stalls > 0);
+  CHECK(stats.stall_ns > 0);
+  // a stalled write found every buffer queued, or all but the one being compressed
+  CHECK(stats.max_queue_depth >= ZSTD_WRITER_BUFFERS - 1);
+  CHECK(stats.max_queue_depth <= ZSTD_WRITER_BUFFERS);
+  CHECK(stats.bytes_in <= data.size());
+  CHECK(stats.bytes_in >= data.size() - ZSTD_CStreamInSize());
+  CHECK(stats.bytes_out <= std::filesystem::file_size(file));
+  CHECK(stats.compress_ns > 0);
+  CHECK(decompressFile(file, data.size() + 1) == data);
+}
+
+void test_level_changes(const std::string &dir) {
+  const size_t buffer_size = ZSTD_CStreamInSize();
+  {
+    // flooded at the highest level, the writer steps down
+    const std::string file = dir + "/level_down.zst";
+    const std::string data = makeData(4 * ZSTD_WRITER_BUFFERS * buffer_size, 3);
+    ZstdFileWriter::Stats stats;
+    {
+      ZstdFileWriter writer(file, ZstdWriterConfig{.level = 19, .min_level = 1, .max_level = 19});
+      for (size_t pos = 0; pos < data.size(); pos += 4096) {
+        writer.write((void *)(data.data() + pos), 4096);
+      }
+      stats = writer.stats();
+    }
+    CHECK(stats.level_changes > 0);
+    CHECK(stats.level < 19);
+    CHECK(stats.level >= 1);
+    // each new level starts a new frame, the file still decompresses as a whole
+    CHECK(decompressFile(file, data.size() + 1) == data);
+  }
+  {
+    // an idle compressor steps up, but not past the maximum
+    const std::string file = dir + "/level_up.zst";
+    const std::string data = makeData(24 * buffer_size, 4);
+    ZstdFileWriter::Stats stats;
+    {
+      ZstdFileWriter writer(file, ZstdWriterConfig{.level = 1, .min_level = 1, .max_level = 3});
+      for (size_t pos = 0; pos < data.size(); pos += buffer_size) {
+        writer.write((void *)(data.data() + pos), buffer_size);
+        util::sleep_for(150);
+      }
+      stats = writer.stats();
+    }
+    CHECK(stats.level_changes > 0);
+    CHECK(stats.level > 1);
+    CHECK(stats.level <= 3);
+    CHECK(decompressFile(file, data.size() + 1) == data);
+  }
+}
+
+void test_zstd_writer() {
+  char dir_template[] = "/tmp/test_zstd_writer_XXXXXX";
+  const std::string dir = mkdtemp(dir_template);
+  test_round_trip(dir);
+  test_stall_stats(dir);
+  test_level_changes(dir);
+  std::filesystem::remove_all(dir);
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_zstd_writer);
+}
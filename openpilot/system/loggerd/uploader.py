@@ -90,6 +90,10 @@ class Uploader:
     requested_routes = [] if r is None else [route for route in r.split(",") if route]
 
     for logdir in listdir_by_creation(self.root):
+      # segments being prepared by loggerd, or left behind by a crash
+      if logdir.endswith(".tmp"):
+        continue
+
       path = os.path.join(self.root, logdir)
       try:
         names = os.listdir(path)
@@ -0,0 +1,191 @@
+#include "system/loggerd/zstd_seekable.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+
+namespace {
+
+constexpr size_t SEEK_TABLE_ENTRY_SIZE = 8;    // compressed and decompressed size, without checksums
+constexpr size_t SEEK_TABLE_FOOTER_SIZE = 9;   // frame count, descriptor and magic
+constexpr size_t SKIPPABLE_HEADER_SIZE = 8;    // magic and frame size
+constexpr size_t LOG_INDEX_HEADER_SIZE = 12;   // version, frame count and service bits
+constexpr size_t LOG_INDEX_ENTRY_SIZE = 16 + LOG_INDEX_SERVICE_BITS / 8;
+
+// all fields are little endian
+void put_u32(std::string &out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) out.push_back((char)(v >> (8 * i)));
+}
+
+void put_u64(std::string &out, uint64_t v) {
+  for (int i = 0; i < 8; ++i) out.push_back((char)(v >> (8 * i)));
+}
+
+uint32_t get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t get_u64(const uint8_t *p) {
+  return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+}  // namespace
+
+void SeekableFrame::addMessage(size_t size, uint64_t mono_time, int service) {
+  // messages without a time or service make the frame match any time or service
+  if (mono_time == 0) {
+    first_mono_time = 0;
+    last_mono_time = UINT64_MAX;
+  } else if (decompressed_size == 0) {
+    first_mono_time = last_mono_time = mono_time;
+  } else {
+    first_mono_time = std::min(first_mono_time, mono_time);
+    last_mono_time = std::max(last_mono_time, mono_time);
+  }
+  decompressed_size += size;
+  if (service < 0 || service >= LOG_INDEX_SERVICE_BITS) {
+    services.set();
+  } else {
+    services.set(service);
+  }
+}
+
+std::string zstd_seekable_footer(const std::vector<SeekableFrame> &frames) {
+  std::string index;
+  put_u32(index, LOG_INDEX_MAGIC);
+  put_u32(index, LOG_INDEX_HEADER_SIZE + frames.size() * LOG_INDEX_ENTRY_SIZE);
+  put_u32(index, LOG_INDEX_VERSION);
+  put_u32(index, frames.size());
+  put_u32(index, LOG_INDEX_SERVICE_BITS);
+  for (const auto &f : frames) {
+    put_u64(index, f.first_mono_time);
+    put_u64(index, f.last_mono_time);
+    for (int i = 0; i < LOG_INDEX_SERVICE_BITS; i += 8) {
+      uint8_t byte = 0;
+      for (int b = 0; b < 8; ++b) byte |= f.services.test(i + b) << b;
+      index.push_back((char)byte);
+    }
+  }
+
+  // the index frame is listed in the seek table like any other frame, it decompresses to nothing
+  std::string table;
+  const size_t entries = frames.size() + 1;
+  put_u32(table, ZSTD_SEEK_TABLE_MAGIC);
+  put_u32(table, entries * SEEK_TABLE_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE);
+  for (const auto &f : frames) {
+    put_u32(table, f.compressed_size);
+    put_u32(table, f.decompressed_size);
+  }
+  put_u32(table, index.size());
+  put_u32(table, 0);
+  put_u32(table, entries);
+  table.push_back(0);  // descriptor: no checksums
+  put_u32(table, ZSTD_SEEKABLE_MAGIC);
+  return index + table;
+}
+
+bool ZstdSeekableReader::open(const std::string &filename) {
+  frames_.clear();
+  file_.reset(fopen(filename.c_str(), "rb"));
+  if (!file_ || fseeko(file_.get(), 0, SEEK_END) != 0) return false;
+  const uint64_t file_size = ftello(file_.get());
+
+  // seek table footer
+  uint8_t footer[SEEK_TABLE_FOOTER_SIZE];
+  if (file_size < SKIPPABLE_HEADER_SIZE + sizeof(footer) ||
+      !readAt(file_size - sizeof(footer), footer, sizeof(footer)) || get_u32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+    return false;
+  }
+  const uint32_t entries = get_u32(footer);
+  const size_t entry_size = SEEK_TABLE_ENTRY_SIZE + ((footer[4] & 0x80) ? 4 : 0);
+  const uint64_t table_size = SKIPPABLE_HEADER_SIZE + (uint64_t)entries * entry_size + sizeof(footer);
+  if (entries == 0 || table_size > file_size) return false;
+
+  std::vector<uint8_t> table(table_size);
+  if (!readAt(file_size - table_size, table.data(), table.size()) || get_u32(table.data()) != ZSTD_SEEK_TABLE_MAGIC) {
+    return false;
+  }
+
+  std::vector<SeekableFrame> frames(entries);
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < entries; ++i) {
+    const uint8_t *entry = table.data() + SKIPPABLE_HEADER_SIZE + i * entry_size;
+    frames[i].offset = offset;
+    frames[i].compressed_size = get_u32(entry);
+    frames[i].decompressed_size = get_u32(entry + 4);
+    offset += frames[i].compressed_size;
+  }
+  if (offset + table_size != file_size) return false;
+
+  // without the log index, every frame may hold any message
+  for (auto &f : frames) {
+    f.first_mono_time = 0;
+    f.last_mono_time = UINT64_MAX;
+    f.services.set();
+  }
+
+  // the log index is the last frame
+  std::vector<uint8_t> index(frames.back().compressed_size);
+  if (index.size() >= SKIPPABLE_HEADER_SIZE && readAt(frames.back().offset, index.data(), index.size()) &&
+      get_u32(index.data()) == LOG_INDEX_MAGIC) {
+    frames.pop_back();
+    const uint8_t *header = index.data() + SKIPPABLE_HEADER_SIZE;
+    const uint32_t service_bits = index.size() >= SKIPPABLE_HEADER_SIZE + LOG_INDEX_HEADER_SIZE ? get_u32(header + 8) : 0;
+    const size_t index_entry_size = 16 + (service_bits + 7) / 8;
+    if (service_bits > 0 && get_u32(header) == LOG_INDEX_VERSION && get_u32(header + 4) == frames.size() &&
+        index.size() >= SKIPPABLE_HEADER_SIZE + LOG_INDEX_HEADER_SIZE + frames.size() * index_entry_size) {
+      for (size_t i = 0; i < frames.size(); ++i) {
+        const uint8_t *entry = header + LOG_INDEX_HEADER_SIZE + i * index_entry_size;
+        frames[i].first_mono_time = get_u64(entry);
+        frames[i].last_mono_time = get_u64(entry + 8);
+        for (int b = 0; b < LOG_INDEX_SERVICE_BITS; ++b) {
+          // members beyond the writer's bitmap may be in any frame
+          frames[i].services[b] = (uint32_t)b >= service_bits || ((entry[16 + b / 8] >> (b % 8)) & 1);
+        }
+      }
+    }
+  }
+
+  frames_ = std::move(frames);
+  return true;
+}
+
+bool ZstdSeekableReader::readAt(uint64_t offset, void *data, size_t size) const {
+  return fseeko(file_.get(), offset, SEEK_SET) == 0 && fread(data, 1, size, file_.get()) == size;
+}
+
+std::string ZstdSeekableReader::readFrame(size_t i) const {
+  if (i >= frames_.size()) return {};
+
+  const SeekableFrame &frame = frames_[i];
+  std::string compressed(frame.compressed_size, '\0');
+  if (!readAt(frame.offset, compressed.data(), compressed.size())) return {};
+
+  std::string out(frame.decompressed_size, '\0');
+  size_t ret = ZSTD_decompress(out.data(), out.size(), compressed.data(), compressed.size());
+  if (ZSTD_isError(ret) || ret != out.size()) return {};
+  return out;
+}
+
+std::string ZstdSeekableReader::read(uint64_t start_mono_time, uint64_t end_mono_time, int service) const {
+  // members beyond the bitmap are in every frame that has one, like any unknown service
+  std::bitset<LOG_INDEX_SERVICE_BITS> services;
+  if (service < 0 || service >= LOG_INDEX_SERVICE_BITS) {
+    services.set();
+  } else {
+    services.set(service);
+  }
+  return read(start_mono_time, end_mono_time, services);
+}
+
+std::string ZstdSeekableReader::read(uint64_t start_mono_time, uint64_t end_mono_time,
+                                     const std::bitset<LOG_INDEX_SERVICE_BITS> &services) const {
+  std::string out;
+  for (size_t i = 0; i < frames_.size(); ++i) {
+    const SeekableFrame &frame = frames_[i];
+    if (frame.last_mono_time < start_mono_time || frame.first_mono_time > end_mono_time) continue;
+    if ((frame.services & services).none()) continue;
+    out += readFrame(i);
+  }
+  return out;
+}
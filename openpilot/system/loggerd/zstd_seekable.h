@@ -0,0 +1,55 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Seekable logs are made of independently decompressible zstd frames cut on message boundaries. They end with
+//  - a skippable frame indexing the logMonoTime range and the services of each frame,
+//  - a seek table in the zstd seekable format (contrib/seekable_format), which lists all frames including the index.
+// Both are skippable frames, so readers decompressing the whole file are unaffected.
+
+constexpr uint32_t ZSTD_SEEK_TABLE_MAGIC = 0x184D2A5E;  // skippable frame holding the seek table
+constexpr uint32_t ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;    // last four bytes of a seekable file
+constexpr uint32_t LOG_INDEX_MAGIC = 0x184D2A5A;        // skippable frame holding the log index
+constexpr uint32_t LOG_INDEX_VERSION = 1;
+constexpr int LOG_INDEX_SERVICE_BITS = 256;             // Event union members, larger ones are in every frame
+
+struct SeekableFrame {
+  uint64_t offset = 0;  // in the compressed file
+  uint32_t compressed_size = 0;
+  uint32_t decompressed_size = 0;
+  uint64_t first_mono_time = 0;
+  uint64_t last_mono_time = 0;
+  std::bitset<LOG_INDEX_SERVICE_BITS> services;
+
+  // service is the Event union member, -1 if unknown
+  void addMessage(size_t size, uint64_t mono_time, int service);
+  bool hasService(int service) const { return service >= LOG_INDEX_SERVICE_BITS || services.test(service); }
+};
+
+// the log index and seek table frames, written after the data frames
+std::string zstd_seekable_footer(const std::vector<SeekableFrame> &frames);
+
+// Random access into a seekable log, decompressing only the frames that are read
+class ZstdSeekableReader {
+public:
+  // returns false if the file can't be read or isn't seekable
+  bool open(const std::string &filename);
+  const std::vector<SeekableFrame> &frames() const { return frames_; }
+  // decompressed messages of frame i, empty on failure
+  std::string readFrame(size_t i) const;
+  // decompressed frames with messages in [start, end] mono time, only those with the service unless it is -1
+  std::string read(uint64_t start_mono_time, uint64_t end_mono_time, int service = -1) const;
+  // decompressed frames with messages in [start, end] mono time that hold any of the services
+  std::string read(uint64_t start_mono_time, uint64_t end_mono_time, const std::bitset<LOG_INDEX_SERVICE_BITS> &services) const;
+
+private:
+  bool readAt(uint64_t offset, void *data, size_t size) const;
+
+  std::unique_ptr<FILE, decltype(&fclose)> file_{nullptr, &fclose};
+  std::vector<SeekableFrame> frames_;
+};
@@ -1,53 +1,210 @@
 
 #include "system/loggerd/zstd_writer.h"
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
 
+#include "common/timing.h"
 #include "common/util.h"
 
-// Constructor: Initializes compression stream and opens file
-ZstdFileWriter::ZstdFileWriter(const std::string& filename, int compression_level) {
+// Constructor: Initializes compression stream, opens file and starts the writer thread
+ZstdFileWriter::ZstdFileWriter(const std::string& filename, const ZstdWriterConfig &config)
+    : config_(config), level_(config.level) {
   // Create the compression stream
   cstream_ = ZSTD_createCStream();
   assert(cstream_);
 
-  size_t initResult = ZSTD_initCStream(cstream_, compression_level);
-  assert(!ZSTD_isError(initResult));
-
-  input_cache_capacity_ = ZSTD_CStreamInSize();
-  input_cache_.reserve(input_cache_capacity_);
+  size_t ret = ZSTD_CCtx_setParameter(cstream_, ZSTD_c_compressionLevel, level_);
+  assert(!ZSTD_isError(ret));
+  if (config_.workers > 0) {
+    // fails when libzstd is built without multithreading, keep compressing on the writer thread then
+    ZSTD_CCtx_setParameter(cstream_, ZSTD_c_nbWorkers, config_.workers);
+  }
+  stats_.level = level_;
+  window_start_ts_ = nanos_since_boot();
+
+  input_buffer_size_ = ZSTD_CStreamInSize();
+  input_buffers_.resize(ZSTD_WRITER_BUFFERS);
+  for (auto &buf : input_buffers_) {
+    buf.data.reserve(input_buffer_size_);
+    free_.push_back(&buf);
+  }
+  current_ = free_.front();
+  free_.pop_front();
   output_buffer_.resize(ZSTD_CStreamOutSize());
 
   file_ = util::safe_fopen(filename.c_str(), "wb");
   assert(file_ != nullptr);
+
+  thread_ = std::thread(&ZstdFileWriter::writerThread, this);
 }
 
-// Destructor: Finalizes compression and closes file
+// Destructor: Finalizes compression and durably closes the file
 ZstdFileWriter::~ZstdFileWriter() {
-  flushCache(true);
-  util::safe_fflush(file_);
+  submit(true, true);
+  thread_.join();
 
-  int err = fclose(file_);
+  util::safe_fflush(file_);
+  int err = fsync(fileno(file_));
+  assert(err == 0);
+  err = fclose(file_);
   assert(err == 0);
 
   ZSTD_freeCStream(cstream_);
 }
 
-// Compresses and writes data to file
-void ZstdFileWriter::write(void* data, size_t size) {
-  // Add data to the input cache
-  input_cache_.insert(input_cache_.end(), (uint8_t*)data, (uint8_t*)data + size);
+// Copies data into the input buffers, full buffers are compressed on the writer thread
+void ZstdFileWriter::write(void* data, size_t size, uint64_t mono_time, int service) {
+  if (config_.frame_size > 0) {
+    frame_.addMessage(size, mono_time, service);
+  }
+
+  const char *src = (const char *)data;
+  while (size > 0) {
+    size_t n = std::min(size, input_buffer_size_ - current_->data.size());
+    current_->data.insert(current_->data.end(), src, src + n);
+    src += n;
+    size -= n;
+
+    if (current_->data.size() >= input_buffer_size_ && size > 0) {
+      submit(false, false);
+    }
+  }
+
+  // frames of seekable files end with a complete message
+  const bool end_frame = config_.frame_size > 0 && frame_.decompressed_size >= config_.frame_size;
+  if (end_frame || current_->data.size() >= input_buffer_size_) {
+    submit(end_frame, false);
+  }
+}
+
+// Hands the current buffer to the writer thread and takes a free one, waiting if there is none
+void ZstdFileWriter::submit(bool end_frame, bool last_chunk) {
+  current_->end_frame = end_frame || last_chunk;
+  if (current_->end_frame) {
+    current_->frame = frame_;
+    frame_ = {};
+  }
 
-  // If the cache is full, compress and write to the file
-  if (input_cache_.size() >= input_cache_capacity_) {
-    flushCache(false);
+  std::unique_lock lock(lock_);
+  full_.push_back(current_);
+  finishing_ = last_chunk;
+  stats_.bytes_in += current_->data.size();
+  stats_.queue_depth = full_.size();
+  stats_.max_queue_depth = std::max(stats_.max_queue_depth, full_.size());
+  full_cv_.notify_one();
+
+  current_ = nullptr;
+  if (last_chunk) return;
+
+  if (free_.empty()) {
+    const uint64_t stall_start = nanos_since_boot();
+    free_cv_.wait(lock, [this]() { return !free_.empty(); });
+    ++stats_.stalls;
+    stats_.stall_ns += nanos_since_boot() - stall_start;
   }
+  current_ = free_.front();
+  free_.pop_front();
 }
 
-// Compress and flush the input cache to the file
-void ZstdFileWriter::flushCache(bool last_chunk) {
-  ZSTD_inBuffer input = {input_cache_.data(), input_cache_.size(), 0};
-  ZSTD_EndDirective mode = !last_chunk ? ZSTD_e_continue : ZSTD_e_end;
+ZstdFileWriter::Stats ZstdFileWriter::stats() const {
+  std::lock_guard lock(lock_);
+  return stats_;
+}
+
+void ZstdFileWriter::writerThread() {
+  const bool seekable = config_.frame_size > 0;
+  bool last_chunk = false;
+  while (!last_chunk) {
+    InputBuffer *input = nullptr;
+    size_t backlog = 0;
+    {
+      std::unique_lock lock(lock_);
+      full_cv_.wait(lock, [this]() { return !full_.empty(); });
+      input = full_.front();
+      full_.pop_front();
+      // the last chunk is submitted after all others
+      last_chunk = finishing_ && full_.empty();
+      backlog = full_.size();
+    }
+
+    // The level only changes between frames. Seekable files end frames on message boundaries,
+    // otherwise a new level ends the current frame.
+    int level = level_;
+    if (!last_chunk && (!seekable || input->end_frame)) {
+      level = adaptLevel(backlog);
+    }
+    const bool end_frame = input->end_frame || level != level_;
+
+    const uint64_t start = nanos_since_boot();
+    // a seekable file has nothing to end when the last frame was just ended
+    if (!(seekable && input->end_frame && input->frame.decompressed_size == 0)) {
+      compress(input->data, end_frame ? ZSTD_e_end : ZSTD_e_continue);
+    }
+    if (seekable && input->end_frame && input->frame.decompressed_size > 0) {
+      input->frame.offset = frames_.empty() ? 0 : frames_.back().offset + frames_.back().compressed_size;
+      input->frame.compressed_size = file_size_ - input->frame.offset;
+      frames_.push_back(input->frame);
+    }
+    if (seekable && last_chunk) {
+      const std::string footer = zstd_seekable_footer(frames_);
+      size_t written = util::safe_fwrite(footer.data(), 1, footer.size(), file_);
+      assert(written == footer.size());
+    }
+    input->data.clear();
+    const uint64_t compress_ns = nanos_since_boot() - start;
+    window_busy_ns_ += compress_ns;
+
+    if (level != level_) {
+      level_ = level;
+      size_t ret = ZSTD_CCtx_setParameter(cstream_, ZSTD_c_compressionLevel, level_);
+      assert(!ZSTD_isError(ret));
+    }
+
+    {
+      std::lock_guard lock(lock_);
+      stats_.compress_ns += compress_ns;
+      stats_.queue_depth = full_.size();
+      if (stats_.level != level_) {
+        stats_.level = level_;
+        ++stats_.level_changes;
+      }
+      free_.push_back(input);
+    }
+    free_cv_.notify_one();
+  }
+}
+
+// Picks the level for the next frame from the backlog and the share of time the compressor was busy.
+// Falling behind steps the level down, while an idle compressor can afford to compress harder.
+int ZstdFileWriter::adaptLevel(size_t backlog) {
+  if (config_.min_level >= config_.max_level) return level_;
+
+  const uint64_t now = nanos_since_boot();
+  const uint64_t elapsed = now - window_start_ts_;
+  if (elapsed < ZSTD_LEVEL_INTERVAL_NS && backlog < ZSTD_WRITER_BUFFERS / 2) return level_;
+
+  const double busy = (double)window_busy_ns_ / elapsed;
+  window_start_ts_ = now;
+  window_busy_ns_ = 0;
+
+  int level = level_;
+  if (backlog >= ZSTD_WRITER_BUFFERS / 2) {
+    level -= 2;
+  } else if (busy > 0.75 || backlog > 1) {
+    level -= 1;
+  } else if (busy < 0.3 && backlog == 0) {
+    level += 1;
+  }
+  return std::clamp(level, config_.min_level, config_.max_level);
+}
+
+// Compress the input buffer and write it to the file
+void ZstdFileWriter::compress(const std::vector<char> &input_buffer, ZSTD_EndDirective mode) {
+  ZSTD_inBuffer input = {input_buffer.data(), input_buffer.size(), 0};
+  const bool last_chunk = mode == ZSTD_e_end;
   int finished = 0;
 
   do {
@@ -57,9 +214,12 @@ void ZstdFileWriter::flushCache(bool last_chunk) {
 
     size_t written = util::safe_fwrite(output_buffer_.data(), 1, output.pos, file_);
     assert(written == output.pos);
+    file_size_ += written;
+    {
+      std::lock_guard lock(lock_);
+      stats_.bytes_out += written;
+    }
 
     finished = last_chunk ? (remaining == 0) : (input.pos == input.size);
   } while (!finished);
-
-  input_cache_.clear();  // Clear cache after compression
 }
@@ -2,23 +2,90 @@
 
 #include <zstd.h>
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <capnp/common.h>
 
+#include "system/loggerd/zstd_seekable.h"
+
+// number of input buffers per writer, each ZSTD_CStreamInSize() large
+constexpr int ZSTD_WRITER_BUFFERS = 8;
+// how often an adaptive writer reconsiders its compression level
+constexpr uint64_t ZSTD_LEVEL_INTERVAL_NS = 1000ULL * 1000 * 1000;
+
+struct ZstdWriterConfig {
+  int level;
+  // the level adapts to the load within these bounds, a new level starts a new zstd frame
+  int min_level = level;
+  int max_level = level;
+  int workers = 0;  // zstd worker threads, 0 compresses on the writer thread
+  // when set, frames are cut at message boundaries once they hold this many bytes, and the file is seekable
+  size_t frame_size = 0;
+};
+
+// Compresses and writes a file on a background thread. write() only copies into a bounded pool of
+// input buffers, and only blocks when all of them are waiting for the compressor.
 class ZstdFileWriter {
 public:
-  ZstdFileWriter(const std::string &filename, int compression_level);
+  struct Stats {
+    size_t queue_depth = 0;      // full buffers waiting for the compressor
+    size_t max_queue_depth = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t compress_ns = 0;    // spent compressing and writing on the writer thread
+    uint64_t stalls = 0;         // writes that had to wait for a free buffer
+    uint64_t stall_ns = 0;
+    int level = 0;               // current compression level
+    uint64_t level_changes = 0;
+  };
+
+  ZstdFileWriter(const std::string &filename, int compression_level)
+      : ZstdFileWriter(filename, ZstdWriterConfig{.level = compression_level}) {}
+  ZstdFileWriter(const std::string &filename, const ZstdWriterConfig &config);
+  // compresses the remaining input and syncs the file to disk
   ~ZstdFileWriter();
-  void write(void* data, size_t size);
+  void write(void* data, size_t size) { write(data, size, 0, -1); }
   inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  // writes one message, seekable files index its logMonoTime and Event union member
+  void write(void* data, size_t size, uint64_t mono_time, int service);
+  Stats stats() const;
 
 private:
-  void flushCache(bool last_chunk);
+  struct InputBuffer {
+    std::vector<char> data;
+    bool end_frame = false;
+    SeekableFrame frame;  // the frame ended by this buffer
+  };
+
+  void submit(bool end_frame, bool last_chunk);
+  void writerThread();
+  void compress(const std::vector<char> &input, ZSTD_EndDirective mode);
+  int adaptLevel(size_t backlog);
 
-  size_t input_cache_capacity_ = 0;
-  std::vector<char> input_cache_;
+  size_t input_buffer_size_ = 0;
+  std::vector<InputBuffer> input_buffers_;
+  InputBuffer *current_ = nullptr;  // being filled by write()
+  SeekableFrame frame_;             // the frame being filled by write()
   std::vector<char> output_buffer_;
   ZSTD_CStream *cstream_;
+  ZstdWriterConfig config_;
+  int level_;
+  // busy time of the compressor since the last level decision
+  uint64_t window_start_ts_ = 0;
+  uint64_t window_busy_ns_ = 0;
+  std::vector<SeekableFrame> frames_;  // written so far
+  uint64_t file_size_ = 0;
   FILE* file_ = nullptr;
+
+  mutable std::mutex lock_;
+  std::condition_variable full_cv_, free_cv_;
+  std::deque<InputBuffer *> full_, free_;
+  bool finishing_ = false;
+  Stats stats_;
+  std::thread thread_;
 };
@@ -9,7 +9,17 @@ from openpilot.common.test import OpenpilotTestCase
 NATIVE_TESTS = (
   "openpilot/common/tests/test_swaglog",
   "openpilot/selfdrive/pandad/tests/test_pandad_canprotocol",
+  "openpilot/system/loggerd/tests/test_drain_scheduler",
+  "openpilot/system/loggerd/tests/test_idx_event",
+  "openpilot/system/loggerd/tests/test_logger",
+  "openpilot/system/loggerd/tests/test_zstd_seekable",
+  "openpilot/system/loggerd/tests/test_zstd_writer",
   "openpilot/tools/cabana/tests/test_dbc_core",
+  "openpilot/tools/replay/tests/test_cache_manager",
+  "openpilot/tools/replay/tests/test_logreader",
+  "openpilot/tools/replay/tests/test_merged_events",
+  "openpilot/tools/replay/tests/test_prefetch",
+  "openpilot/tools/replay/tests/test_timeline",
 )
 
 
@@ -6,6 +6,7 @@ Called by C++ replay/cabana via subprocess.
 Subcommands:
   route-files <route>    - Get route file URLs as JSON
   download <url>         - Download/decompress URL to local cache, print local path
+                           (--compressed keeps compressed files as downloaded)
   decompress <path>      - Decompress a local log file, print temporary path
   devices                - List user's devices as JSON
   device-routes <did>    - List routes for a device as JSON
@@ -66,14 +67,37 @@ def make_decompressor(compression):
   raise ValueError(f"Unsupported compression type: {compression}")
 
 
+class StreamDecompressor:
+  """Decompresses a stream chunk by chunk. zstd logs can consist of several frames, each gets a new decompressor."""
+
+  def __init__(self, compression):
+    self.compression = compression
+    self.decompressor = make_decompressor(compression)
+
+  @property
+  def eof(self):
+    return self.decompressor.eof
+
+  def decompress(self, data):
+    out = []
+    while data:
+      # a frame can end exactly at the end of the last chunk, then this chunk starts the next one
+      if self.decompressor.eof:
+        self.decompressor = make_decompressor(self.compression)
+      out.append(self.decompressor.decompress(data))
+      data = self.decompressor.unused_data if self.decompressor.eof else b''
+    return b''.join(out)
+
+
 def decompress_file(source, destination, compression=None):
   with open(source, 'rb') as src, open(destination, 'wb') as dst:
     header = src.read(4)
     compression = compression or compression_type(header)
-    decompressor = make_decompressor(compression)
-    dst.write(decompressor.decompress(header))
-    while data := src.read(1024 * 1024):
+    decompressor = StreamDecompressor(compression)
+    data = header
+    while data:
       dst.write(decompressor.decompress(data))
+      data = src.read(1024 * 1024)
   if not decompressor.eof:
     raise EOFError(f"Compressed {compression} file ended before the end-of-stream marker")
 
@@ -104,8 +128,15 @@ def cmd_route_files(args):
 def cmd_download(args):
   url = args.url
   use_cache = not args.no_cache
+  keep_compressed = args.compressed
 
   if use_cache:
+    local_path = cache_file_path(url)
+    if keep_compressed and os.path.exists(local_path):
+      sys.stdout.write(local_path + "\n")
+      sys.stdout.flush()
+      return
+
     for compression in ('bz2', 'zst'):
       decompressed_path = cache_file_path(url, compression)
       if os.path.exists(decompressed_path):
@@ -113,7 +144,6 @@ def cmd_download(args):
         sys.stdout.flush()
         return
 
-    local_path = cache_file_path(url)
     if os.path.exists(local_path):
       with open(local_path, 'rb') as f:
         compression = compression_type(f.read(4))
@@ -150,8 +180,8 @@ def cmd_download(args):
         for data in r.stream(chunk_size):
           if downloaded == 0:
             compression = compression_type(data)
-            if compression:
-              decompressor = make_decompressor(compression)
+            if compression and not keep_compressed:
+              decompressor = StreamDecompressor(compression)
           f.write(decompressor.decompress(data) if decompressor else data)
           downloaded += len(data)
           sys.stderr.write(f"PROGRESS:{downloaded}:{total}\n")
@@ -159,6 +189,8 @@ def cmd_download(args):
 
       if decompressor and not decompressor.eof:
         raise EOFError(f"Compressed {compression} file ended before the end-of-stream marker")
+      if downloaded < total:
+        raise EOFError(f"Download ended after {downloaded} of {total} bytes")
 
       if decompressor:
         if use_cache:
@@ -235,6 +267,7 @@ def main():
   p_dl = subparsers.add_parser("download")
   p_dl.add_argument("url")
   p_dl.add_argument("--no-cache", action="store_true")
+  p_dl.add_argument("--compressed", action="store_true")
   p_dl.set_defaults(func=cmd_download)
 
   p_dc = subparsers.add_parser("decompress")
@@ -0,0 +1,74 @@
+import contextlib
+import http.server
+import io
+import random
+from argparse import Namespace
+
+import zstandard as zstd
+
+from openpilot.common.test import OpenpilotTestCase
+from openpilot.selfdrive.test.helpers import http_server_context
+from openpilot.tools.lib.file_downloader import cmd_download
+
+CHUNK_SIZE = 1024 * 1024  # file_downloader reads and downloads in chunks of this size
+
+
+def zstd_frame(compressed_size, seed=0):
+  """Incompressible data and its zstd frame, which is exactly compressed_size bytes long."""
+  size = compressed_size
+  while True:
+    data = random.Random(seed).randbytes(size)
+    frame = zstd.compress(data, 3)
+    if len(frame) == compressed_size:
+      return data, frame
+    size += compressed_size - len(frame)
+
+
+class PayloadHandler(http.server.BaseHTTPRequestHandler):
+  payload = b""
+
+  def do_GET(self):
+    self.send_response(200)
+    self.send_header("Content-Length", str(len(self.payload)))
+    self.end_headers()
+    self.wfile.write(self.payload)
+
+  def log_message(self, *args):
+    pass
+
+
+class TestFileDownloader(OpenpilotTestCase):
+  def test_download_multiple_zstd_frames(self):
+    # the first frame ends with the first downloaded chunk, the others in the middle of one
+    data, frame = zstd_frame(CHUNK_SIZE)
+    tail = b"loggerd" * 100000
+    PayloadHandler.payload = frame + zstd.compress(tail[:1000], 10) + zstd.compress(tail[1000:], 3)
+
+    with http_server_context(handler=PayloadHandler) as (host, port):
+      out = io.StringIO()
+      with contextlib.redirect_stdout(out):
+        cmd_download(Namespace(url=f"http://{host}:{port}/rlog.zst", no_cache=False, compressed=False))
+
+    with open(out.getvalue().strip(), "rb") as f:
+      assert f.read() == data + tail
+
+  def test_download_compressed(self):
+    data, frame = zstd_frame(CHUNK_SIZE + 1000)
+    PayloadHandler.payload = frame
+
+    url = None
+    with http_server_context(handler=PayloadHandler) as (host, port):
+      url = f"http://{host}:{port}/rlog.zst"
+      for _ in range(2):  # downloaded, then served from the cache
+        out = io.StringIO()
+        with contextlib.redirect_stdout(out):
+          cmd_download(Namespace(url=url, no_cache=False, compressed=True))
+        with open(out.getvalue().strip(), "rb") as f:
+          assert f.read() == frame
+
+    # the compressed copy is decompressed for readers that want the log itself
+    out = io.StringIO()
+    with contextlib.redirect_stdout(out):
+      cmd_download(Namespace(url=url, no_cache=False, compressed=False))
+    with open(out.getvalue().strip(), "rb") as f:
+      assert f.read() == data
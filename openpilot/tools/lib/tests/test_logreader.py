@@ -6,14 +6,17 @@ import tempfile
 import os
 import unittest
 import requests
+import zstandard as zstd
 
 from openpilot.common.test import OpenpilotTestCase
 from openpilot.common.parameterized import parameterized
 
 from openpilot.cereal import log as capnp_log
 from openpilot.tools.lib.logreader import _LogFileReader, LogsUnavailable, LogIterable, LogReader, parse_indirect, ReadMode
+from openpilot.tools.lib.file_downloader import decompress_file
 from openpilot.tools.lib.file_sources import InternalUnavailableException
 from openpilot.tools.lib.route import FileName, SegmentRange
+from openpilot.tools.lib.tests.test_file_downloader import CHUNK_SIZE, zstd_frame
 from openpilot.tools.lib.url_file import URLFileException
 
 NUM_SEGS = 17  # number of segments in the test route
@@ -258,6 +261,26 @@ class TestLogReader(OpenpilotTestCase):
     msgs = list(LogReader(self.qlog_path, sort_by_time=True))
     assert msgs == sorted(msgs, key=lambda m: m.logMonoTime)
 
+  def test_multiple_zstd_frames(self):
+    # loggerd starts a new frame when it changes the compression level
+    with open(self.rlog_path, "rb") as f:
+      dat = f.read()
+    half = len(dat) // 2
+    with tempfile.NamedTemporaryFile(suffix=".zst") as rlog:
+      with open(rlog.name, "wb") as f:
+        f.write(zstd.compress(dat[:half], 3) + zstd.compress(dat[half:], 10))
+
+      assert len(list(LogReader(rlog.name))) == len(list(LogReader(self.rlog_path)))
+
+      # decompress_file starts a new decompressor for every frame, also for one that starts with a read
+      data, frame = zstd_frame(4 + CHUNK_SIZE)
+      with open(rlog.name, "wb") as f:
+        f.write(frame + zstd.compress(dat, 10))
+      with tempfile.NamedTemporaryFile() as out:
+        decompress_file(rlog.name, out.name)
+        with open(out.name, "rb") as f:
+          assert f.read() == data + dat
+
   def test_only_union_types(self):
     with tempfile.NamedTemporaryFile() as qlog:
       # write valid Event messages
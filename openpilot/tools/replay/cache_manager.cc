@@ -0,0 +1,134 @@
+#include "tools/replay/cache_manager.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common/hardware/hw.h"
+#include "common/util.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+constexpr char LOCK_FILE[] = ".replay_cache.lock";
+// entries this young may be in the middle of being opened by the process that fetched them
+constexpr int64_t MIN_EVICT_AGE_NS = 60 * 1000000000LL;
+// temporary files are only removed once their writer has clearly died
+constexpr int64_t STALE_TMP_AGE_NS = 24 * 3600 * 1000000000LL;
+
+int64_t wallTimeNs(std::chrono::system_clock::time_point tp) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+}
+
+bool isTempFile(const std::string &name) {
+  // python's mkstemp files and our own "<name>.tmp<pid>" files
+  return util::starts_with(name, "tmp") || name.find(".tmp") != std::string::npos;
+}
+
+}  // namespace
+
+CacheManager &CacheManager::instance() {
+  static CacheManager manager;
+  return manager;
+}
+
+CacheManager::CacheManager() {
+  root_ = Path::download_cache_root();
+  if (!root_.empty() && root_.back() != '/') root_ += "/";
+}
+
+void CacheManager::setQuota(uint64_t bytes) {
+  std::lock_guard lock(mutex_);
+  quota_ = bytes;
+}
+
+void CacheManager::touch(const std::string &path) {
+  // the mtime is left alone, the event and packet index sidecars are validated against it
+  const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+  utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+void CacheManager::recordDownload(const std::string &path, std::chrono::system_clock::time_point requested) {
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  if (!fileStat(path, size, mtime_ns)) return;
+
+  const bool hit = mtime_ns < wallTimeNs(requested);
+  touch(path);
+  {
+    std::lock_guard lock(mutex_);
+    ++(hit ? stats_.hits : stats_.misses);
+  }
+  if (!hit) {
+    prune();
+  }
+}
+
+void CacheManager::prune() {
+  std::lock_guard lock(mutex_);
+  if (quota_ == 0) return;
+
+  // one process prunes at a time, the others skip it instead of waiting for the same result
+  int lock_fd = open((root_ + LOCK_FILE).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  if (lock_fd < 0) return;
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    return;
+  }
+
+  struct Entry {
+    std::string name;
+    uint64_t size;
+    int64_t atime_ns;
+  };
+  std::vector<Entry> entries;
+  uint64_t usage = 0;
+  const int64_t now = wallTimeNs(std::chrono::system_clock::now());
+
+  if (DIR *dir = opendir(root_.c_str())) {
+    while (struct dirent *ent = readdir(dir)) {
+      std::string name = ent->d_name;
+      uint64_t size = 0;
+      int64_t mtime_ns = 0, atime_ns = 0;
+      if (name == LOCK_FILE || !fileStat(root_ + name, size, mtime_ns, &atime_ns)) {
+        continue;
+      }
+      usage += size;
+      // temporary files age from their last write, entries from their last use
+      const bool temp = isTempFile(name);
+      const int64_t age = now - (temp ? mtime_ns : std::max(atime_ns, mtime_ns));
+      if (age >= (temp ? STALE_TMP_AGE_NS : MIN_EVICT_AGE_NS)) {
+        entries.push_back({name, size, std::max(atime_ns, mtime_ns)});
+      }
+    }
+    closedir(dir);
+  }
+
+  if (usage > quota_) {
+    std::sort(entries.begin(), entries.end(), [](auto &l, auto &r) { return l.atime_ns < r.atime_ns; });
+    // open files and mappings of other processes stay valid after unlink
+    for (const auto &e : entries) {
+      if (usage <= quota_) break;
+      if (unlink((root_ + e.name).c_str()) == 0) {
+        usage -= e.size;
+        ++stats_.evicted_files;
+        stats_.evicted_bytes += e.size;
+      }
+    }
+    rDebug("download cache pruned to %s", formattedDataSize(usage).c_str());
+  }
+  stats_.disk_usage = usage;
+
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+CacheManager::Stats CacheManager::stats() {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
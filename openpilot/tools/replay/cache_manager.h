@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Bounds the local download cache, which may be shared by several replay processes.
+// Each file in the cache directory is an entry, its atime is the last access and is bumped on
+// every use. The mtime stays the time it was written, which sidecars are validated against. Once the cache exceeds the quota, the least recently used entries are evicted.
+// Entries only appear through atomic renames, and pruning holds an exclusive flock on a lock
+// file, so concurrent processes never evict under each other's feet.
+class CacheManager {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evicted_files = 0;
+    uint64_t evicted_bytes = 0;
+    uint64_t disk_usage = 0;  // size of the cache after the last prune
+  };
+
+  static CacheManager &instance();
+
+  // 0 disables eviction
+  void setQuota(uint64_t bytes);
+  // Marks a cache entry as used now, so it's evicted last
+  void touch(const std::string &path);
+  // Records a download served from the cache. Files written after `requested` were fetched
+  // by this request and count as misses, which may push the cache over its quota.
+  void recordDownload(const std::string &path, std::chrono::system_clock::time_point requested);
+  // Evicts the least recently used entries until the cache fits the quota
+  void prune();
+  Stats stats();
+
+private:
+  CacheManager();
+
+  std::mutex mutex_;
+  std::string root_;
+  uint64_t quota_ = 10ULL * 1024 * 1024 * 1024;
+  Stats stats_;
+};
@@ -1,6 +1,7 @@
 #include "tools/replay/camera.h"
 
 #include <algorithm>
+#include <cmath>
 
 #include <capnp/dynamic.h>
 
@@ -8,8 +9,11 @@
 #include "tools/replay/util.h"
 
 const int BUFFER_COUNT = 40;
+// frames decoded ahead are held in the vipc buffers, keep well below BUFFER_COUNT
+// so buffers still read by clients are never reused for a prefetched frame
+const int MAX_LOOKAHEAD = 8;
 
-CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
+CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], ReplaySink *sink) : sink_(sink) {
   for (int i = 0; i < MAX_CAMERAS; ++i) {
     std::tie(cameras_[i].width, cameras_[i].height) = camera_size[i];
   }
@@ -22,34 +26,66 @@ CameraServer::~CameraServer() {
       // Clear the queue
       std::pair<FrameReader*, const Event *> item;
       while (cam.queue.try_pop(item)) {
-        --publishing_;
+        frameSent();
       }
 
       // Signal termination and join the thread
       cam.queue.push({});
       cam.thread.join();
     }
+    freeSinkBuffers(cam);
   }
   vipc_server_.reset(nullptr);
 }
 
 void CameraServer::startVipcServer() {
-  vipc_server_.reset(new VisionIpcServer("camerad"));
+  if (!sink_) {
+    vipc_server_.reset(new VisionIpcServer("camerad"));
+  }
   for (auto &cam : cameras_) {
     cam.cached_buf.clear();
+    freeSinkBuffers(cam);
 
     if (cam.width > 0 && cam.height > 0) {
       rInfo("camera[%d] frame size %dx%d", cam.type, cam.width, cam.height);
       auto [stride, y_height, uv_height_, buffer_size] = get_nv12_info(cam.width, cam.height);
       (void)uv_height_;  // unused in replay
-      vipc_server_->create_buffers_with_sizes(cam.stream_type, BUFFER_COUNT, cam.width, cam.height,
-                                              buffer_size, stride, stride * y_height);
+      if (sink_) {
+        // the same buffer rotation as the vipc server, so lookahead keeps working
+        cam.sink_bufs.resize(BUFFER_COUNT);
+        for (auto &buf : cam.sink_bufs) {
+          buf.allocate(buffer_size);
+          buf.init_yuv(cam.width, cam.height, stride, stride * y_height);
+        }
+      } else {
+        vipc_server_->create_buffers_with_sizes(cam.stream_type, BUFFER_COUNT, cam.width, cam.height,
+                                                buffer_size, stride, stride * y_height);
+      }
       if (!cam.thread.joinable()) {
         cam.thread = std::thread(&CameraServer::cameraThread, this, std::ref(cam));
       }
     }
   }
-  vipc_server_->start_listener();
+  if (vipc_server_) {
+    vipc_server_->start_listener();
+  }
+}
+
+void CameraServer::freeSinkBuffers(Camera &cam) {
+  for (auto &buf : cam.sink_bufs) {
+    buf.free();
+  }
+  cam.sink_bufs.clear();
+  cam.next_sink_buf = 0;
+}
+
+VisionBuf *CameraServer::nextBuffer(Camera &cam) {
+  if (!sink_) {
+    return vipc_server_->get_buffer(cam.stream_type);
+  }
+  VisionBuf *buf = &cam.sink_bufs[cam.next_sink_buf];
+  cam.next_sink_buf = (cam.next_sink_buf + 1) % cam.sink_bufs.size();
+  return buf;
 }
 
 void CameraServer::cameraThread(Camera &cam) {
@@ -57,6 +93,8 @@ void CameraServer::cameraThread(Camera &cam) {
     const auto [fr, event] = cam.queue.pop();
     if (!fr) break;
 
+    std::lock_guard lock(cam.decode_lock);
+
     capnp::FlatArrayMessageReader reader(event->data);
     auto evt = reader.getRoot<cereal::Event>();
     auto eidx = capnp::AnyStruct::Reader(evt).getPointerSection()[0].getAs<cereal::EncodeIndex>();
@@ -69,15 +107,23 @@ void CameraServer::cameraThread(Camera &cam) {
           .timestamp_sof = eidx.getTimestampSof(),
           .timestamp_eof = eidx.getTimestampEof(),
       };
-      vipc_server_->send(yuv, &extra);
+      if (sink_) {
+        sink_->sendFrame(cam.type, yuv, extra);
+      } else {
+        vipc_server_->send(yuv, &extra);
+      }
+      if (onFrameSent) onFrameSent(cam.type);
     } else {
       rError("camera[%d] failed to get frame: %lu", cam.type, segment_id);
     }
 
-    // Prefetch the next frame
-    getFrame(cam, fr, segment_id + 1, frame_id + 1);
+    frameSent();
 
-    --publishing_;
+    // Decode the next frames ahead until a new frame is requested
+    const int lookahead = lookahead_;
+    for (int i = 1; i <= lookahead && cam.queue.empty() && !cancel_lookahead_; ++i) {
+      if (!getFrame(cam, fr, segment_id + i, frame_id + i)) break;
+    }
   }
 }
 
@@ -87,12 +133,14 @@ VisionBuf *CameraServer::getFrame(Camera &cam, FrameReader *fr, int32_t segment_
                              [frame_id](VisionBuf *buf) { return buf->get_frame_id() == frame_id; });
   if (buf_it != cam.cached_buf.end()) return *buf_it;
 
-  VisionBuf *yuv_buf = vipc_server_->get_buffer(cam.stream_type);
+  VisionBuf *yuv_buf = nextBuffer(cam);
   if (fr->get(segment_id, yuv_buf)) {
     yuv_buf->set_frame_id(frame_id);
     cam.cached_buf.insert(yuv_buf);
     return yuv_buf;
   }
+  // the buffer may hold a partially decoded frame now
+  cam.cached_buf.erase(yuv_buf);
   return nullptr;
 }
 
@@ -101,7 +149,7 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const Event *even
   if (cam.width != fr->width || cam.height != fr->height) {
     cam.width = fr->width;
     cam.height = fr->height;
-    waitForSent();
+    waitForIdle();
     startVipcServer();
   }
 
@@ -109,8 +157,27 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const Event *even
   cam.queue.push({fr, event});
 }
 
+void CameraServer::frameSent() {
+  std::lock_guard lock(publish_lock_);
+  if (--publishing_ == 0) {
+    publish_cv_.notify_all();
+  }
+}
+
 void CameraServer::waitForSent() {
-  while (publishing_ > 0) {
-    std::this_thread::yield();
+  std::unique_lock lock(publish_lock_);
+  publish_cv_.wait(lock, [this]() { return publishing_ == 0; });
+}
+
+void CameraServer::waitForIdle() {
+  waitForSent();
+  cancel_lookahead_ = true;
+  for (auto &cam : cameras_) {
+    std::lock_guard lock(cam.decode_lock);
   }
+  cancel_lookahead_ = false;
+}
+
+void CameraServer::setPlaybackSpeed(float speed) {
+  lookahead_ = std::clamp((int)std::ceil(speed * 2), 1, MAX_LOOKAHEAD);
 }
@@ -1,22 +1,36 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "openpilot/cereal/visionstream.h"
 #include "msgq/visionipc/visionipc_server.h"
 #include "common/queue.h"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
+#include "tools/replay/sink.h"
 
 class CameraServer {
 public:
-  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
+  // frames go to `sink` instead of VisionIPC when set
+  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, ReplaySink *sink = nullptr);
   ~CameraServer();
   void pushFrame(CameraType type, FrameReader* fr, const Event *event);
   void waitForSent();
+  // waits for the sends and stops decoding ahead, so no frame reader is in use afterwards
+  void waitForIdle();
+  // decode further ahead at higher playback speeds
+  void setPlaybackSpeed(float speed);
+
+  // called from the camera threads after a frame was sent. set before pushing frames.
+  std::function<void(CameraType)> onFrameSent = nullptr;
 
 protected:
   struct Camera {
@@ -27,10 +41,16 @@ protected:
     std::thread thread;
     SafeQueue<std::pair<FrameReader*, const Event *>> queue;
     std::set<VisionBuf *> cached_buf;
+    std::mutex decode_lock;  // held while the camera thread uses a frame reader
+    std::vector<VisionBuf> sink_bufs;  // decode buffers when frames go to a sink
+    size_t next_sink_buf = 0;
   };
   void startVipcServer();
+  void freeSinkBuffers(Camera &cam);
+  VisionBuf *nextBuffer(Camera &cam);
   void cameraThread(Camera &cam);
   VisionBuf *getFrame(Camera &cam, FrameReader *fr, int32_t segment_id, uint32_t frame_id);
+  void frameSent();
 
   Camera cameras_[MAX_CAMERAS] = {
       {.type = NarrowRoadCam, .stream_type = VISION_STREAM_NARROW_ROAD},
@@ -38,5 +58,10 @@ protected:
       {.type = WideRoadCam, .stream_type = VISION_STREAM_WIDE_ROAD},
   };
   std::atomic<int> publishing_ = 0;
+  std::atomic<int> lookahead_ = 1;
+  std::atomic<bool> cancel_lookahead_ = false;
+  std::mutex publish_lock_;
+  std::condition_variable publish_cv_;
   std::unique_ptr<VisionIpcServer> vipc_server_;
+  ReplaySink *sink_ = nullptr;
 };
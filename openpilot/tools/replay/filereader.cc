@@ -1,29 +1,137 @@
 #include "tools/replay/filereader.h"
 
+#include <zstd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <memory>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 #include "common/util.h"
+#include "system/loggerd/zstd_seekable.h"
+#include "tools/replay/cache_manager.h"
 #include "tools/replay/py_downloader.h"
+#include "tools/replay/util.h"
 
 std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
+  compressed_size_ = 0;
+  decompress_seconds_ = 0.0;
+
   const bool is_remote = (file.find("https://") == 0) || (file.find("http://") == 0);
   if (is_remote) {
-    std::string local_path = PyDownloader::download(file, cache_to_local_, abort);
+    // downloads stay compressed, they are decompressed like local files
+    const auto requested = std::chrono::system_clock::now();
+    std::string local_path = PyDownloader::download(file, cache_to_local_, abort, true);
     if (local_path.empty()) return {};
-    return util::read_file(local_path);
+    if (cache_to_local_) {
+      CacheManager::instance().recordDownload(local_path, requested);
+    }
+    std::string data = readLocal(local_path, abort);
+    if (!cache_to_local_) {
+      // without the cache, the downloader hands back a temporary file
+      unlink(local_path.c_str());
+    }
+    return data;
   }
+  return readLocal(file, abort);
+}
+
+std::string FileReader::readLocal(const std::string &file, std::atomic<bool> *abort) {
   char header[4] = {};
   std::ifstream stream(file, std::ios::binary);
   stream.read(header, sizeof(header));
   const std::string magic(header, stream.gcount());
-  if (util::ends_with(file, ".bz2") || util::ends_with(file, ".zst") ||
-      util::starts_with(magic, "BZh") || magic == "\x28\xB5\x2F\xFD") {
-    std::string local_path = PyDownloader::decompress(file, abort);
-    if (local_path.empty()) return {};
-    std::string data = util::read_file(local_path);
-    unlink(local_path.c_str());
+  stream.close();
+
+  const bool is_zstd = util::ends_with(file, ".zst") || magic == "\x28\xB5\x2F\xFD";
+  const bool is_bz2 = util::ends_with(file, ".bz2") || util::starts_with(magic, "BZh");
+  if (is_zstd || is_bz2) {
+    const auto start = std::chrono::steady_clock::now();
+    std::string data;
+    if (is_zstd) {
+      data = zstd_decompress_file(file, abort);
+    } else {
+      // bzip2 is not a vendored dependency, keep decoding it out of process
+      std::string local_path = PyDownloader::decompress(file, abort);
+      if (local_path.empty()) return {};
+      data = util::read_file(local_path);
+      unlink(local_path.c_str());
+    }
+    decompress_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    struct stat st = {};
+    compressed_size_ = stat(file.c_str(), &st) == 0 ? st.st_size : 0;
     return data;
   }
-  return util::read_file(file);
+
+  std::string data = util::read_file(file);
+  compressed_size_ = data.size();
+  return data;
+}
+
+std::string zstd_decompress_file(const std::string &file, std::atomic<bool> *abort) {
+  std::unique_ptr<FILE, decltype(&fclose)> f(fopen(file.c_str(), "rb"), &fclose);
+  if (!f) {
+    rWarning("failed to open %s", file.c_str());
+    return {};
+  }
+
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+  std::vector<char> in_buf(ZSTD_DStreamInSize());
+  const size_t out_chunk = ZSTD_DStreamOutSize();
+
+  std::string out;
+  // the seek table of a seekable log has the exact size. other logs are written as a stream without
+  // content size, or in several frames when their level changed, so the first frame is only a hint.
+  ZstdSeekableReader seekable;
+  if (seekable.open(file)) {
+    size_t content_size = 0;
+    for (const auto &frame : seekable.frames()) content_size += frame.decompressed_size;
+    out.reserve(content_size);
+  }
+
+  size_t out_pos = 0;
+  size_t ret = 0;
+  bool first_chunk = out.capacity() == 0;
+  size_t n = 0;
+  while (!(abort && *abort) && (n = fread(in_buf.data(), 1, in_buf.size(), f.get())) > 0) {
+    if (first_chunk) {
+      unsigned long long content_size = ZSTD_getFrameContentSize(in_buf.data(), n);
+      if (content_size != ZSTD_CONTENTSIZE_ERROR && content_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+        out.reserve(content_size);
+      }
+      first_chunk = false;
+    }
+
+    ZSTD_inBuffer input = {in_buf.data(), n, 0};
+    while (input.pos < input.size) {
+      // decompress directly into the tail of the output string. it grows a chunk at a time, so only
+      // what's about to be written is zero filled, and the reserved capacity is used up before reallocating.
+      if (out_pos == out.size()) {
+        const size_t room = out.capacity() - out_pos;
+        out.resize(out_pos + (room > 0 ? std::min(room, out_chunk) : out_chunk));
+      }
+      ZSTD_outBuffer output = {out.data() + out_pos, out.size() - out_pos, 0};
+      ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+      if (ZSTD_isError(ret)) {
+        rWarning("failed to decompress %s: %s", file.c_str(), ZSTD_getErrorName(ret));
+        break;
+      }
+      out_pos += output.pos;
+    }
+    if (ZSTD_isError(ret)) break;
+  }
+  if (abort && *abort) return {};
+
+  out.resize(out_pos);
+  out.shrink_to_fit();
+  if (ret != 0 && !ZSTD_isError(ret)) {
+    // keep what we have, the log parser recovers the complete events of truncated logs
+    rWarning("%s ended before the end of the zstd frame", file.c_str());
+  }
+  return out;
 }
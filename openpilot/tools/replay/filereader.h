@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <string>
 
 class FileReader {
@@ -9,6 +10,17 @@ public:
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
 
+  uint64_t compressed_size() const { return compressed_size_; }
+  double decompress_seconds() const { return decompress_seconds_; }
+
 private:
+  // decompresses zstd and bzip2 files, others are read as is
+  std::string readLocal(const std::string &file, std::atomic<bool> *abort);
+
   bool cache_to_local_;
+  uint64_t compressed_size_ = 0;
+  double decompress_seconds_ = 0.0;
 };
+
+// Streams a zstd compressed file into memory. Returns an empty string on failure or abort.
+std::string zstd_decompress_file(const std::string &file, std::atomic<bool> *abort = nullptr);
@@ -1,12 +1,24 @@
 #include "tools/replay/framereader.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 
 #include "common/util.h"
 #include "common/yuv.h"
+#include "tools/replay/cache_manager.h"
 #include "tools/replay/py_downloader.h"
 #include "tools/replay/util.h"
 #include "common/hardware/hw.h"
@@ -56,34 +68,174 @@ struct DecoderManager {
     return decoders_[key].get();
   }
 
+  // software decoding threads of one camera, the budget is split evenly so cameras don't oversubscribe cores
+  int threadsPerDecoder() const {
+    int threads = thread_budget_ > 0 ? thread_budget_.load() : (int)std::thread::hardware_concurrency();
+    return std::max(1, threads / std::max(1, cameras_.load()));
+  }
+
+  std::atomic<int> thread_budget_ = 0;
+  std::atomic<int> cameras_ = 1;
   std::mutex mutex_;
   std::map<std::tuple<CameraType, int, int>, std::unique_ptr<VideoDecoder>> decoders_;
 };
 
 DecoderManager decoder_manager;
 
+constexpr char PACKET_INDEX_MAGIC[8] = {'O', 'P', 'P', 'K', 'T', 'I', 'D', 'X'};
+constexpr uint32_t PACKET_INDEX_VERSION = 1;
+
+// sidecar header, the index is only valid for the exact file it was built from
+struct PacketIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t file_size;
+  int64_t file_mtime_ns;
+  uint64_t packet_count;
+};
+
+// LRU of decoded NV12 frames, shared by all readers. It keeps the frames decoded on the way from a key frame
+// to the requested one, so frame stepping and short backward seeks don't decode the whole GOP again.
+// Requested frames aren't kept, forward playback decodes each frame once and never copies it here.
+class FrameCache {
+public:
+  void setLimit(size_t bytes) {
+    std::lock_guard lock(mutex_);
+    limit_ = bytes;
+    evict(0);
+  }
+
+  bool enabled() const { return limit_ > 0; }
+
+  bool get(uint64_t key, VisionBuf *buf) {
+    std::lock_guard lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) return false;
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    const Frame &f = *it->second;
+    const uint8_t *uv = f.data.data() + f.width * f.height;
+    for (int i = 0; i < f.height; ++i) {
+      memcpy(buf->y + i * buf->stride, f.data.data() + i * f.width, f.width);
+    }
+    for (int i = 0; i < f.height / 2; ++i) {
+      memcpy(buf->uv + i * buf->stride, uv + i * f.width, f.width);
+    }
+    return true;
+  }
+
+  bool contains(uint64_t key) {
+    std::lock_guard lock(mutex_);
+    return index_.count(key) > 0;
+  }
+
+  // returns a buffer for a frame, reusing the storage of the least recently used one when full
+  std::vector<uint8_t> acquire(size_t size) {
+    std::lock_guard lock(mutex_);
+    evict(size);
+    std::vector<uint8_t> data = std::move(spare_);
+    data.resize(size);
+    return data;
+  }
+
+  void put(uint64_t key, int width, int height, std::vector<uint8_t> &&data) {
+    std::lock_guard lock(mutex_);
+    if (index_.count(key) || data.size() > limit_) return;
+
+    evict(data.size());
+    used_ += data.size();
+    lru_.push_front({key, width, height, std::move(data)});
+    index_[key] = lru_.begin();
+  }
+
+  void erase(uint32_t reader_id) {
+    std::lock_guard lock(mutex_);
+    for (auto it = lru_.begin(); it != lru_.end();) {
+      if ((it->key >> 32) == reader_id) {
+        used_ -= it->data.size();
+        index_.erase(it->key);
+        it = lru_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+private:
+  struct Frame {
+    uint64_t key;
+    int width, height;
+    std::vector<uint8_t> data;
+  };
+
+  void evict(size_t incoming) {
+    while (!lru_.empty() && used_ + incoming > limit_) {
+      auto &f = lru_.back();
+      used_ -= f.data.size();
+      index_.erase(f.key);
+      spare_ = std::move(f.data);
+      lru_.pop_back();
+    }
+  }
+
+  std::mutex mutex_;
+  std::atomic<size_t> limit_ = 256 * 1024 * 1024;
+  size_t used_ = 0;
+  std::list<Frame> lru_;
+  std::unordered_map<uint64_t, std::list<Frame>::iterator> index_;
+  std::vector<uint8_t> spare_;
+};
+
+FrameCache frame_cache;
+std::atomic<uint32_t> next_reader_id = 0;
+
 }  // namespace
 
-FrameReader::FrameReader() {
+void setFrameCacheLimit(size_t bytes) {
+  frame_cache.setLimit(bytes);
+}
+
+void setDecoderThreads(int threads) {
+  decoder_manager.thread_budget_ = std::max(0, threads);
+}
+
+void setDecodingCameras(int cameras) {
+  decoder_manager.cameras_ = std::max(1, cameras);
+}
+
+FrameReader::FrameReader() : id_(next_reader_id++) {
   av_log_set_level(AV_LOG_QUIET);
 }
 
 FrameReader::~FrameReader() {
+  frame_cache.erase(id_);
   if (input_ctx) avformat_close_input(&input_ctx);
 }
 
 bool FrameReader::load(CameraType type, const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache) {
   std::string local_file_path;
   if (url.find("https://") == 0 || url.find("http://") == 0) {
+    const auto requested = std::chrono::system_clock::now();
     local_file_path = PyDownloader::download(url, local_cache, abort);
     if (local_file_path.empty()) return false;
+    if (local_cache) {
+      CacheManager::instance().recordDownload(local_file_path, requested);
+    }
   } else {
     local_file_path = url;
   }
-  return loadFromFile(type, local_file_path, no_hw_decoder, abort);
+  return loadFromFile(type, local_file_path, no_hw_decoder, abort, local_cache);
+}
+
+bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache) {
+  const auto start = std::chrono::steady_clock::now();
+  bool success = openAndIndex(type, file, no_hw_decoder, abort, local_cache);
+  index_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return success;
 }
 
-bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort) {
+bool FrameReader::openAndIndex(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache) {
   if (avformat_open_input(&input_ctx, file.c_str(), nullptr, nullptr) != 0 ||
       avformat_find_stream_info(input_ctx, nullptr) < 0) {
     rError("Failed to open input file or find video stream");
@@ -104,23 +256,109 @@ bool FrameReader::loadFromFile(CameraType type, const std::string &file, bool no
   width = decoder_->width;
   height = decoder_->height;
 
+  // reuse the packet index of a previous run instead of demuxing the whole file.
+  // temporary downloads are removed once loaded, their index could never be found again.
+  const std::string index_file = local_cache ? cacheSidecarPath("packets_", file) : "";
+  if (local_cache && loadPacketIndex(index_file, file)) {
+    avformat_seek_file(input_ctx, 0, 0, 0, 0, AVSEEK_FLAG_BYTE);
+    return true;
+  }
+
   AVPacket pkt;
   packets_info.reserve(60 * 20);  // 20fps, one minute
   while (!(abort && *abort) && av_read_frame(input_ctx, &pkt) == 0) {
     if (pkt.stream_index == video_stream_idx_) {
-      packets_info.emplace_back(PacketInfo{.flags = pkt.flags, .pos = pkt.pos});
+      packets_info.emplace_back(PacketInfo{.flags = pkt.flags, .size = pkt.size, .pos = pkt.pos, .pts = pkt.pts});
     }
     av_packet_unref(&pkt);
   }
   avio_seek(input_ctx->pb, 0, SEEK_SET);
+  if (abort && *abort) return false;
+
+  if (local_cache && !packets_info.empty()) {
+    writePacketIndex(index_file, file);
+  }
   return !packets_info.empty();
 }
 
+bool FrameReader::loadPacketIndex(const std::string &index_file, const std::string &file) {
+  uint64_t file_size = 0;
+  int64_t mtime_ns = 0;
+  if (!fileStat(file, file_size, mtime_ns)) return false;
+
+  std::unique_ptr<FILE, decltype(&fclose)> f(fopen(index_file.c_str(), "rb"), &fclose);
+  if (!f) return false;
+
+  PacketIndexHeader header = {};
+  if (fread(&header, sizeof(header), 1, f.get()) != 1 ||
+      memcmp(header.magic, PACKET_INDEX_MAGIC, sizeof(PACKET_INDEX_MAGIC)) != 0 ||
+      header.version != PACKET_INDEX_VERSION || header.entry_size != sizeof(PacketInfo) ||
+      header.file_size != file_size || header.file_mtime_ns != mtime_ns || header.packet_count == 0) {
+    return false;
+  }
+
+  packets_info.resize(header.packet_count);
+  if (fread(packets_info.data(), sizeof(PacketInfo), packets_info.size(), f.get()) != packets_info.size()) {
+    packets_info.clear();
+    return false;
+  }
+  CacheManager::instance().touch(index_file);
+  return true;
+}
+
+void FrameReader::writePacketIndex(const std::string &index_file, const std::string &file) const {
+  PacketIndexHeader header = {};
+  if (!fileStat(file, header.file_size, header.file_mtime_ns)) return;
+
+  memcpy(header.magic, PACKET_INDEX_MAGIC, sizeof(PACKET_INDEX_MAGIC));
+  header.version = PACKET_INDEX_VERSION;
+  header.entry_size = sizeof(PacketInfo);
+  header.packet_count = packets_info.size();
+
+  util::create_directories(index_file.substr(0, index_file.rfind('/')), 0775);
+  // write to a temporary file and rename it, so concurrent readers never see a partial index
+  const std::string tmp_file = index_file + ".tmp" + std::to_string(getpid());
+  FILE *f = fopen(tmp_file.c_str(), "wb");
+  if (!f) return;
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(packets_info.data(), sizeof(PacketInfo), packets_info.size(), f) == packets_info.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_file.c_str(), index_file.c_str()) != 0) {
+    rWarning("failed to write packet index %s", index_file.c_str());
+    unlink(tmp_file.c_str());
+  }
+}
+
 bool FrameReader::get(int idx, VisionBuf *buf) {
   if (!buf || idx < 0 || idx >= packets_info.size()) {
     return false;
   }
-  return decoder_->decode(this, idx, buf);
+  if (frame_cache.get(frameKey(idx), buf)) {
+    return true;
+  }
+  if (first_decode_seconds > 0) {
+    return decoder_->decode(this, idx, buf);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  bool success = decoder_->decode(this, idx, buf);
+  first_decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return success;
+}
+
+int FrameReader::keyFrameBefore(int idx) const {
+  for (int i = idx; i >= 0; --i) {
+    if (packets_info[i].flags & AV_PKT_FLAG_KEY) return i;
+  }
+  return 0;
+}
+
+size_t FrameReader::memoryUsage() const {
+  // frames are decoded on demand by the shared decoders, so a reader only holds its index and io buffer
+  size_t usage = packets_info.capacity() * sizeof(PacketInfo);
+  if (input_ctx && input_ctx->pb) usage += input_ctx->pb->buffer_size;
+  return usage;
 }
 
 // class VideoDecoder
@@ -152,6 +390,11 @@ bool FFmpegVideoDecoder::open(AVCodecParameters *codecpar, bool hw_decoder) {
   if (hw_decoder && !initHardwareDecoder(HW_DEVICE_TYPE)) {
     rWarning("No device with hardware decoder found. fallback to CPU decoding.");
   }
+  if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+    // frame threading pipelines consecutive frames, slice threading helps within the key frames
+    decoder_ctx->thread_count = decoder_manager.threadsPerDecoder();
+    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
 
   if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
     rError("Failed to open codec");
@@ -187,16 +430,13 @@ bool FFmpegVideoDecoder::initHardwareDecoder(AVHWDeviceType hw_device_type) {
 }
 
 bool FFmpegVideoDecoder::decode(FrameReader *reader, int idx, VisionBuf *buf) {
-  int current_idx = idx;
-  if (idx != reader->prev_idx + 1) {
-    // seeking to the nearest key frame
-    for (int i = idx; i >= 0; --i) {
-      if (reader->packets_info[i].flags & AV_PKT_FLAG_KEY) {
-        current_idx = i;
-        break;
-      }
-    }
-
+  // The decoder continues from where it left off when no key frame lies between its position and the
+  // target, so stepping and seeking forward within a GOP don't go back to the key frame. A threaded
+  // decoder holds back frames of the last reader, so this only works for the same reader.
+  int current_idx = reader->prev_idx + 1;
+  const int key_idx = reader->keyFrameBefore(idx);
+  if (idx < current_idx || key_idx > current_idx || reader->id() != last_reader_ || draining_) {
+    current_idx = key_idx;
     auto pos = reader->packets_info[current_idx].pos;
     int ret = avformat_seek_file(reader->input_ctx, 0, pos, pos, pos, AVSEEK_FLAG_BYTE);
     if (ret < 0) {
@@ -204,68 +444,88 @@ bool FFmpegVideoDecoder::decode(FrameReader *reader, int idx, VisionBuf *buf) {
       return false;
     }
     avcodec_flush_buffers(decoder_ctx);
+    draining_ = false;
   }
   reader->prev_idx = idx;
+  last_reader_ = reader->id();
 
   AVPacket pkt;
-  while (av_read_frame(reader->input_ctx, &pkt) >= 0) {
+  while (true) {
+    int ret = 0;
+    if (AVFrame *frame = receiveFrame(ret)) {
+      const uint64_t key = reader->frameKey(current_idx);
+      if (current_idx < idx && frame_cache.enabled() && !frame_cache.contains(key)) {
+        auto data = frame_cache.acquire(width * height * 3 / 2);
+        copyBuffer(frame, data.data(), data.data() + width * height, width);
+        frame_cache.put(key, width, height, std::move(data));
+      }
+
+      if (current_idx++ == idx) {
+        copyBuffer(frame, buf->y, buf->uv, buf->stride);
+        return true;
+      }
+      continue;
+    }
+    if (ret != AVERROR(EAGAIN) || draining_) break;
+
+    // the decoder needs more input
+    if (av_read_frame(reader->input_ctx, &pkt) < 0) {
+      // end of file, drain the frames still queued in the decoder threads
+      avcodec_send_packet(decoder_ctx, nullptr);
+      draining_ = true;
+      continue;
+    }
     // Skip non-video packets
     if (pkt.stream_index != reader->video_stream_idx_) {
       av_packet_unref(&pkt);
       continue;
     }
 
-    AVFrame *frame = decodeFrame(&pkt);
+    ret = avcodec_send_packet(decoder_ctx, &pkt);
     av_packet_unref(&pkt);
-    if (!frame) {
-      rError("Failed to decode frame at index %d", current_idx);
+    if (ret < 0) {
+      rError("Error sending a packet for decoding: %d", ret);
+      last_reader_ = -1;
       return false;
     }
-
-    if (current_idx++ == idx) {
-      return copyBuffer(frame, buf);
-    }
   }
   rError("Failed to find frame at index %d", idx);
+  last_reader_ = -1;
   return false;
 }
 
-AVFrame *FFmpegVideoDecoder::decodeFrame(AVPacket *pkt) {
-  int ret = avcodec_send_packet(decoder_ctx, pkt);
-  if (ret < 0) {
-    rError("Error sending a packet for decoding: %d", ret);
-    return nullptr;
-  }
-
+AVFrame *FFmpegVideoDecoder::receiveFrame(int &ret) {
   ret = avcodec_receive_frame(decoder_ctx, av_frame_);
   if (ret != 0) {
-    rError("avcodec_receive_frame error: %d", ret);
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+      rError("avcodec_receive_frame error: %d", ret);
+    }
     return nullptr;
   }
 
   if (av_frame_->format == hw_pix_fmt && av_hwframe_transfer_data(hw_frame_, av_frame_, 0) < 0) {
     rError("error transferring frame data from GPU to CPU");
+    ret = AVERROR(EIO);
     return nullptr;
   }
   return (av_frame_->format == hw_pix_fmt) ? hw_frame_ : av_frame_;
 }
 
-bool FFmpegVideoDecoder::copyBuffer(AVFrame *f, VisionBuf *buf) {
+void FFmpegVideoDecoder::copyBuffer(AVFrame *f, uint8_t *y, uint8_t *uv, int stride) {
   if (hw_pix_fmt == HW_PIX_FMT) {
     for (int i = 0; i < height/2; i++) {
-      memcpy(buf->y + (i*2 + 0)*buf->stride, f->data[0] + (i*2 + 0)*f->linesize[0], width);
-      memcpy(buf->y + (i*2 + 1)*buf->stride, f->data[0] + (i*2 + 1)*f->linesize[0], width);
-      memcpy(buf->uv + i*buf->stride, f->data[1] + i*f->linesize[1], width);
+      memcpy(y + (i*2 + 0)*stride, f->data[0] + (i*2 + 0)*f->linesize[0], width);
+      memcpy(y + (i*2 + 1)*stride, f->data[0] + (i*2 + 1)*f->linesize[0], width);
+      memcpy(uv + i*stride, f->data[1] + i*f->linesize[1], width);
     }
   } else {
     yuv::i420_to_nv12(f->data[0], f->linesize[0],
                       f->data[1], f->linesize[1],
                       f->data[2], f->linesize[2],
-                      buf->y, buf->stride,
-                      buf->uv, buf->stride,
+                      y, stride,
+                      uv, stride,
                       width, height);
   }
-  return true;
 }
 
 #ifndef __APPLE__
@@ -281,16 +541,11 @@ bool V4LVideoDecoder::open(AVCodecParameters *codecpar, bool hw_decoder) {
 }
 
 bool V4LVideoDecoder::decode(FrameReader *reader, int idx, VisionBuf *buf) {
-  int from_idx = idx;
-  if (idx != reader->prev_idx + 1) {
-    // seeking to the nearest key frame
-    for (int i = idx; i >= 0; --i) {
-      if (reader->packets_info[i].flags & AV_PKT_FLAG_KEY) {
-        from_idx = i;
-        break;
-      }
-    }
-
+  // continue from the decoder's position when no key frame lies between it and the target
+  int from_idx = reader->prev_idx + 1;
+  const int key_idx = reader->keyFrameBefore(idx);
+  if (idx < from_idx || key_idx > from_idx || reader->id() != last_reader_) {
+    from_idx = key_idx;
     auto pos = reader->packets_info[from_idx].pos;
     int ret = avformat_seek_file(reader->input_ctx, 0, pos, pos, pos, AVSEEK_FLAG_BYTE);
     if (ret < 0) {
@@ -299,6 +554,7 @@ bool V4LVideoDecoder::decode(FrameReader *reader, int idx, VisionBuf *buf) {
     }
   }
   reader->prev_idx = idx;
+  last_reader_ = reader->id();
   bool result = false;
   AVPacket pkt;
   v4l_decoder.avctx = reader->input_ctx;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -17,16 +18,32 @@ extern "C" {
 
 class VideoDecoder;
 
+// Caps the memory of the decoded frame cache shared by all readers. 0 disables the cache.
+void setFrameCacheLimit(size_t bytes);
+// Software decoding threads shared by the decoders of all cameras. 0 uses one thread per core.
+void setDecoderThreads(int threads);
+// Number of cameras decoded concurrently, the decoding threads are split between them.
+void setDecodingCameras(int cameras);
+
 class FrameReader {
 public:
   FrameReader();
   ~FrameReader();
   bool load(CameraType type, const std::string &url, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false);
-  bool loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr);
+  // the packet index is cached next to persistent files, not temporary downloads
+  bool loadFromFile(CameraType type, const std::string &file, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false);
   bool get(int idx, VisionBuf *buf);
   size_t getFrameCount() const { return packets_info.size(); }
+  size_t memoryUsage() const;
+  uint32_t id() const { return id_; }
+  // index of the last key frame at or before idx
+  int keyFrameBefore(int idx) const;
+  // key of a decoded frame of this reader in the frame cache
+  uint64_t frameKey(int idx) const { return ((uint64_t)id_ << 32) | (uint32_t)idx; }
 
   int width = 0, height = 0;
+  double index_seconds = 0;         // time to open the file and build or load the packet index
+  double first_decode_seconds = 0;  // time to decode the first requested frame
 
   VideoDecoder *decoder_ = nullptr;
   AVFormatContext *input_ctx = nullptr;
@@ -34,9 +51,18 @@ public:
   int prev_idx = -1;
   struct PacketInfo {
     int flags;
+    int size;
     int64_t pos;
+    int64_t pts;
   };
   std::vector<PacketInfo> packets_info;
+
+private:
+  bool openAndIndex(CameraType type, const std::string &file, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache);
+  bool loadPacketIndex(const std::string &index_file, const std::string &file);
+  void writePacketIndex(const std::string &index_file, const std::string &file) const;
+
+  const uint32_t id_;
 };
 
 
@@ -57,13 +83,16 @@ public:
 
 private:
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
-  AVFrame *decodeFrame(AVPacket *pkt);
-  bool copyBuffer(AVFrame *f, VisionBuf *buf);
+  // returns the next decoded frame, or nullptr with ret set to EAGAIN when more input is needed
+  AVFrame *receiveFrame(int &ret);
+  void copyBuffer(AVFrame *f, uint8_t *y, uint8_t *uv, int stride);
 
   AVFrame *av_frame_, *hw_frame_;
   AVCodecContext *decoder_ctx = nullptr;
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
+  int64_t last_reader_ = -1;  // id of the reader whose frames are queued in the decoder
+  bool draining_ = false;
 };
 
 #ifndef __APPLE__
@@ -76,5 +105,6 @@ public:
 
 private:
   V4LDecoder v4l_decoder;
+  int64_t last_reader_ = -1;  // id of the reader the decoder state belongs to
 };
 #endif
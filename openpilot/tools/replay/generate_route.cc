@@ -0,0 +1,331 @@
+#include <getopt.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <capnp/dynamic.h>
+
+#include "openpilot/cereal/messaging/messaging.h"
+#include "common/util.h"
+#include "openpilot/cereal/services.h"
+#include "tools/replay/util.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+// Writes a synthetic route that replay can load from a local directory. It gives the
+// replay benchmark a reproducible input that doesn't depend on the network or a real drive.
+
+const std::string ROUTE_TIMESTAMP = "2024-01-01--12-00-00";
+const uint64_t ROUTE_START_NANOS = 100ULL * 1000000000ULL;
+const int VIDEO_FPS = 20;
+
+const std::string helpText =
+R"(Usage: generate_route [options] <output dir>
+Writes a synthetic route, replay it with: replay --data_dir <output dir> )" + ROUTE_TIMESTAMP + R"(
+Options:
+  -n, --segments     Number of segments. Default is 2
+  -d, --duration     Seconds per segment. Default is 60
+  -s, --services     Services to log as name[:hz], comma-separated. The rate defaults to the service frequency
+                     Default is can,carState,carControl,controlsState,selfdriveState,modelV2,deviceState
+  -c, --can          CAN messages per can event. Default is 8
+      --video        Encode a small qcamera.ts per segment, indexed by narrowRoadEncodeIdx
+      --video-size   <width>x<height> of the video. Default is 320x240
+  -h, --help         Show this help message
+)";
+
+struct GeneratorConfig {
+  std::string output_dir;
+  int segments = 2;
+  int duration = 60;
+  std::vector<std::pair<std::string, double>> services;
+  int can_messages = 8;
+  bool video = false;
+  int width = 320;
+  int height = 240;
+};
+
+bool parseArgs(int argc, char *argv[], GeneratorConfig &config) {
+  const struct option cli_options[] = {
+      {"segments", required_argument, nullptr, 'n'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"services", required_argument, nullptr, 's'},
+      {"can", required_argument, nullptr, 'c'},
+      {"video", no_argument, nullptr, 0},
+      {"video-size", required_argument, nullptr, 0},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  std::string service_list = "can,carState,carControl,controlsState,selfdriveState,modelV2,deviceState";
+  int opt, option_index = 0;
+  while ((opt = getopt_long(argc, argv, "n:d:s:c:h", cli_options, &option_index)) != -1) {
+    switch (opt) {
+      case 'n': config.segments = std::max(1, std::atoi(optarg)); break;
+      case 'd': config.duration = std::max(1, std::atoi(optarg)); break;
+      case 's': service_list = optarg; break;
+      case 'c': config.can_messages = std::max(1, std::atoi(optarg)); break;
+      case 0: {
+        std::string name = cli_options[option_index].name;
+        if (name == "video") config.video = true;
+        else if (name == "video-size" && sscanf(optarg, "%dx%d", &config.width, &config.height) != 2) return false;
+        break;
+      }
+      case 'h': std::cout << helpText; return false;
+      default: return false;
+    }
+  }
+  if (optind >= argc) {
+    std::cout << helpText;
+    return false;
+  }
+  config.output_dir = argv[optind];
+
+  const auto event_schema = capnp::Schema::from<cereal::Event>();
+  for (const auto &item : split(service_list, ',')) {
+    auto fields = split(item, ':');
+    const std::string &name = fields[0];
+    auto it = services.find(name);
+    double hz = fields.size() > 1 ? std::atof(fields[1].c_str()) : (it != services.end() ? it->second.frequency : 0);
+    auto field = event_schema.findFieldByName(name);
+    if (!field || hz <= 0 || !(field->getType().isStruct() || field->getType().isList())) {
+      std::cerr << "unknown service or rate: " << item << "\n";
+      return false;
+    }
+    config.services.emplace_back(name, hz);
+  }
+  return true;
+}
+
+void appendMessage(std::string &log, MessageBuilder &msg) {
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  log.append((const char *)bytes.begin(), bytes.size());
+}
+
+void buildServiceEvent(MessageBuilder &msg, const std::string &name, uint64_t mono_time, const GeneratorConfig &config) {
+  auto event = msg.initEvent();
+  event.setLogMonoTime(mono_time);
+  if (name == "can" || name == "sendcan") {
+    auto can = name == "can" ? event.initCan(config.can_messages) : event.initSendcan(config.can_messages);
+    for (int i = 0; i < config.can_messages; ++i) {
+      uint8_t dat[8];
+      for (int j = 0; j < 8; ++j) dat[j] = (mono_time >> (j * 4)) + i;
+      can[i].setAddress(0x100 + i);
+      can[i].setSrc(i % 3);
+      can[i].setDat(kj::arrayPtr(dat, sizeof(dat)));
+    }
+  } else if (name == "selfdriveState") {
+    // toggle engagement and alerts so the timeline has entries
+    auto state = event.initSelfdriveState();
+    const uint64_t seconds = (mono_time - ROUTE_START_NANOS) / 1000000000ULL;
+    state.setEnabled((seconds / 10) % 2 == 0);
+    if (seconds % 30 < 3) {
+      state.setAlertSize(cereal::SelfdriveState::AlertSize::SMALL);
+      state.setAlertText1("Synthetic Alert");
+    }
+  } else {
+    // other services keep their default values, enough to exercise parsing and publishing
+    capnp::DynamicStruct::Builder dynamic_event = event;
+    auto field = dynamic_event.getSchema().getFieldByName(name);
+    if (field.getType().isList()) {
+      dynamic_event.init(field, 1);
+    } else {
+      dynamic_event.init(field);
+    }
+  }
+}
+
+bool writeVideo(const std::string &file, int frame_count, const GeneratorConfig &config) {
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    std::cerr << "no H.264 encoder available\n";
+    return false;
+  }
+
+  AVFormatContext *output = nullptr;
+  if (avformat_alloc_output_context2(&output, nullptr, "mpegts", file.c_str()) < 0) return false;
+
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  ctx->width = config.width;
+  ctx->height = config.height;
+  ctx->time_base = {1, VIDEO_FPS};
+  ctx->framerate = {VIDEO_FPS, 1};
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->gop_size = VIDEO_FPS;
+  ctx->max_b_frames = 0;
+  // replay's decoder expects a frame back for every packet
+  av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+  av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+
+  AVStream *stream = avformat_new_stream(output, nullptr);
+  AVFrame *frame = av_frame_alloc();
+  AVPacket *pkt = av_packet_alloc();
+  bool ok = avcodec_open2(ctx, codec, nullptr) == 0 &&
+            avcodec_parameters_from_context(stream->codecpar, ctx) >= 0 &&
+            avio_open(&output->pb, file.c_str(), AVIO_FLAG_WRITE) >= 0;
+  stream->time_base = ctx->time_base;
+  ok = ok && avformat_write_header(output, nullptr) >= 0;
+
+  frame->format = ctx->pix_fmt;
+  frame->width = ctx->width;
+  frame->height = ctx->height;
+  ok = ok && av_frame_get_buffer(frame, 0) == 0;
+
+  auto drain = [&]() {
+    while (ok && avcodec_receive_packet(ctx, pkt) == 0) {
+      av_packet_rescale_ts(pkt, ctx->time_base, stream->time_base);
+      pkt->stream_index = stream->index;
+      ok = av_interleaved_write_frame(output, pkt) >= 0;
+    }
+  };
+
+  for (int i = 0; ok && i < frame_count; ++i) {
+    ok = av_frame_make_writable(frame) == 0;
+    // a moving gradient, so consecutive frames differ
+    for (int y = 0; y < ctx->height; ++y) {
+      for (int x = 0; x < ctx->width; ++x) {
+        frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
+      }
+    }
+    for (int y = 0; y < ctx->height / 2; ++y) {
+      memset(frame->data[1] + y * frame->linesize[1], 128, ctx->width / 2);
+      memset(frame->data[2] + y * frame->linesize[2], 128, ctx->width / 2);
+    }
+    frame->pts = i;
+    ok = ok && avcodec_send_frame(ctx, frame) == 0;
+    drain();
+  }
+  if (ok) {
+    avcodec_send_frame(ctx, nullptr);
+    drain();
+    ok = av_write_trailer(output) == 0;
+  }
+
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  if (output->pb) avio_closep(&output->pb);
+  avformat_free_context(output);
+  return ok;
+}
+
+bool writeCompressed(const std::string &file, const std::string &log) {
+  std::string compressed(ZSTD_compressBound(log.size()), '\0');
+  size_t size = ZSTD_compress(compressed.data(), compressed.size(), log.data(), log.size(), 3);
+  if (ZSTD_isError(size)) {
+    std::cerr << "failed to compress " << file << ": " << ZSTD_getErrorName(size) << "\n";
+    return false;
+  }
+  return util::write_file(file.c_str(), compressed.data(), size, O_WRONLY | O_CREAT | O_TRUNC) == 0;
+}
+
+bool writeSegment(int n, const GeneratorConfig &config) {
+  const std::string dir = config.output_dir + "/" + ROUTE_TIMESTAMP + "--" + std::to_string(n);
+  if (!util::create_directories(dir, 0775)) {
+    std::cerr << "failed to create " << dir << "\n";
+    return false;
+  }
+
+  const uint64_t segment_start = ROUTE_START_NANOS + (uint64_t)n * config.duration * 1000000000ULL;
+  const uint64_t segment_nanos = (uint64_t)config.duration * 1000000000ULL;
+
+  // (mono_time, service index) of every event in the segment, in log order. -1 is a video frame.
+  std::vector<std::pair<uint64_t, int>> schedule;
+  for (int i = 0; i < (int)config.services.size(); ++i) {
+    const double interval = 1e9 / config.services[i].second;
+    for (uint64_t k = 0; k * interval < segment_nanos; ++k) {
+      schedule.emplace_back(segment_start + (uint64_t)(k * interval), i);
+    }
+  }
+  const int frame_count = config.video ? config.duration * VIDEO_FPS : 0;
+  for (int k = 0; k < frame_count; ++k) {
+    schedule.emplace_back(segment_start + (uint64_t)k * 1000000000ULL / VIDEO_FPS, -1);
+  }
+  std::stable_sort(schedule.begin(), schedule.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+  std::string rlog, qlog;
+  {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(segment_start);
+    event.initInitData().setWallTimeNanos(1704110400ULL * 1000000000ULL + (segment_start - ROUTE_START_NANOS));
+    appendMessage(rlog, msg);
+    appendMessage(qlog, msg);
+  }
+  {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(segment_start);
+    event.initCarParams().setCarFingerprint("MOCK");
+    appendMessage(rlog, msg);
+    appendMessage(qlog, msg);
+  }
+
+  std::vector<uint64_t> counts(config.services.size(), 0);
+  for (const auto &[mono_time, i] : schedule) {
+    MessageBuilder msg;
+    if (i == -1) {
+      // replay only plays frames of FULL_H_E_V_C indexes, the decoder doesn't care about the codec
+      const uint32_t k = (mono_time - segment_start) * VIDEO_FPS / 1000000000ULL;
+      auto event = msg.initEvent();
+      event.setLogMonoTime(mono_time);
+      auto idx = event.initNarrowRoadEncodeIdx();
+      idx.setFrameId(n * frame_count + k);
+      idx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      idx.setSegmentNum(n);
+      idx.setSegmentId(k);
+      idx.setTimestampSof(mono_time);
+      idx.setTimestampEof(mono_time);
+      appendMessage(rlog, msg);
+      continue;
+    }
+
+    const std::string &name = config.services[i].first;
+    buildServiceEvent(msg, name, mono_time, config);
+    appendMessage(rlog, msg);
+
+    // qlogs keep every n-th message of the decimated services
+    auto it = services.find(name);
+    if (it != services.end() && it->second.decimation > 0 && counts[i] % it->second.decimation == 0) {
+      appendMessage(qlog, msg);
+    }
+    ++counts[i];
+  }
+
+  if (!writeCompressed(dir + "/rlog.zst", rlog) || !writeCompressed(dir + "/qlog.zst", qlog)) {
+    return false;
+  }
+  if (config.video && !writeVideo(dir + "/qcamera.ts", frame_count, config)) {
+    std::cerr << "failed to write " << dir << "/qcamera.ts\n";
+    return false;
+  }
+  std::cout << "segment " << n << ": " << schedule.size() + 2 << " events, rlog "
+            << formattedDataSize(rlog.size()) << ", qlog " << formattedDataSize(qlog.size()) << "\n";
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  GeneratorConfig config;
+  if (!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  for (int n = 0; n < config.segments; ++n) {
+    if (!writeSegment(n, config)) {
+      return 1;
+    }
+  }
+
+  std::cout << "replay --data_dir " << config.output_dir << " " << ROUTE_TIMESTAMP << "\n";
+  return 0;
+}
@@ -1,12 +1,173 @@
 #include "tools/replay/logreader.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <capnp/schema.h>
+
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include "tools/replay/cache_manager.h"
 #include "tools/replay/filereader.h"
 #include "tools/replay/py_downloader.h"
 #include "tools/replay/util.h"
 #include "common/util.h"
+#include "system/loggerd/zstd_seekable.h"
+
+namespace {
+
+// logs are only split into chunks of at least this size, smaller ones are parsed faster by a single thread
+constexpr size_t MIN_PARSE_CHUNK = 8 * 1024 * 1024;
+constexpr int MAX_PARSE_THREADS = 16;
+// cores available for splitting logs, shared by all the readers parsing at the same time
+std::atomic<int> spare_parse_threads = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+
+// On-disk event index: header, a table of pre-sorted events, then the message bytes they point into.
+// It is keyed by the log's path and invalidated when the log's size or mtime changes.
+constexpr char EVENT_CACHE_MAGIC[8] = {'O', 'P', 'E', 'V', 'T', 'I', 'D', 'X'};
+constexpr uint32_t EVENT_CACHE_VERSION = 2;
+
+struct EventCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t file_size;
+  int64_t file_mtime_ns;
+  uint64_t event_count;
+  uint64_t data_offset;
+  uint64_t data_size;
+};
+
+struct EventCacheEntry {
+  uint64_t mono_time;
+  uint64_t offset;
+  uint32_t size_words;
+  uint16_t which;
+  uint16_t reserved;
+  int32_t eidx_segnum;
+  uint32_t reserved2;
+};
+
+static_assert(sizeof(EventCacheHeader) % sizeof(capnp::word) == 0);
+static_assert(sizeof(EventCacheEntry) % sizeof(capnp::word) == 0);
+
+template <typename T>
+inline T readLE(const uint8_t *p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+// Reads logMonoTime and the union discriminant of an Event straight from the capnp wire layout.
+// Returns the size of the message in words, or 0 if it has to go through a full reader.
+size_t scanEvent(kj::ArrayPtr<const capnp::word> words, uint64_t &mono_time, uint16_t &which) {
+  static const uint32_t discriminant_offset =
+      capnp::Schema::from<cereal::Event>().getProto().getStruct().getDiscriminantOffset();
+
+  const uint8_t *bytes = (const uint8_t *)words.begin();
+  const size_t available = words.size();
+  if (available < 2) return 0;
+
+  // segment table: (segment count - 1), then the size of each segment, padded to a word
+  const uint32_t segment_count = readLE<uint32_t>(bytes) + 1;
+  const size_t header_words = (segment_count + 2) / 2;
+  if (segment_count > 512 || header_words >= available) return 0;
+
+  const uint32_t segment0_words = readLE<uint32_t>(bytes + 4);
+  uint64_t total_words = header_words;
+  for (uint32_t i = 0; i < segment_count; ++i) {
+    total_words += readLE<uint32_t>(bytes + 4 + i * 4);
+  }
+  if (segment0_words == 0 || total_words > available) return 0;
+
+  // the root struct pointer is the first word of segment 0. far pointers are left to the full reader.
+  const uint64_t root = readLE<uint64_t>(bytes + header_words * sizeof(capnp::word));
+  if (root == 0 || (root & 3) != 0) return 0;
+
+  const int64_t start = 1 + ((int32_t)(uint32_t)root >> 2);
+  const uint16_t data_words = (root >> 32) & 0xffff;
+  const uint16_t pointer_words = root >> 48;
+  if (start < 1 || start + data_words + pointer_words > segment0_words) return 0;
+
+  // fields beyond the encoded data section hold their default value
+  const uint8_t *data = bytes + (header_words + start) * sizeof(capnp::word);
+  const size_t data_bytes = data_words * sizeof(capnp::word);
+  mono_time = data_bytes >= sizeof(uint64_t) ? readLE<uint64_t>(data) : 0;
+  which = data_bytes >= (discriminant_offset + 1) * sizeof(uint16_t) ? readLE<uint16_t>(data + discriminant_offset * sizeof(uint16_t)) : 0;
+  return total_words;
+}
+
+// Decompresses only the frames of a seekable log that may hold kept events. Returns false if the log isn't seekable.
+bool readSeekableLog(const std::string &file, const ServiceFilter &filter, std::string &data) {
+  ZstdSeekableReader reader;
+  if (!reader.open(file)) return false;
+
+  std::bitset<LOG_INDEX_SERVICE_BITS> services;
+  for (size_t which = 0; which < std::max(filter.services.size(), filter.frames.size()); ++which) {
+    if (filter.keepEvent(which) || filter.keepFrame(which)) {
+      if (which >= LOG_INDEX_SERVICE_BITS) return false;
+      services.set(which);
+    }
+  }
+  // old logs are migrated unless they have a selfdriveState
+  services.set(cereal::Event::SELFDRIVE_STATE);
+  data = reader.read(0, UINT64_MAX, services);
+  return true;
+}
+
+// Reserves spare cores to split a log between threads. Returns the number of threads besides the caller's.
+int acquireParseThreads(size_t size) {
+  const int wanted = std::min<size_t>(size / MIN_PARSE_CHUNK, MAX_PARSE_THREADS) - 1;
+  int spare = spare_parse_threads;
+  while (wanted > 0 && spare > 0) {
+    const int n = std::min(wanted, spare);
+    if (spare_parse_threads.compare_exchange_weak(spare, spare - n)) return n;
+  }
+  return 0;
+}
+
+// Merges adjacent sorted runs of `events` pairwise, the merges of each level split between up to
+// `max_threads` threads, including the caller's. The runs come from consecutive parts of the log, so they barely overlap.
+void mergeRuns(std::vector<Event> &events, std::vector<size_t> runs, int max_threads) {
+  while (runs.size() > 2) {
+    const size_t pairs = (runs.size() - 1) / 2;
+    std::atomic<size_t> next_pair = 0;
+    auto merge_pairs = [&]() {
+      for (size_t i = next_pair++; i < pairs; i = next_pair++) {
+        std::inplace_merge(events.begin() + runs[2 * i], events.begin() + runs[2 * i + 1], events.begin() + runs[2 * i + 2]);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min<int>(max_threads, pairs); ++i) {
+      threads.emplace_back(merge_pairs);
+    }
+    merge_pairs();
+    for (auto &t : threads) t.join();
+
+    std::vector<size_t> merged;
+    for (size_t i = 0; i <= pairs; ++i) {
+      merged.push_back(runs[2 * i]);
+    }
+    if (runs.size() % 2 == 0) {
+      merged.push_back(runs.back());  // an odd run out is merged on the next level
+    }
+    runs = std::move(merged);
+  }
+}
+
+}  // namespace
+
+LogReader::~LogReader() {
+  if (cache_addr_) munmap(cache_addr_, cache_size_);
+}
 
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache,
                      const ProgressCallback &progress) {
@@ -16,6 +177,7 @@ bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool loca
   download_seconds_ = 0.0;
   decompress_seconds_ = 0.0;
   parse_seconds_ = 0.0;
+  sort_seconds_ = 0.0;
 
   if (progress) {
     installDownloadProgressHandler([progress](uint64_t cur, uint64_t total, bool success) {
@@ -25,18 +187,70 @@ bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool loca
     });
   }
   const auto download_start = Clock::now();
-  std::string data = FileReader(local_cache).read(url, abort);
+  std::string file = url;
+  std::string cache_file;
+  if (local_cache) {
+    // the event cache sits next to the local copy of the log
+    if (url.find("https://") == 0 || url.find("http://") == 0) {
+      const auto requested = std::chrono::system_clock::now();
+      file = PyDownloader::download(url, true, abort, true);
+      if (!file.empty()) {
+        CacheManager::instance().recordDownload(file, requested);
+      }
+    }
+    if (!file.empty()) {
+      cache_file = cacheSidecarPath("events_", file);
+    }
+  }
+
+  const auto parse_start = Clock::now();
+  if (!cache_file.empty() && loadFromCache(cache_file, file)) {
+    if (progress) {
+      installDownloadProgressHandler(nullptr);
+    }
+    download_seconds_ = std::chrono::duration<double>(parse_start - download_start).count();
+    parse_seconds_ = std::chrono::duration<double>(Clock::now() - parse_start).count();
+    decompressed_size_ = cache_size_;
+    return true;
+  }
+
+  FileReader reader(local_cache);
+  std::string data;
+  const bool is_local = !file.empty() && file.find("https://") != 0 && file.find("http://") != 0;
+  if (is_local && cache_file.empty() && !filter_.empty() && readSeekableLog(file, filter_, data)) {
+    // without the event cache, a filtered load skips the frames without kept events
+    uint64_t file_size = 0;
+    int64_t mtime_ns = 0;
+    compressed_size_ = fileStat(file, file_size, mtime_ns) ? file_size : 0;
+    decompress_seconds_ = std::chrono::duration<double>(Clock::now() - parse_start).count();
+  } else {
+    data = file.empty() ? std::string() : reader.read(file, abort);
+    compressed_size_ = reader.compressed_size();
+    decompress_seconds_ = reader.decompress_seconds();
+  }
   const auto download_end = Clock::now();
   if (progress) {
     installDownloadProgressHandler(nullptr);
   }
-  compressed_size_ = data.size();
-  download_seconds_ = std::chrono::duration<double>(download_end - download_start).count();
+  download_seconds_ = std::chrono::duration<double>(download_end - download_start).count() - decompress_seconds_;
   decompressed_size_ = data.size();
 
+  if (!cache_file.empty() && !filter_.empty() && !data.empty()) {
+    // the cache always holds every event. parse the whole log once and serve the filtered view from the cache.
+    LogReader full;
+    if (full.load(data.data(), data.size(), abort, progress) && full.writeCache(cache_file, file) && loadFromCache(cache_file, file)) {
+      parse_seconds_ = full.parse_seconds_;
+      sort_seconds_ = full.sort_seconds_;
+      return true;
+    }
+  }
+
   bool success = !data.empty() && load(data.data(), data.size(), abort, progress);
-  if (filters_.empty())
+  if (filter_.empty())
     raw_ = std::move(data);
+  if (success && !cache_file.empty() && filter_.empty()) {
+    writeCache(cache_file, file);
+  }
   return success;
 }
 
@@ -44,75 +258,186 @@ bool LogReader::load(const char *data, size_t size, std::atomic<bool> *abort,
                      const ProgressCallback &progress) {
   using Clock = std::chrono::steady_clock;
   const auto parse_start = Clock::now();
-  try {
-    events.reserve(65000);
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
-    const uint64_t total_bytes = size;
-    const uint64_t report_step = std::max<uint64_t>(1, total_bytes / 200);
-    uint64_t last_reported = 0;
-    if (progress) {
-      progress(ProgressStage::Parsing, 0, total_bytes);
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+  if (progress) {
+    progress(ProgressStage::Parsing, 0, size);
+  }
+
+  std::vector<size_t> runs;  // bounds of the sorted runs left by a parallel parse
+  // the reserved threads are held until the runs are merged
+  const int extra_threads = acquireParseThreads(size);
+  if (extra_threads > 0) {
+    runs = parseParallel(words, extra_threads + 1, abort);
+  } else {
+    bool has_selfdrive_state = false;
+    try {
+      events.reserve(65000);
+      parseEvents(words, buffer_, events, has_selfdrive_state, abort, progress, size);
+    } catch (const kj::Exception &e) {
+      rWarning("Failed to parse log : %s.\nRetrieved %zu events from corrupt log", e.getDescription().cStr(), events.size());
+    }
+    requires_migration = !has_selfdrive_state;
+  }
+
+  if (progress) {
+    progress(ProgressStage::Parsing, size, size);
+  }
+
+  if (requires_migration) {
+    migrateOldEvents();
+    runs.clear();
+  }
+
+  parse_seconds_ = std::chrono::duration<double>(Clock::now() - parse_start).count();
+
+  const bool success = !events.empty() && !(abort && *abort);
+  if (success) {
+    events.shrink_to_fit();
+    const auto sort_start = Clock::now();
+    if (runs.empty()) {
+      std::sort(events.begin(), events.end());
+    } else {
+      mergeRuns(events, std::move(runs), extra_threads + 1);
     }
-    while (words.size() > 0 && !(abort && *abort)) {
+    sort_seconds_ = std::chrono::duration<double>(Clock::now() - sort_start).count();
+  }
+  spare_parse_threads += extra_threads;
+  return success;
+}
+
+// Parses the messages of `words` into `out`, copying the kept ones to `arena` when filtering.
+// Throws on corrupt data, keeping the events parsed before it.
+void LogReader::parseEvents(kj::ArrayPtr<const capnp::word> words, MonotonicBuffer &arena, std::vector<Event> &out,
+                            bool &has_selfdrive_state, std::atomic<bool> *abort, const ProgressCallback &progress,
+                            uint64_t total_bytes) const {
+  const uint64_t report_step = std::max<uint64_t>(1, total_bytes / 200);
+  uint64_t last_reported = 0;
+  while (words.size() > 0 && !(abort && *abort)) {
+    uint64_t mono_time = 0;
+    uint16_t which_value = 0;
+    kj::ArrayPtr<const capnp::word> event_data;
+    if (size_t msg_words = scanEvent(words, mono_time, which_value)) {
+      event_data = words.slice(0, msg_words);
+    } else {
+      // unusual layouts (e.g. multi-segment messages) and corrupt data go through the full reader
       capnp::FlatArrayMessageReader reader(words);
       auto event = reader.getRoot<cereal::Event>();
-      auto which = event.which();
-      auto event_data = kj::arrayPtr(words.begin(), reader.getEnd());
-      words = kj::arrayPtr(reader.getEnd(), words.end());
-      if (which == cereal::Event::Which::SELFDRIVE_STATE) {
-        requires_migration = false;
-      }
+      which_value = event.which();
+      mono_time = event.getLogMonoTime();
+      event_data = kj::arrayPtr(words.begin(), reader.getEnd());
+    }
+    words = kj::arrayPtr(event_data.end(), words.end());
 
-      if (!filters_.empty()) {
-        if (which >= filters_.size() || !filters_[which])
-          continue;
-        auto buf = buffer_.allocate(event_data.size() * sizeof(capnp::word));
-        memcpy(buf, event_data.begin(), event_data.size() * sizeof(capnp::word));
-        event_data = kj::arrayPtr((const capnp::word *)buf, event_data.size());
+    auto which = (cereal::Event::Which)which_value;
+    if (which == cereal::Event::Which::SELFDRIVE_STATE) {
+      has_selfdrive_state = true;
+    }
+
+    const bool is_encode_idx = which == cereal::Event::NARROW_ROAD_ENCODE_IDX ||
+                               which == cereal::Event::CABIN_ENCODE_IDX ||
+                               which == cereal::Event::WIDE_ROAD_ENCODE_IDX;
+    const bool keep_event = filter_.keepEvent(which);
+    const bool keep_frame = is_encode_idx && filter_.keepFrame(which);
+    if (!keep_event && !keep_frame) continue;
+
+    if (!filter_.empty()) {
+      auto buf = arena.allocate(event_data.size() * sizeof(capnp::word));
+      memcpy(buf, event_data.begin(), event_data.size() * sizeof(capnp::word));
+      event_data = kj::arrayPtr((const capnp::word *)buf, event_data.size());
+    }
+
+    if (keep_event) {
+      out.emplace_back(which, mono_time, event_data);
+    }
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (keep_frame) {
+      capnp::FlatArrayMessageReader reader(event_data);
+      auto event = reader.getRoot<cereal::Event>();
+      auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C) {
+        uint64_t sof = idx.getTimestampSof();
+        out.emplace_back(which, sof ? sof : mono_time, event_data, idx.getSegmentNum());
       }
+    }
 
-      uint64_t mono_time = event.getLogMonoTime();
-      const Event &evt = events.emplace_back(which, mono_time, event_data);
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt.which == cereal::Event::NARROW_ROAD_ENCODE_IDX ||
-          evt.which == cereal::Event::CABIN_ENCODE_IDX ||
-          evt.which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
-        auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
-        if (idx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C) {
-          uint64_t sof = idx.getTimestampSof();
-          events.emplace_back(which, sof ? sof : mono_time, event_data, idx.getSegmentNum());
-        }
+    if (progress) {
+      const uint64_t current_bytes =
+        total_bytes - static_cast<uint64_t>(words.size() * sizeof(capnp::word));
+      if (current_bytes >= total_bytes || current_bytes - last_reported >= report_step) {
+        progress(ProgressStage::Parsing, current_bytes, total_bytes);
+        last_reported = current_bytes;
       }
+    }
+  }
+}
 
-      if (progress) {
-        const uint64_t current_bytes =
-          total_bytes - static_cast<uint64_t>(words.size() * sizeof(capnp::word));
-        if (current_bytes >= total_bytes || current_bytes - last_reported >= report_step) {
-          progress(ProgressStage::Parsing, current_bytes, total_bytes);
-          last_reported = current_bytes;
-        }
+// Splits the log at message boundaries and parses the chunks on their own threads, each into its own
+// arena, sorting them as they finish. Returns the bounds of the sorted runs left in `events`.
+std::vector<size_t> LogReader::parseParallel(kj::ArrayPtr<const capnp::word> words, int threads, std::atomic<bool> *abort) {
+  // finding the boundaries only reads the message headers, the copying and frame events are left to the threads
+  std::vector<kj::ArrayPtr<const capnp::word>> chunks;
+  const size_t chunk_words = words.size() / threads + 1;
+  const capnp::word *chunk_begin = words.begin(), *pos = words.begin();
+  std::string error;
+  try {
+    while (pos != words.end()) {
+      uint64_t mono_time = 0;
+      uint16_t which = 0;
+      auto remaining = kj::arrayPtr(pos, words.end());
+      if (size_t msg_words = scanEvent(remaining, mono_time, which)) {
+        pos += msg_words;
+      } else {
+        pos = capnp::FlatArrayMessageReader(remaining).getEnd();
+      }
+      if ((size_t)(pos - chunk_begin) >= chunk_words) {
+        chunks.push_back(kj::arrayPtr(chunk_begin, pos));
+        chunk_begin = pos;
       }
     }
   } catch (const kj::Exception &e) {
-    rWarning("Failed to parse log : %s.\nRetrieved %zu events from corrupt log", e.getDescription().cStr(), events.size());
+    // the log ends at the corrupt message, like in a serial parse
+    error = e.getDescription().cStr();
   }
-
-  if (progress) {
-    progress(ProgressStage::Parsing, size, size);
+  if (pos != chunk_begin) {
+    chunks.push_back(kj::arrayPtr(chunk_begin, pos));
   }
 
-  if (requires_migration) {
-    migrateOldEvents();
+  std::vector<std::vector<Event>> chunk_events(chunks.size());
+  std::unique_ptr<bool[]> has_selfdrive_state(new bool[chunks.size()]());
+  arenas_.clear();
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    arenas_.push_back(std::make_unique<MonotonicBuffer>(1024 * 1024));
   }
+  auto parseChunk = [&](size_t i) {
+    try {
+      chunk_events[i].reserve(65000 / chunks.size());
+      parseEvents(chunks[i], i == 0 ? buffer_ : *arenas_[i - 1], chunk_events[i], has_selfdrive_state[i], abort, {}, 0);
+    } catch (const kj::Exception &e) {
+      rWarning("Failed to parse log chunk : %s", e.getDescription().cStr());
+    }
+    std::sort(chunk_events[i].begin(), chunk_events[i].end());
+  };
 
-  parse_seconds_ = std::chrono::duration<double>(Clock::now() - parse_start).count();
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    workers.emplace_back(parseChunk, i);
+  }
+  if (!chunks.empty()) parseChunk(0);
+  for (auto &t : workers) t.join();
 
-  if (!events.empty() && !(abort && *abort)) {
-    events.shrink_to_fit();
-    std::sort(events.begin(), events.end());
-    return true;
+  size_t total = 0;
+  for (const auto &c : chunk_events) total += c.size();
+  events.reserve(total);
+  std::vector<size_t> runs = {0};
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    events.insert(events.end(), chunk_events[i].begin(), chunk_events[i].end());
+    requires_migration = requires_migration && !has_selfdrive_state[i];
+    runs.push_back(events.size());
+  }
+  if (!error.empty()) {
+    rWarning("Failed to parse log : %s.\nRetrieved %zu events from corrupt log", error.c_str(), events.size());
   }
-  return false;
+  return runs;
 }
 
 void LogReader::migrateOldEvents() {
@@ -152,8 +477,136 @@ void LogReader::migrateOldEvents() {
       msg.serializeToBuffer(reinterpret_cast<unsigned char *>(buf), buf_size);
 
       // Store the migrated event in the events list
-      auto event_data = kj::arrayPtr(reinterpret_cast<const capnp::word *>(buf), buf_size);
+      auto event_data = kj::arrayPtr(reinterpret_cast<const capnp::word *>(buf), buf_size / sizeof(capnp::word));
       events.emplace_back(new_evt.which(), new_evt.getLogMonoTime(), event_data);
     }
   }
 }
+
+bool LogReader::loadFromCache(const std::string &cache_file, const std::string &file) {
+  uint64_t file_size = 0;
+  int64_t mtime_ns = 0;
+  if (!fileStat(file, file_size, mtime_ns)) return false;
+
+  int fd = open(cache_file.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st = {};
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(EventCacheHeader)) {
+    addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) return false;
+
+  const size_t size = st.st_size;
+  const auto *header = reinterpret_cast<const EventCacheHeader *>(addr);
+  bool valid = memcmp(header->magic, EVENT_CACHE_MAGIC, sizeof(EVENT_CACHE_MAGIC)) == 0 &&
+               header->version == EVENT_CACHE_VERSION &&
+               header->entry_size == sizeof(EventCacheEntry) &&
+               header->file_size == file_size && header->file_mtime_ns == mtime_ns &&
+               header->event_count > 0 &&
+               header->data_offset == sizeof(EventCacheHeader) + header->event_count * sizeof(EventCacheEntry) &&
+               header->data_offset + header->data_size == size;
+
+  std::vector<Event> cached_events;
+  std::unordered_set<uint64_t> used_offsets;
+  size_t used_bytes = 0;
+  if (valid) {
+    const auto *entries = reinterpret_cast<const EventCacheEntry *>(header + 1);
+    const char *data = (const char *)addr + header->data_offset;
+    cached_events.reserve(header->event_count);
+    for (uint64_t i = 0; i < header->event_count; ++i) {
+      const EventCacheEntry &entry = entries[i];
+      if (entry.offset + (uint64_t)entry.size_words * sizeof(capnp::word) > header->data_size) {
+        valid = false;
+        break;
+      }
+      if (!(entry.eidx_segnum == -1 ? filter_.keepEvent(entry.which) : filter_.keepFrame(entry.which))) {
+        continue;
+      }
+      // encodeIdx frame events share the message of their index event
+      if (used_offsets.insert(entry.offset).second) {
+        used_bytes += (size_t)entry.size_words * sizeof(capnp::word);
+      }
+      auto event_data = kj::arrayPtr(reinterpret_cast<const capnp::word *>(data + entry.offset), entry.size_words);
+      cached_events.emplace_back((cereal::Event::Which)entry.which, entry.mono_time, event_data, entry.eidx_segnum);
+    }
+  }
+
+  if (!valid || cached_events.empty()) {
+    if (!valid) rWarning("ignoring invalid event cache %s", cache_file.c_str());
+    munmap(addr, size);
+    return false;
+  }
+
+  // events are stored sorted, the filtered subset stays sorted
+  events = std::move(cached_events);
+  if (cache_addr_) munmap(cache_addr_, cache_size_);
+  cache_addr_ = addr;
+  cache_size_ = size;
+  cache_used_ = used_bytes;
+  CacheManager::instance().touch(cache_file);
+  return true;
+}
+
+bool LogReader::writeCache(const std::string &cache_file, const std::string &file) const {
+  EventCacheHeader header = {};
+  if (!fileStat(file, header.file_size, header.file_mtime_ns)) return false;
+
+  std::vector<EventCacheEntry> entries;
+  entries.reserve(events.size());
+  std::vector<kj::ArrayPtr<const capnp::word>> blobs;
+  std::unordered_map<const capnp::word *, uint64_t> offsets;
+  uint64_t data_size = 0;
+  for (const Event &e : events) {
+    // encodeIdx frame events share the message of their index event
+    auto [it, inserted] = offsets.try_emplace(e.data.begin(), data_size);
+    if (inserted) {
+      blobs.push_back(e.data);
+      data_size += e.data.size() * sizeof(capnp::word);
+    }
+    entries.push_back({.mono_time = e.mono_time, .offset = it->second, .size_words = (uint32_t)e.data.size(),
+                       .which = (uint16_t)e.which, .eidx_segnum = e.eidx_segnum});
+  }
+
+  memcpy(header.magic, EVENT_CACHE_MAGIC, sizeof(EVENT_CACHE_MAGIC));
+  header.version = EVENT_CACHE_VERSION;
+  header.entry_size = sizeof(EventCacheEntry);
+  header.event_count = entries.size();
+  header.data_offset = sizeof(EventCacheHeader) + entries.size() * sizeof(EventCacheEntry);
+  header.data_size = data_size;
+
+  util::create_directories(cache_file.substr(0, cache_file.rfind('/')), 0775);
+  // write to a temporary file and rename it, so concurrent readers never map a partial cache
+  const std::string tmp_file = cache_file + ".tmp" + std::to_string(getpid());
+  FILE *f = fopen(tmp_file.c_str(), "wb");
+  if (!f) return false;
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(entries.data(), sizeof(EventCacheEntry), entries.size(), f) == entries.size();
+  for (size_t i = 0; ok && i < blobs.size(); ++i) {
+    // coalesce blobs that are adjacent in memory into a single write
+    const capnp::word *begin = blobs[i].begin(), *end = blobs[i].end();
+    while (i + 1 < blobs.size() && blobs[i + 1].begin() == end) {
+      end = blobs[++i].end();
+    }
+    ok = fwrite(begin, sizeof(capnp::word), end - begin, f) == (size_t)(end - begin);
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+    rWarning("failed to write event cache %s", cache_file.c_str());
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  // the decompressed events are several times the size of the download
+  CacheManager::instance().prune();
+  return true;
+}
+
+size_t LogReader::memoryUsage() const {
+  // the mapping is reclaimable file backed pages, a filtered reader only touches the messages it kept
+  size_t usage = raw_.capacity() + events.capacity() * sizeof(Event) + buffer_.capacity() + cache_used_;
+  for (const auto &arena : arenas_) usage += arena->capacity();
+  return usage;
+}
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -26,6 +27,19 @@ public:
   int32_t eidx_segnum;
 };
 
+// Services kept while parsing a log. An empty filter keeps every event.
+struct ServiceFilter {
+  std::vector<bool> services;  // indexed by cereal::Event::Which
+  std::vector<bool> frames;    // encodeIdx services whose frame events are kept, even if the service itself is not
+
+  bool empty() const { return services.empty(); }
+  bool keepEvent(uint16_t which) const { return services.empty() || (which < services.size() && services[which]); }
+  bool keepFrame(uint16_t which) const {
+    if (services.empty()) return true;
+    return frames.empty() ? keepEvent(which) : (which < frames.size() && frames[which]);
+  }
+};
+
 class LogReader {
 public:
   enum class ProgressStage {
@@ -35,7 +49,8 @@ public:
 
   using ProgressCallback = std::function<void(ProgressStage stage, uint64_t current, uint64_t total)>;
 
-  LogReader(const std::vector<bool> &filters = {}) { filters_ = filters; }
+  LogReader(const ServiceFilter &filter = {}) : filter_(filter) {}
+  ~LogReader();
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr,
             bool local_cache = false, const ProgressCallback &progress = {});
   bool load(const char *data, size_t size, std::atomic<bool> *abort = nullptr,
@@ -47,17 +62,30 @@ public:
   double download_seconds() const { return download_seconds_; }
   double decompress_seconds() const { return decompress_seconds_; }
   double parse_seconds() const { return parse_seconds_; }
+  double sort_seconds() const { return sort_seconds_; }
+  size_t memoryUsage() const;
 
 private:
+  void parseEvents(kj::ArrayPtr<const capnp::word> words, MonotonicBuffer &arena, std::vector<Event> &out,
+                   bool &has_selfdrive_state, std::atomic<bool> *abort, const ProgressCallback &progress,
+                   uint64_t total_bytes) const;
+  std::vector<size_t> parseParallel(kj::ArrayPtr<const capnp::word> words, int threads, std::atomic<bool> *abort);
   void migrateOldEvents();
+  bool loadFromCache(const std::string &cache_file, const std::string &file);
+  bool writeCache(const std::string &cache_file, const std::string &file) const;
 
   std::string raw_;
   bool requires_migration = true;
-  std::vector<bool> filters_;
+  ServiceFilter filter_;
   MonotonicBuffer buffer_{1024 * 1024};
+  std::vector<std::unique_ptr<MonotonicBuffer>> arenas_;  // copies of the chunks parsed by other threads
+  void *cache_addr_ = nullptr;
+  size_t cache_size_ = 0;
+  size_t cache_used_ = 0;  // bytes of the mapped event cache the kept events point at
   uint64_t compressed_size_ = 0;
   uint64_t decompressed_size_ = 0;
   double download_seconds_ = 0.0;
   double decompress_seconds_ = 0.0;
   double parse_seconds_ = 0.0;
+  double sort_seconds_ = 0.0;
 };
@@ -1,5 +1,6 @@
 #include <getopt.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <iomanip>
 #include <iostream>
@@ -9,6 +10,9 @@
 
 #include "common/prefix.h"
 #include "common/timing.h"
+#include "common/util.h"
+#include "json11/json11.hpp"
+#include "tools/replay/cache_manager.h"
 #include "tools/replay/consoleui.h"
 #include "tools/replay/replay.h"
 #include "tools/replay/util.h"
@@ -19,6 +23,10 @@ Options:
   -a, --allow        Whitelist of services to send (comma-separated)
   -b, --block        Blacklist of services to send (comma-separated)
   -c, --cache        Cache <n> segments in memory. Default is 5
+      --cache-mb     Cache as many segments as fit in <n> MB of memory, instead of a fixed count
+      --frame-cache-mb Keep up to <n> MB of decoded video frames for stepping and short seeks. Default is 256
+      --disk-cache-gb Keep the local download cache under <n> GB, evicting the least recently used files. Default is 10, 0 disables eviction
+      --decode-threads Share <n> threads between the software video decoders of all cameras. Default is one per core
   -s, --start        Start from <seconds>
   -x, --playback     Playback <speed>
       --demo         Use a demo route instead of providing your own
@@ -35,6 +43,10 @@ Options:
       --no-vipc      Do not output video
       --all          Output all messages including bookmarkButton, uiDebug, userBookmark
       --benchmark    Run in benchmark mode (process all events then exit with stats)
+                     With --playback, follow log time at that speed and measure publish lag
+      --benchmark-json Write the benchmark results as JSON to <file>, or - for stdout
+      --sink         Run headless, sending events and frames to a sink instead of msgq and VisionIPC:
+                     null (count only), ring[:<mb>] (copy into a memory ring) or file:<path> (write the events as a log)
   -h, --help         Show this help message
 )";
 
@@ -48,7 +60,13 @@ struct ReplayConfig {
   bool auto_source = false;
   int start_seconds = 0;
   int cache_segments = -1;
+  int cache_mb = -1;
+  int frame_cache_mb = -1;
+  int decode_threads = -1;
+  int disk_cache_gb = -1;
   float playback_speed = -1;
+  std::string benchmark_json;
+  std::string sink;
 };
 
 bool parseArgs(int argc, char *argv[], ReplayConfig &config) {
@@ -56,6 +74,11 @@ bool parseArgs(int argc, char *argv[], ReplayConfig &config) {
       {"allow", required_argument, nullptr, 'a'},
       {"block", required_argument, nullptr, 'b'},
       {"cache", required_argument, nullptr, 'c'},
+      {"cache-mb", required_argument, nullptr, 0},
+      {"frame-cache-mb", required_argument, nullptr, 0},
+      {"decode-threads", required_argument, nullptr, 0},
+      {"disk-cache-gb", required_argument, nullptr, 0},
+      {"sink", required_argument, nullptr, 0},
       {"start", required_argument, nullptr, 's'},
       {"playback", required_argument, nullptr, 'x'},
       {"demo", no_argument, nullptr, 0},
@@ -73,6 +96,7 @@ bool parseArgs(int argc, char *argv[], ReplayConfig &config) {
       {"no-vipc", no_argument, nullptr, 0},
       {"all", no_argument, nullptr, 0},
       {"benchmark", no_argument, nullptr, 0},
+      {"benchmark-json", required_argument, nullptr, 0},
       {"help", no_argument, nullptr, 'h'},
       {nullptr, 0, nullptr, 0},  // Terminating entry
   };
@@ -110,6 +134,18 @@ bool parseArgs(int argc, char *argv[], ReplayConfig &config) {
         std::string name = cli_options[option_index].name;
         if (name == "demo") config.route = DEMO_ROUTE;
         else if (name == "auto") config.auto_source = true;
+        else if (name == "cache-mb") config.cache_mb = std::atoi(optarg);
+        else if (name == "frame-cache-mb") config.frame_cache_mb = std::atoi(optarg);
+        else if (name == "decode-threads") config.decode_threads = std::atoi(optarg);
+        else if (name == "disk-cache-gb") config.disk_cache_gb = std::atoi(optarg);
+        else if (name == "sink") {
+          config.sink = optarg;
+          config.flags |= REPLAY_FLAG_BENCHMARK;
+        }
+        else if (name == "benchmark-json") {
+          config.benchmark_json = optarg;
+          config.flags |= REPLAY_FLAG_BENCHMARK;
+        }
         else config.flags |= flag_map.at(name);
         break;
       }
@@ -131,6 +167,81 @@ bool parseArgs(int argc, char *argv[], ReplayConfig &config) {
   return true;
 }
 
+double percentile(std::vector<uint64_t> values, double p) {
+  if (values.empty()) return 0;
+  size_t n = std::min(values.size() - 1, (size_t)(p / 100.0 * values.size()));
+  std::nth_element(values.begin(), values.begin() + n, values.end());
+  return values[n];
+}
+
+bool writeBenchmarkJson(const Replay &replay, const std::string &file) {
+  const auto &stats = replay.getBenchmarkStats();
+  const auto cache = CacheManager::instance().stats();
+
+  json11::Json sink;  // null when publishing to msgq and VisionIPC
+  if (replay.sink()) {
+    const auto sink_stats = replay.sink()->stats();
+    sink = json11::Json::object{
+      {"name", replay.sink()->name()},
+      {"events", (double)sink_stats.events},
+      {"event_mb", sink_stats.event_bytes / (1024.0 * 1024.0)},
+      {"frames", (double)sink_stats.frames},
+      {"frame_mb", sink_stats.frame_bytes / (1024.0 * 1024.0)},
+    };
+  }
+
+  json11::Json::object stages;
+  for (const auto &[name, seconds] : stats.stage_seconds) {
+    stages[name] = seconds * 1000.0;
+  }
+
+  json11::Json::array timeline;
+  for (const auto &[ts, event] : stats.timeline) {
+    timeline.push_back(json11::Json::object{{"t_ms", (ts - stats.process_start_ts) / 1e6}, {"event", event}});
+  }
+
+  json11::Json lag;  // null unless playback was paced
+  if (!stats.lag_ns.empty()) {
+    lag = json11::Json::object{
+      {"p50", percentile(stats.lag_ns, 50) / 1e6},
+      {"p90", percentile(stats.lag_ns, 90) / 1e6},
+      {"p99", percentile(stats.lag_ns, 99) / 1e6},
+      {"max", *std::max_element(stats.lag_ns.begin(), stats.lag_ns.end()) / 1e6},
+    };
+  }
+
+  const double publish_seconds = (stats.publish_end_ts - stats.publish_start_ts) / 1e9;
+  json11::Json result = json11::Json::object{
+    {"route", replay.route().name()},
+    {"speed", replay.getSpeed()},
+    {"stages_ms", stages},
+    {"events_published", (double)stats.events_published},
+    {"events_per_second", publish_seconds > 0 ? stats.events_published / publish_seconds : 0.0},
+    {"publish_lag_ms", lag},
+    {"peak_rss_mb", stats.peak_rss_kb / 1024.0},
+    {"sink", sink},
+    {"download_cache", json11::Json::object{
+      {"hits", (double)cache.hits},
+      {"misses", (double)cache.misses},
+      {"evicted_files", (double)cache.evicted_files},
+      {"evicted_mb", cache.evicted_bytes / (1024.0 * 1024.0)},
+      {"disk_usage_mb", cache.disk_usage / (1024.0 * 1024.0)},
+    }},
+    {"timeline", timeline},
+  };
+
+  const std::string output = result.dump() + "\n";
+  if (file == "-") {
+    std::cout << output;
+    return true;
+  }
+  if (util::write_file(file.c_str(), output.data(), output.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+    std::cerr << "failed to write " << file << "\n";
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char *argv[]) {
 #ifdef __APPLE__
   // With all sockets opened, we might hit the default limit of 256 on macOS
@@ -156,8 +267,30 @@ int main(int argc, char *argv[]) {
   if (config.cache_segments > 0) {
     replay.setSegmentCacheLimit(config.cache_segments);
   }
+  if (config.cache_mb > 0) {
+    replay.setSegmentCacheBudget((size_t)config.cache_mb * 1024 * 1024);
+  }
+  if (config.frame_cache_mb >= 0) {
+    setFrameCacheLimit((size_t)config.frame_cache_mb * 1024 * 1024);
+  }
+  if (config.disk_cache_gb >= 0) {
+    CacheManager::instance().setQuota((uint64_t)config.disk_cache_gb * 1024 * 1024 * 1024);
+    CacheManager::instance().prune();
+  }
+  if (config.decode_threads > 0) {
+    setDecoderThreads(config.decode_threads);
+  }
+  if (!config.sink.empty()) {
+    auto sink = ReplaySink::create(config.sink);
+    if (!sink) {
+      std::cerr << "invalid sink: " << config.sink << "\n";
+      return 1;
+    }
+    replay.setSink(std::move(sink));
+  }
   if (config.playback_speed > 0) {
     replay.setSpeed(std::clamp(config.playback_speed, ConsoleUI::speed_array.front(), ConsoleUI::speed_array.back()));
+    replay.setBenchmarkPaced(true);
   }
   if (!replay.load()) {
     return 1;
@@ -170,6 +303,10 @@ int main(int argc, char *argv[]) {
     const auto &stats = replay.getBenchmarkStats();
     uint64_t process_start = stats.process_start_ts;
 
+    if (!config.benchmark_json.empty()) {
+      return writeBenchmarkJson(replay, config.benchmark_json) ? 0 : 1;
+    }
+
     std::cout << "\n===== REPLAY BENCHMARK RESULTS =====\n";
     std::cout << "Route: " << replay.route().name() << "\n\n";
 
@@ -182,6 +319,19 @@ int main(int argc, char *argv[]) {
                 << event << "\n";
     }
 
+    if (auto sink = replay.sink()) {
+      const auto sink_stats = sink->stats();
+      const double seconds = (stats.publish_end_ts - stats.publish_start_ts) / 1e9;
+      std::cout << "\nSINK " << sink->name() << ": " << sink_stats.events << " events ("
+                << formattedDataSize(sink_stats.event_bytes) << "), " << sink_stats.frames << " frames ("
+                << formattedDataSize(sink_stats.frame_bytes) << ")";
+      if (seconds > 0) {
+        std::cout << ", " << std::fixed << std::setprecision(0) << sink_stats.events / seconds << " events/s, "
+                  << std::setprecision(1) << sink_stats.frames / seconds << " frames/s";
+      }
+      std::cout << "\n";
+    }
+
     return 0;
   }
 
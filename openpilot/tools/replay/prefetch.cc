@@ -0,0 +1,74 @@
+#include "tools/replay/prefetch.h"
+
+#include <algorithm>
+#include <utility>
+
+PrefetchScheduler::PrefetchScheduler(int io_threads, int cpu_threads) {
+  for (int i = 0; i < std::max(1, io_threads); ++i) {
+    threads_.emplace_back(&PrefetchScheduler::workerThread, this, IO);
+  }
+  for (int i = 0; i < std::max(1, cpu_threads); ++i) {
+    threads_.emplace_back(&PrefetchScheduler::workerThread, this, CPU);
+  }
+}
+
+PrefetchScheduler::~PrefetchScheduler() {
+  {
+    std::lock_guard lock(mutex_);
+    exit_ = true;
+  }
+  for (auto &cv : cv_) cv.notify_all();
+  for (auto &t : threads_) t.join();
+}
+
+void PrefetchScheduler::submit(Pool pool, const void *owner, int seg_num, std::function<void()> fn) {
+  {
+    std::lock_guard lock(mutex_);
+    queues_[pool].push_back({owner, seg_num, next_seq_++, std::move(fn)});
+  }
+  cv_[pool].notify_one();
+}
+
+void PrefetchScheduler::cancel(const void *owner) {
+  std::unique_lock lock(mutex_);
+  // a running job may still queue its next stage, so drop queued jobs on every wakeup
+  done_cv_.wait(lock, [&]() {
+    for (auto &q : queues_) {
+      q.remove_if([owner](const Job &job) { return job.owner == owner; });
+    }
+    return running_.count(owner) == 0;
+  });
+}
+
+void PrefetchScheduler::setCursor(int seg_num) {
+  std::lock_guard lock(mutex_);
+  cursor_ = seg_num;
+}
+
+void PrefetchScheduler::workerThread(Pool pool) {
+  auto &queue = queues_[pool];
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_[pool].wait(lock, [&]() { return exit_ || !queue.empty(); });
+    if (exit_) break;
+
+    // the queues are a few dozen jobs at most, a scan is cheaper than keeping a heap in sync with the cursor
+    auto it = std::min_element(queue.begin(), queue.end(), [this](const Job &l, const Job &r) {
+      return std::make_pair(rank(l.seg_num), l.seq) < std::make_pair(rank(r.seg_num), r.seq);
+    });
+    Job job = std::move(*it);
+    queue.erase(it);
+    ++running_[job.owner];
+
+    lock.unlock();
+    job.fn();
+    // release what the job holds, e.g. a temporary file, outside the lock
+    job.fn = nullptr;
+    lock.lock();
+
+    if (--running_[job.owner] == 0) {
+      running_.erase(job.owner);
+    }
+    done_cv_.notify_all();
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs segment loading jobs on two bounded worker pools: IO for fetching files (downloads,
+// disk reads) and CPU for decompressing, parsing and indexing them, so the fetch of one segment
+// overlaps the processing of another. Queued jobs run closest to the playback cursor first,
+// segments ahead of it before the ones behind.
+class PrefetchScheduler {
+public:
+  enum Pool { IO, CPU };
+
+  PrefetchScheduler(int io_threads, int cpu_threads);
+  ~PrefetchScheduler();
+
+  // Queues a job loading segment `seg_num` on behalf of `owner`
+  void submit(Pool pool, const void *owner, int seg_num, std::function<void()> fn);
+  // Drops the queued jobs of `owner` and waits for its running ones to return.
+  // Dropped jobs are destroyed without running, so they must not own anything only their run releases.
+  void cancel(const void *owner);
+  void setCursor(int seg_num);
+
+private:
+  struct Job {
+    const void *owner;
+    int seg_num;
+    uint64_t seq;
+    std::function<void()> fn;
+  };
+
+  void workerThread(Pool pool);
+  // playback moves forward, so the segments behind the cursor count double
+  int rank(int seg_num) const { return seg_num >= cursor_ ? seg_num - cursor_ : 2 * (cursor_ - seg_num); }
+
+  std::mutex mutex_;
+  std::condition_variable cv_[2];
+  std::condition_variable done_cv_;
+  std::list<Job> queues_[2];
+  std::map<const void *, int> running_;
+  std::vector<std::thread> threads_;
+  uint64_t next_seq_ = 0;
+  int cursor_ = 0;
+  bool exit_ = false;
+};
@@ -144,11 +144,14 @@ void installDownloadProgressHandler(DownloadProgressHandler handler) {
 
 namespace PyDownloader {
 
-std::string download(const std::string &url, bool use_cache, std::atomic<bool> *abort) {
+std::string download(const std::string &url, bool use_cache, std::atomic<bool> *abort, bool keep_compressed) {
   std::vector<std::string> args = {"download", url};
   if (!use_cache) {
     args.push_back("--no-cache");
   }
+  if (keep_compressed) {
+    args.push_back("--compressed");
+  }
   return runPython(args, abort);
 }
 
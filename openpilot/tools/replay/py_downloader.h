@@ -10,7 +10,9 @@ void installDownloadProgressHandler(DownloadProgressHandler handler);
 namespace PyDownloader {
 
 // Downloads url to local cache, returns local file path. Reports progress via installDownloadProgressHandler.
-std::string download(const std::string &url, bool use_cache = true, std::atomic<bool> *abort = nullptr);
+// Compressed files are decompressed unless keep_compressed is set.
+std::string download(const std::string &url, bool use_cache = true, std::atomic<bool> *abort = nullptr,
+                     bool keep_compressed = false);
 
 // Decompresses a local log file and returns the temporary output path.
 std::string decompress(const std::string &path, std::atomic<bool> *abort = nullptr);
@@ -1,13 +1,19 @@
 #include "tools/replay/replay.h"
 
+#include <sys/resource.h>
+
 #include <capnp/dynamic.h>
 #include <csignal>
 #include <iomanip>
+#include <iterator>
 #include <sstream>
 #include "openpilot/cereal/services.h"
 #include "common/params.h"
 #include "tools/replay/util.h"
 
+// events due within this window are published back-to-back without sleeping in between
+constexpr int64_t PUBLISH_WINDOW_NS = 1000 * 1000;
+
 static void interrupt_sleep_handler(int signal) {}
 
 // Helper function to notify events with safety checks
@@ -29,6 +35,9 @@ Replay::Replay(const std::string &route, std::vector<std::string> allow, std::ve
     });
   }
 
+  if (!hasFlag(REPLAY_FLAG_NO_VIPC)) {
+    setDecodingCameras(1 + hasFlag(REPLAY_FLAG_CABIN_CAMERA) + hasFlag(REPLAY_FLAG_WIDE_ROAD));
+  }
   if (!(flags_ & REPLAY_FLAG_ALL_SERVICES)) {
     block.insert(block.end(), {"bookmarkButton", "uiDebug", "userBookmark"});
   }
@@ -55,20 +64,26 @@ void Replay::setupServices(const std::vector<std::string> &allow, const std::vec
 
   std::string services_str = join(active_services, ", ");
   rInfo("active services: %s", services_str.c_str());
-  if (!sm_) {
-    pm_ = std::make_unique<PubMaster>(active_services);
-  }
 }
 
 void Replay::setupSegmentManager(bool has_filters) {
   seg_mgr_->setCallback([this]() { handleSegmentMerge(); });
 
   if (has_filters) {
-    std::vector<bool> filters(sockets_.size(), false);
+    ServiceFilter filter;
+    filter.services.resize(sockets_.size(), false);
     for (size_t i = 0; i < sockets_.size(); ++i) {
-      filters[i] = (i == cereal::Event::Which::INIT_DATA || i == cereal::Event::Which::CAR_PARAMS || sockets_[i]);
+      filter.services[i] = (i == cereal::Event::Which::INIT_DATA || i == cereal::Event::Which::CAR_PARAMS || sockets_[i]);
+    }
+
+    // keep the frame events of enabled cameras, even if their encodeIdx service is not published
+    filter.frames.resize(sockets_.size(), false);
+    if (!hasFlag(REPLAY_FLAG_NO_VIPC)) {
+      filter.frames[cereal::Event::Which::NARROW_ROAD_ENCODE_IDX] = true;
+      filter.frames[cereal::Event::Which::CABIN_ENCODE_IDX] = hasFlag(REPLAY_FLAG_CABIN_CAMERA);
+      filter.frames[cereal::Event::Which::WIDE_ROAD_ENCODE_IDX] = hasFlag(REPLAY_FLAG_WIDE_ROAD);
     }
-    seg_mgr_->setFilters(filters);
+    seg_mgr_->setFilter(filter);
   }
 }
 
@@ -125,6 +140,14 @@ void Replay::seekTo(double seconds, bool relative) {
   rInfo("Seeking to %d s, segment %d", (int)target_time, target_segment);
   notifyEvent(onSeeking, target_time);
 
+  {
+    std::lock_guard lock(seek_trace_lock_);
+    awaiting_first_event_ = awaiting_first_frame_ = false;
+    seek_trace_ = {.target_seconds = target_time, .cached = getEventData()->isSegmentLoaded(target_segment)};
+    seek_start_ts_ = nanos_since_boot();
+    seek_merge_start_ = seg_mgr_->mergeSeconds();
+  }
+
   interruptStream([&]() {
     current_segment_.store(target_segment);
     cur_mono_time_ = route_start_ts_ + target_time * 1e9;
@@ -133,6 +156,14 @@ void Replay::seekTo(double seconds, bool relative) {
     return false;
   });
 
+  {
+    std::lock_guard lock(seek_trace_lock_);
+    seek_trace_.interrupt_ms = (nanos_since_boot() - seek_start_ts_) / 1e6;
+  }
+
+  // A target in a loaded segment resumes right away below: the stream thread finds its position in the
+  // merged events with a binary search, and the camera decoders continue forward from their position
+  // when no key frame lies in between. Moving the segment window only loads and merges in the background.
   seg_mgr_->setCurrentSegment(target_segment);
   checkSeekProgress();
 }
@@ -141,14 +172,46 @@ void Replay::checkSeekProgress() {
   if (!seg_mgr_->getEventData()->isSegmentLoaded(current_segment_.load())) return;
 
   double seek_to = seeking_to_.exchange(-1.0, std::memory_order_acquire);
-  if (seek_to >= 0 && onSeekedTo) {
-    onSeekedTo(seek_to);
+  if (seek_to >= 0) {
+    traceSeekResumed();
+    notifyEvent(onSeekedTo, seek_to);
   }
 
   // Resume the interrupted stream
   interruptStream([]() { return true; });
 }
 
+void Replay::traceSeekResumed() {
+  std::lock_guard lock(seek_trace_lock_);
+  seek_trace_.load_ms = (nanos_since_boot() - seek_start_ts_) / 1e6;
+  seek_trace_.merge_ms = (seg_mgr_->mergeSeconds() - seek_merge_start_) * 1000;
+  if (!seek_trace_.cached) {
+    auto event_data = seg_mgr_->getEventData();
+    if (auto it = event_data->segments.find(current_segment_); it != event_data->segments.end()) {
+      for (const auto &fr : it->second->frames) {
+        if (fr) seek_trace_.frame_index_ms += fr->index_seconds * 1000;
+      }
+    }
+  }
+  awaiting_first_event_ = true;
+  awaiting_first_frame_ = camera_server_ != nullptr;
+}
+
+void Replay::traceSeekPublished(bool frame) {
+  std::lock_guard lock(seek_trace_lock_);
+  auto &awaiting = frame ? awaiting_first_frame_ : awaiting_first_event_;
+  if (!awaiting.exchange(false)) return;
+
+  (frame ? seek_trace_.first_frame_ms : seek_trace_.first_event_ms) = (nanos_since_boot() - seek_start_ts_) / 1e6;
+  if (awaiting_first_event_ || awaiting_first_frame_) return;
+
+  const auto &t = seek_trace_;
+  rInfo("seeked to %.1f s%s: interrupt %.1f ms, load %.1f ms (merge %.1f ms, frame index %.1f ms), "
+        "first event %.1f ms, first frame %.1f ms",
+        t.target_seconds, t.cached ? " (cached)" : "", t.interrupt_ms, t.load_ms, t.merge_ms, t.frame_index_ms,
+        t.first_event_ms, t.first_frame_ms);
+}
+
 void Replay::seekToFlag(FindFlag flag) {
   if (auto next = timeline_.find(currentSeconds(), flag)) {
     seekTo(*next - 2, false);  // seek to 2 seconds before next
@@ -214,6 +277,13 @@ void Replay::startStream(const std::shared_ptr<Segment> segment) {
     rWarning("failed to read CarParams from current segment");
   }
 
+  // the publishers are created once a sink can no longer be set
+  if (!sm_ && !sink_) {
+    std::vector<const char *> active_services;
+    std::copy_if(sockets_.begin(), sockets_.end(), std::back_inserter(active_services), [](const char *s) { return s; });
+    pm_ = std::make_unique<PubMaster>(active_services);
+  }
+
   // start camera server
   if (!hasFlag(REPLAY_FLAG_NO_VIPC)) {
     std::pair<int, int> camera_size[MAX_CAMERAS] = {};
@@ -222,7 +292,10 @@ void Replay::startStream(const std::shared_ptr<Segment> segment) {
         camera_size[type] = {fr->width, fr->height};
       }
     }
-    camera_server_ = std::make_unique<CameraServer>(camera_size);
+    camera_server_ = std::make_unique<CameraServer>(camera_size, sink_.get());
+    camera_server_->onFrameSent = [this](CameraType) {
+      if (awaiting_first_frame_) traceSeekPublished(true);
+    };
   }
 
   timeline_.initialize(seg_mgr_->route_, route_start_ts_, !(flags_ & REPLAY_FLAG_NO_FILE_CACHE),
@@ -234,7 +307,9 @@ void Replay::startStream(const std::shared_ptr<Segment> segment) {
 void Replay::publishMessage(const Event *e) {
   if (event_filter_ && event_filter_(e)) return;
 
-  if (!sm_) {
+  if (sink_) {
+    sink_->sendEvent(sockets_[e->which], *e);
+  } else if (!sm_) {
     auto bytes = e->data.asBytes();
     int ret = pm_->send(sockets_[e->which], (capnp::byte *)bytes.begin(), bytes.size());
     if (ret == -1) {
@@ -283,8 +358,8 @@ void Replay::streamThread() {
 
     event_data_ = seg_mgr_->getEventData();
     const auto &events = event_data_->events;
-    auto first = std::upper_bound(events.cbegin(), events.cend(), Event(cur_which_, cur_mono_time_, {}));
-    if (first == events.cend()) {
+    auto first = events.upper_bound(Event(cur_which_, cur_mono_time_, {}));
+    if (first == events.end()) {
       rInfo("waiting for events...");
       events_ready_ = false;
       continue;
@@ -292,17 +367,18 @@ void Replay::streamThread() {
 
     if (!streaming_started && hasFlag(REPLAY_FLAG_BENCHMARK)) {
       benchmark_stats_.timeline.emplace_back(nanos_since_boot(), "streaming started");
+      benchmark_stats_.publish_start_ts = nanos_since_boot();
       streaming_started = true;
     }
 
-    auto it = publishEvents(first, events.cend(), last_processed_segment, segment_start_time);
+    auto it = publishEvents(first, events.end(), last_processed_segment, segment_start_time);
 
-    // Ensure frames are sent before unlocking to prevent race conditions
+    // Ensure frames are sent and no segment is being decoded ahead before unlocking to prevent race conditions
     if (camera_server_) {
-      camera_server_->waitForSent();
+      camera_server_->waitForIdle();
     }
 
-    if (it == events.cend() && !hasFlag(REPLAY_FLAG_NO_LOOP) && !hasFlag(REPLAY_FLAG_BENCHMARK)) {
+    if (it == events.end() && !hasFlag(REPLAY_FLAG_NO_LOOP) && !hasFlag(REPLAY_FLAG_BENCHMARK)) {
       int last_segment = seg_mgr_->route_.segments().rbegin()->first;
       if (event_data_->isSegmentLoaded(last_segment)) {
         rInfo("reaches the end of route, restart from beginning");
@@ -310,7 +386,7 @@ void Replay::streamThread() {
         seekTo(minSeconds(), false);
         stream_lock_.lock();
       }
-    } else if (it == events.cend() && hasFlag(REPLAY_FLAG_BENCHMARK)) {
+    } else if (it == events.end() && hasFlag(REPLAY_FLAG_BENCHMARK)) {
       // Exit benchmark mode after first segment completes
       exit_ = true;
       break;
@@ -319,6 +395,7 @@ void Replay::streamThread() {
 
   if (hasFlag(REPLAY_FLAG_BENCHMARK)) {
     benchmark_stats_.timeline.emplace_back(nanos_since_boot(), "benchmark done");
+    collectBenchmarkStats();
 
     {
       std::unique_lock lock(benchmark_lock_);
@@ -328,10 +405,55 @@ void Replay::streamThread() {
   }
 }
 
-std::vector<Event>::const_iterator Replay::publishEvents(std::vector<Event>::const_iterator first,
-                                                         std::vector<Event>::const_iterator last,
-                                                         int &last_processed_segment,
-                                                         uint64_t &segment_start_time) {
+void Replay::collectBenchmarkStats() {
+  auto &stats = benchmark_stats_;
+  stats.publish_end_ts = nanos_since_boot();
+  stats.events_published = publish_stats_.events;
+
+  double download = 0, decompress = 0, parse = 0, sort = 0, frame_index = 0, first_decode = 0;
+  for (const auto &[n, seg] : event_data_->segments) {
+    // downloads happen in the prefetch stage, before the readers see a local file
+    download += seg->fetchSeconds();
+    if (seg->log) {
+      download += seg->log->download_seconds();
+      decompress += seg->log->decompress_seconds();
+      parse += seg->log->parse_seconds();
+      sort += seg->log->sort_seconds();
+    }
+    for (const auto &fr : seg->frames) {
+      if (!fr) continue;
+      frame_index += fr->index_seconds;
+      // segments are in order, so this is the first frame decoded by the benchmark
+      if (first_decode == 0) first_decode = fr->first_decode_seconds;
+    }
+  }
+  stats.stage_seconds = {
+    {"download", download},
+    {"decompress", decompress},
+    {"parse", parse},
+    {"sort", sort},
+    {"merge", seg_mgr_->mergeSeconds()},
+    {"frame_index", frame_index},
+    {"first_decode", first_decode},
+  };
+
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  stats.peak_rss_kb = usage.ru_maxrss;
+}
+
+void Replay::trackPublishLag(uint64_t lag_ns, uint64_t current_nanos) {
+  ++publish_stats_.late_events;
+  publish_stats_.max_lag_ns = std::max(publish_stats_.max_lag_ns, lag_ns);
+  if (lag_ns > 100 * 1e6 && current_nanos - publish_stats_.last_warning_ts > 1e9) {
+    publish_stats_.last_warning_ts = current_nanos;
+    rWarning("publishing is %.0f ms behind the log (%lu of %lu events late)", lag_ns / 1e6,
+             publish_stats_.late_events, publish_stats_.events);
+  }
+}
+
+MergedEvents::iterator Replay::publishEvents(MergedEvents::iterator first, const MergedEvents::iterator &last,
+                                             int &last_processed_segment, uint64_t &segment_start_time) {
   uint64_t evt_start_ts = cur_mono_time_;
   uint64_t loop_start_ts = nanos_since_boot();
   double prev_replay_speed = speed_;
@@ -365,29 +487,42 @@ std::vector<Event>::const_iterator Replay::publishEvents(std::vector<Event>::con
     cur_mono_time_ = evt.mono_time;
     cur_which_ = evt.which;
 
-    // Skip events if socket is not present
-    if (!sockets_[evt.which]) continue;
+    // Skip events if socket is not present. Frame events are kept by the segment filter for enabled cameras.
+    if (evt.eidx_segnum == -1 && !sockets_[evt.which]) continue;
 
     const uint64_t current_nanos = nanos_since_boot();
     const int64_t time_diff = (evt.mono_time - evt_start_ts) / speed_ - (current_nanos - loop_start_ts);
+    ++publish_stats_.events;
 
     // Reset timestamps for potential synchronization issues:
     // - A negative time_diff may indicate slow execution or system wake-up,
     // - A time_diff exceeding 1 second suggests a skipped segment.
     if ((time_diff < -1e9 || time_diff >= 1e9) || speed_ != prev_replay_speed) {
+      if (time_diff < -1e9 && speed_ == prev_replay_speed) {
+        ++publish_stats_.resyncs;
+        rWarning("publishing fell %.1f s behind, skipping ahead", -time_diff / 1e9);
+      }
       evt_start_ts = evt.mono_time;
       loop_start_ts = current_nanos;
       prev_replay_speed = speed_;
-    } else if (time_diff > 0 && !hasFlag(REPLAY_FLAG_BENCHMARK)) {
+    } else if (time_diff > PUBLISH_WINDOW_NS && (!hasFlag(REPLAY_FLAG_BENCHMARK) || benchmark_paced_)) {
+      // Events due within the window are published back-to-back, only sleep for later ones.
       // Skip sleep in benchmark mode for maximum throughput
-      precise_nano_sleep(time_diff, interrupt_requested_);
+      precise_sleep_until(current_nanos + time_diff, interrupt_requested_);
+    } else if (time_diff < -PUBLISH_WINDOW_NS) {
+      trackPublishLag(-time_diff, current_nanos);
+    }
+    if (hasFlag(REPLAY_FLAG_BENCHMARK) && benchmark_paced_) {
+      benchmark_stats_.lag_ns.push_back(time_diff < 0 ? -time_diff : 0);
     }
 
     if (interrupt_requested_) break;
 
     if (evt.eidx_segnum == -1) {
       publishMessage(&evt);
+      if (awaiting_first_event_) traceSeekPublished(false);
     } else if (camera_server_) {
+      camera_server_->setPlaybackSpeed(speed_);
       if (speed_ > 1.0) {
         camera_server_->waitForSent();
       }
@@ -10,6 +10,7 @@
 
 #include "tools/replay/camera.h"
 #include "tools/replay/seg_mgr.h"
+#include "tools/replay/sink.h"
 #include "tools/replay/timeline.h"
 
 #define DEMO_ROUTE "5beb9b58bd12b691/0000010a--a51155e496"
@@ -27,9 +28,38 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_BENCHMARK = 0x1000,
 };
 
+// How far publishing falls behind the log timeline
+struct PublishStats {
+  uint64_t events = 0;
+  uint64_t late_events = 0;  // published after their deadline plus the batching window
+  uint64_t resyncs = 0;      // timeline resets after falling more than a second behind
+  uint64_t max_lag_ns = 0;
+  uint64_t last_warning_ts = 0;
+};
+
+// Where the time of a seek went, in ms since the seek was requested
+struct SeekTrace {
+  double target_seconds = 0;
+  bool cached = false;          // the target segment was already loaded
+  double interrupt_ms = 0;      // the stream thread stopped publishing
+  double load_ms = 0;           // the target segment was loaded and the stream resumed
+  double merge_ms = 0;          // spent merging segments in between
+  double frame_index_ms = 0;    // spent indexing the target segment's videos, when the seek loaded it
+  double first_event_ms = -1;   // the first event was published after the seek
+  double first_frame_ms = -1;   // the first camera frame was sent after the seek
+};
+
 struct BenchmarkStats {
   uint64_t process_start_ts = 0;
   std::vector<std::pair<uint64_t, std::string>> timeline;
+
+  // filled in when the benchmark finishes
+  std::vector<std::pair<std::string, double>> stage_seconds;  // summed over the loaded segments
+  uint64_t events_published = 0;
+  uint64_t publish_start_ts = 0;
+  uint64_t publish_end_ts = 0;
+  std::vector<uint64_t> lag_ns;  // lag of each published event, only recorded when playback is paced
+  long peak_rss_kb = 0;
 };
 
 class Replay {
@@ -46,6 +76,7 @@ public:
   inline bool isPaused() const { return user_paused_; }
   inline int segmentCacheLimit() const { return seg_mgr_->segment_cache_limit_; }
   inline void setSegmentCacheLimit(int n) { seg_mgr_->segment_cache_limit_ = std::max(MIN_SEGMENTS_CACHE, n); }
+  inline void setSegmentCacheBudget(size_t bytes) { seg_mgr_->memory_budget_ = bytes; }
   inline bool hasFlag(REPLAY_FLAGS flag) const { return flags_ & flag; }
   void setLoop(bool loop) { loop ? flags_ &= ~REPLAY_FLAG_NO_LOOP : flags_ |= REPLAY_FLAG_NO_LOOP; }
   bool loop() const { return !(flags_ & REPLAY_FLAG_NO_LOOP); }
@@ -65,6 +96,15 @@ public:
   void installEventFilter(std::function<bool(const Event *)> filter) { event_filter_ = filter; }
   void waitForFinished();
   const BenchmarkStats &getBenchmarkStats() const { return benchmark_stats_; }
+  // follow log time at the playback speed in benchmark mode instead of publishing as fast as possible
+  void setBenchmarkPaced(bool paced) { benchmark_paced_ = paced; }
+  // Sends events and frames to `sink` instead of msgq and VisionIPC. Must be set before load().
+  void setSink(std::unique_ptr<ReplaySink> sink) { sink_ = std::move(sink); }
+  const ReplaySink *sink() const { return sink_.get(); }
+  SeekTrace lastSeekTrace() const {
+    std::lock_guard lock(seek_trace_lock_);
+    return seek_trace_;
+  }
 
   // Event callback functions
   std::function<void()> onSegmentsMerged = nullptr;
@@ -79,13 +119,15 @@ private:
   void streamThread();
   void handleSegmentMerge();
   void interruptStream(const std::function<bool()>& update_fn);
-  std::vector<Event>::const_iterator publishEvents(std::vector<Event>::const_iterator first,
-                                                   std::vector<Event>::const_iterator last,
-                                                   int &last_processed_segment,
-                                                   uint64_t &segment_start_time);
+  MergedEvents::iterator publishEvents(MergedEvents::iterator first, const MergedEvents::iterator &last,
+                                       int &last_processed_segment, uint64_t &segment_start_time);
   void publishMessage(const Event *e);
+  void trackPublishLag(uint64_t lag_ns, uint64_t current_nanos);
+  void collectBenchmarkStats();
   void publishFrame(const Event *e);
   void checkSeekProgress();
+  void traceSeekResumed();
+  void traceSeekPublished(bool frame);
 
   std::unique_ptr<SegmentManager> seg_mgr_;
   Timeline timeline_;
@@ -109,6 +151,7 @@ private:
   SubMaster *sm_ = nullptr;
   std::unique_ptr<PubMaster> pm_;
   std::vector<const char*> sockets_;
+  std::unique_ptr<ReplaySink> sink_;
   std::unique_ptr<CameraServer> camera_server_;
   std::atomic<uint32_t> flags_ = REPLAY_FLAG_NONE;
 
@@ -118,8 +161,17 @@ private:
 
   std::shared_ptr<SegmentManager::EventData> event_data_ = std::make_shared<SegmentManager::EventData>();
 
+  PublishStats publish_stats_;
   BenchmarkStats benchmark_stats_;
   std::condition_variable benchmark_cv_;
   std::mutex benchmark_lock_;
   bool benchmark_done_ = false;
+  bool benchmark_paced_ = false;
+
+  mutable std::mutex seek_trace_lock_;
+  SeekTrace seek_trace_;
+  uint64_t seek_start_ts_ = 0;
+  double seek_merge_start_ = 0;
+  std::atomic<bool> awaiting_first_event_ = false;
+  std::atomic<bool> awaiting_first_frame_ = false;
 };
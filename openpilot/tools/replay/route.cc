@@ -1,11 +1,17 @@
 #include "tools/replay/route.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <array>
+#include <chrono>
 #include <filesystem>
 #include <regex>
 
 #include "json11/json11.hpp"
 #include "common/hardware/hw.h"
+#include "common/timing.h"
+#include "tools/replay/cache_manager.h"
 #include "tools/replay/py_downloader.h"
 #include "tools/replay/replay.h"
 #include "tools/replay/util.h"
@@ -192,9 +198,9 @@ void Route::addFileToSegment(int n, const std::string &file) {
 
 // class Segment
 
-Segment::Segment(int n, const SegmentFile &files, uint32_t flags, const std::vector<bool> &filters,
-                 std::function<void(int, bool)> callback)
-    : seg_num(n), flags(flags), filters_(filters), on_load_finished_(callback) {
+Segment::Segment(int n, const SegmentFile &files, uint32_t flags, const ServiceFilter &filter,
+                 std::shared_ptr<PrefetchScheduler> scheduler, std::function<void(int, bool)> callback)
+    : seg_num(n), flags(flags), filter_(filter), scheduler_(scheduler), on_load_finished_(callback) {
   // [NarrowRoadCam, CabinCam, WideRoadCam, log]. fallback to qcamera/qlog
   const std::array file_list = {
       (flags & REPLAY_FLAG_QCAMERA) || files.narrow_road_cam.empty() ? files.qcamera : files.narrow_road_cam,
@@ -202,12 +208,17 @@ Segment::Segment(int n, const SegmentFile &files, uint32_t flags, const std::vec
       flags & REPLAY_FLAG_WIDE_ROAD ? files.wide_road_cam : "",
       files.rlog.empty() ? files.qlog : files.rlog,
   };
+  std::vector<int> ids;
   for (int i = 0; i < file_list.size(); ++i) {
     if (!file_list[i].empty() && (!(flags & REPLAY_FLAG_NO_VIPC) || i >= MAX_CAMERAS)) {
-      ++loading_;
-      threads_.emplace_back(&Segment::loadFile, this, i, file_list[i]);
+      ids.push_back(i);
     }
   }
+  // count every file before queuing any, so an early finish can't complete the load
+  loading_ = ids.size();
+  for (int id : ids) {
+    scheduler_->submit(PrefetchScheduler::IO, this, seg_num, [this, id, file = file_list[id]]() { fetchFile(id, file); });
+  }
 }
 
 Segment::~Segment() {
@@ -216,27 +227,76 @@ Segment::~Segment() {
     on_load_finished_ = nullptr;  // Prevent callback after destruction
   }
   abort_ = true;
-  for (auto &thread : threads_) {
-    if (thread.joinable()) thread.join();
+  scheduler_->cancel(this);
+}
+
+// IO stage: brings the file to local storage, then queues its processing on the CPU pool
+void Segment::fetchFile(int id, const std::string &file) {
+  if (abort_) {
+    fileFinished();
+    return;
   }
+
+  const uint64_t start = nanos_since_boot();
+  const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
+  const bool remote = file.find("https://") == 0 || file.find("http://") == 0;
+  std::string local_file = file;
+  if (remote) {
+    const auto requested = std::chrono::system_clock::now();
+    local_file = PyDownloader::download(file, local_cache, &abort_, true);
+    if (!local_file.empty() && local_cache) {
+      CacheManager::instance().recordDownload(local_file, requested);
+    }
+  } else {
+#ifndef __APPLE__
+    // read the file ahead in the background, so processing doesn't wait on the disk
+    if (int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+#endif
+  }
+  fetch_ns_ += nanos_since_boot() - start;
+
+  // without the file cache, downloads land in temporary files. the job owns the file, so it's
+  // removed once loaded, and also when the job is dropped by a seek or an eviction.
+  const bool temporary = remote && !local_cache && !local_file.empty();
+  std::shared_ptr<const std::string> path(new std::string(local_file), [temporary](const std::string *f) {
+    if (temporary) unlink(f->c_str());
+    delete f;
+  });
+
+  if (local_file.empty() || abort_) {
+    abort_ = true;
+    fileFinished();
+    return;
+  }
+  scheduler_->submit(PrefetchScheduler::CPU, this, seg_num, [this, id, path]() { loadFile(id, *path); });
 }
 
-void Segment::loadFile(int id, const std::string file) {
+// CPU stage: decompresses and parses the log, or indexes the video.
+// the log is in memory and the video stays open once loaded, the file is no longer needed by name.
+void Segment::loadFile(int id, const std::string &file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
-  if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
-    success = frames[id]->load((CameraType)id, file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache);
-  } else {
-    log = std::make_unique<LogReader>(filters_);
-    success = log->load(file, &abort_, local_cache);
+  if (!abort_) {
+    if (id < MAX_CAMERAS) {
+      frames[id] = std::make_unique<FrameReader>();
+      success = frames[id]->load((CameraType)id, file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache);
+    } else {
+      log = std::make_unique<LogReader>(filter_);
+      success = log->load(file, &abort_, local_cache);
+    }
   }
 
   if (!success) {
     // abort all loading jobs.
     abort_ = true;
   }
+  fileFinished();
+}
 
+void Segment::fileFinished() {
   if (--loading_ == 0) {
     std::lock_guard lock(mutex_);
     load_state_ = !abort_ ? LoadState::Loaded : LoadState::Failed;
@@ -246,6 +306,14 @@ void Segment::loadFile(int id, const std::string file) {
   }
 }
 
+size_t Segment::memoryUsage() const {
+  size_t usage = log ? log->memoryUsage() : 0;
+  for (const auto &f : frames) {
+    if (f) usage += f->memoryUsage();
+  }
+  return usage;
+}
+
 Segment::LoadState Segment::getState() {
   std::scoped_lock lock(mutex_);
   return load_state_;
@@ -5,12 +5,12 @@
 #include <memory>
 #include <mutex>
 #include <string>
-#include <thread>
 #include <vector>
 
 #include "json11/json11.hpp"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
+#include "tools/replay/prefetch.h"
 #include "tools/replay/util.h"
 
 enum class RouteLoadError {
@@ -72,24 +72,29 @@ class Segment {
 public:
   enum class LoadState {Loading, Loaded, Failed};
 
-  Segment(int n, const SegmentFile &files, uint32_t flags, const std::vector<bool> &filters,
-          std::function<void(int, bool)> callback);
+  Segment(int n, const SegmentFile &files, uint32_t flags, const ServiceFilter &filter,
+          std::shared_ptr<PrefetchScheduler> scheduler, std::function<void(int, bool)> callback);
   ~Segment();
   LoadState getState();
+  size_t memoryUsage() const;
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
   std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+  double fetchSeconds() const { return fetch_ns_ / 1e9; }
 
 protected:
-  void loadFile(int id, const std::string file);
+  void fetchFile(int id, const std::string &file);
+  void loadFile(int id, const std::string &file);
+  void fileFinished();
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
+  std::atomic<uint64_t> fetch_ns_ = 0;  // time spent downloading or reading ahead the files
   std::mutex mutex_;
-  std::vector<std::thread> threads_;
+  std::shared_ptr<PrefetchScheduler> scheduler_;
   std::function<void(int, bool)> on_load_finished_ = nullptr;
   uint32_t flags;
-  std::vector<bool> filters_;
+  ServiceFilter filter_;
   LoadState load_state_  = LoadState::Loading;
 };
@@ -1,6 +1,9 @@
 #include "tools/replay/seg_mgr.h"
 
 #include <algorithm>
+#include <tuple>
+
+#include "common/timing.h"
 
 SegmentManager::~SegmentManager() {
   {
@@ -55,13 +58,19 @@ void SegmentManager::manageSegmentCache() {
     if (cur == segments_.end()) continue;
 
     // Calculate the range of segments to load
-    auto begin = std::prev(cur, std::min<int>(segment_cache_limit_ / 2, std::distance(segments_.begin(), cur)));
-    auto end = std::next(begin, std::min<int>(segment_cache_limit_, std::distance(begin, segments_.end())));
-    begin = std::prev(end, std::min<int>(segment_cache_limit_, std::distance(segments_.begin(), end)));
+    SegmentMap::iterator begin, end;
+    if (memory_budget_ > 0) {
+      std::tie(begin, end) = budgetedRange(cur);
+    } else {
+      begin = std::prev(cur, std::min<int>(segment_cache_limit_ / 2, std::distance(segments_.begin(), cur)));
+      end = std::next(begin, std::min<int>(segment_cache_limit_, std::distance(begin, segments_.end())));
+      begin = std::prev(end, std::min<int>(segment_cache_limit_, std::distance(segments_.begin(), end)));
+    }
 
     lock.unlock();
 
-    loadSegmentsInRange(begin, cur, end);
+    scheduler_->setCursor(cur->first);
+    loadSegmentsInRange(begin, end);
     bool merged = mergeSegments(begin, end);
 
     // Free segments outside the current range
@@ -74,23 +83,64 @@ void SegmentManager::manageSegmentCache() {
   }
 }
 
+// Grows the window outwards from the current segment while the cached segments fit in the budget.
+// Segments ahead of the cursor are preferred two to one over the ones behind it, so the segments
+// left out, and freed, are the ones furthest from the playback position.
+std::pair<SegmentMap::iterator, SegmentMap::iterator> SegmentManager::budgetedRange(SegmentMap::iterator cur) {
+  auto isLoaded = [](const std::shared_ptr<Segment> &seg) { return seg && seg->getState() == Segment::LoadState::Loaded; };
+
+  // segments that are not loaded yet are assumed to be as large as the largest one seen so far
+  size_t estimate = 0;
+  for (const auto &[n, seg] : segments_) {
+    if (isLoaded(seg)) estimate = std::max(estimate, seg->memoryUsage());
+  }
+  auto cost = [&](SegmentMap::iterator it) { return isLoaded(it->second) ? it->second->memoryUsage() : estimate; };
+
+  auto begin = cur, end = std::next(cur);
+  size_t used = cost(cur);
+  if (estimate == 0) return {begin, end};  // nothing measured yet, load the current segment first
+
+  int ahead = 0, behind = 0;
+  while (true) {
+    bool can_forward = end != segments_.end();
+    bool can_backward = begin != segments_.begin();
+    if (!can_forward && !can_backward) break;
+
+    bool forward = can_forward && (!can_backward || ahead < 2 * (behind + 1));
+    auto next = forward ? end : std::prev(begin);
+    size_t size = cost(next);
+    if (used + size > memory_budget_) break;
+
+    used += size;
+    if (forward) {
+      end = std::next(end);
+      ++ahead;
+    } else {
+      begin = next;
+      ++behind;
+    }
+  }
+
+  rDebug("segment cache: %d ahead, %d behind, %s of %s", ahead, behind,
+         formattedDataSize(used).c_str(), formattedDataSize(memory_budget_).c_str());
+  return {begin, end};
+}
+
 bool SegmentManager::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::set<int> segments_to_merge;
-  size_t total_event_count = 0;
   for (auto it = begin; it != end; ++it) {
     const auto &segment = it->second;
     if (segment && segment->getState() == Segment::LoadState::Loaded) {
       segments_to_merge.insert(segment->seg_num);
-      total_event_count += segment->log->events.size();
     }
   }
 
   if (segments_to_merge == merged_segments_) return false;
 
+  const uint64_t merge_start = nanos_since_boot();
+  // each segment's events are already sorted, so only their ranges are recorded here
+  // and the merge happens while iterating. this keeps the cost independent of the event count.
   auto merged_event_data = std::make_shared<EventData>();
-  auto &merged_events = merged_event_data->events;
-  merged_events.reserve(total_event_count);
-
   std::string segments_str = join(segments_to_merge, ", ");
   rDebug("merging segments: %s", segments_str.c_str());
   for (int n : segments_to_merge) {
@@ -98,50 +148,39 @@ bool SegmentManager::mergeSegments(const SegmentMap::iterator &begin, const Segm
     if (events.empty()) continue;
 
     // Skip INIT_DATA if present
-    auto events_begin = (events.front().which == cereal::Event::Which::INIT_DATA) ? std::next(events.begin()) : events.begin();
-
-    size_t previous_size = merged_events.size();
-    merged_events.insert(merged_events.end(), events_begin, events.end());
-    std::inplace_merge(merged_events.begin(), merged_events.begin() + previous_size, merged_events.end());
+    const Event *events_begin = events.data();
+    if (events_begin->which == cereal::Event::Which::INIT_DATA) ++events_begin;
+    merged_event_data->events.add(events_begin, events.data() + events.size());
 
     merged_event_data->segments[n] = segments_.at(n);
   }
 
   std::atomic_store(&event_data_, std::move(merged_event_data));
   merged_segments_ = segments_to_merge;
+  merge_ns_ += nanos_since_boot() - merge_start;
 
   return true;
 }
 
-void SegmentManager::loadSegmentsInRange(SegmentMap::iterator begin, SegmentMap::iterator cur, SegmentMap::iterator end) {
-  auto tryLoadSegment = [this](auto first, auto last) {
-    for (auto it = first; it != last; ++it) {
-      auto &segment_ptr = it->second;
-      if (!segment_ptr) {
-        if (onBenchmarkEvent_) {
-          onBenchmarkEvent_(it->first, "loading");
-        }
-        segment_ptr = std::make_shared<Segment>(
-            it->first, route_.at(it->first), flags_, filters_,
-            [this](int seg_num, bool success) {
-              if (onBenchmarkEvent_) {
-                onBenchmarkEvent_(seg_num, success ? "loaded" : "load failed");
-              }
-              std::unique_lock lock(mutex_);
-              needs_update_ = true;
-              cv_.notify_one();
-            });
-      }
-
-      if (segment_ptr->getState() == Segment::LoadState::Loading) {
-        return true;  // Segment is still loading
-      }
-    }
-    return false;  // No segments need loading
-  };
+// Queues every segment of the range at once. The scheduler pipelines their fetching and processing,
+// closest to the cursor first, and segments freed by a seek cancel their pending jobs.
+void SegmentManager::loadSegmentsInRange(SegmentMap::iterator begin, SegmentMap::iterator end) {
+  for (auto it = begin; it != end; ++it) {
+    auto &segment_ptr = it->second;
+    if (segment_ptr) continue;
 
-  // Try forward loading, then reverse if necessary
-  if (!tryLoadSegment(cur, end)) {
-    tryLoadSegment(std::make_reverse_iterator(cur), std::make_reverse_iterator(begin));
+    if (onBenchmarkEvent_) {
+      onBenchmarkEvent_(it->first, "loading");
+    }
+    segment_ptr = std::make_shared<Segment>(
+        it->first, route_.at(it->first), flags_, filter_, scheduler_,
+        [this](int seg_num, bool success) {
+          if (onBenchmarkEvent_) {
+            onBenchmarkEvent_(seg_num, success ? "loaded" : "load failed");
+          }
+          std::unique_lock lock(mutex_);
+          needs_update_ = true;
+          cv_.notify_one();
+        });
   }
 }
@@ -1,46 +1,131 @@
 #pragma once
 
+#include <algorithm>
 #include <condition_variable>
+#include <iterator>
 #include <map>
 #include <mutex>
 #include <set>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "tools/replay/route.h"
 
 constexpr int MIN_SEGMENTS_CACHE = 5;
+constexpr int PREFETCH_IO_THREADS = 4;
+// leave the other half of the cores to video decoding and publishing
+inline int prefetchCpuThreads() { return std::clamp((int)std::thread::hardware_concurrency() / 2, 1, 4); }
 
 using SegmentMap = std::map<int, std::shared_ptr<Segment>>;
 
+// The sorted event runs of the loaded segments, in segment order. Runs are merged
+// lazily by the iterator, so adding or dropping a segment never copies events.
+class MergedEvents {
+public:
+  struct Span {
+    const Event *begin;
+    const Event *end;
+  };
+
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Event;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Event *;
+    using reference = const Event &;
+
+    iterator() = default;
+    iterator(const std::vector<Span> *spans, std::vector<const Event *> &&pos) : spans_(spans), pos_(std::move(pos)) { next(); }
+    reference operator*() const { return *pos_[cur_]; }
+    pointer operator->() const { return pos_[cur_]; }
+    iterator &operator++() {
+      ++pos_[cur_];
+      next();
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return cur_ == other.cur_ && (cur_ == -1 || pos_[cur_] == other.pos_[other.cur_]);
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+
+  private:
+    // pick the run with the smallest head. on ties the earlier segment wins, like a stable merge.
+    void next() {
+      cur_ = -1;
+      for (int i = 0; i < (int)pos_.size(); ++i) {
+        if (pos_[i] != (*spans_)[i].end && (cur_ == -1 || *pos_[i] < *pos_[cur_])) {
+          cur_ = i;
+        }
+      }
+    }
+
+    const std::vector<Span> *spans_ = nullptr;
+    std::vector<const Event *> pos_;
+    int cur_ = -1;
+  };
+
+  void add(const Event *begin, const Event *end) {
+    if (begin != end) {
+      spans_.push_back({begin, end});
+      size_ += end - begin;
+    }
+  }
+  iterator begin() const { return makeIterator([](const Span &s) { return s.begin; }); }
+  iterator end() const { return iterator(); }
+  iterator upper_bound(const Event &e) const {
+    return makeIterator([&e](const Span &s) { return std::upper_bound(s.begin, s.end, e); });
+  }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  template <typename F>
+  iterator makeIterator(F &&position) const {
+    std::vector<const Event *> pos;
+    pos.reserve(spans_.size());
+    for (const auto &span : spans_) pos.push_back(position(span));
+    return iterator(&spans_, std::move(pos));
+  }
+
+  std::vector<Span> spans_;
+  size_t size_ = 0;
+};
+
 class SegmentManager {
 public:
   struct EventData {
-    std::vector<Event> events;  //  Events extracted from the segments
+    MergedEvents events;        // Events extracted from the segments
     SegmentMap segments;        // Associated segments that contributed to these events
     bool isSegmentLoaded(int n) const { return segments.find(n) != segments.end(); }
   };
 
   SegmentManager(const std::string &route_name, uint32_t flags, const std::string &data_dir = "", bool auto_source = false)
-      : flags_(flags), route_(route_name, data_dir, auto_source), event_data_(std::make_shared<EventData>()) {}
+      : flags_(flags), route_(route_name, data_dir, auto_source), event_data_(std::make_shared<EventData>()),
+        scheduler_(std::make_shared<PrefetchScheduler>(PREFETCH_IO_THREADS, prefetchCpuThreads())) {}
   ~SegmentManager();
 
   bool load();
   void setCurrentSegment(int seg_num);
   void setCallback(const std::function<void()> &callback) { onSegmentMergedCallback_ = callback; }
   void setBenchmarkCallback(const std::function<void(int, const std::string&)> &callback) { onBenchmarkEvent_ = callback; }
-  void setFilters(const std::vector<bool> &filters) { filters_ = filters; }
+  void setFilter(const ServiceFilter &filter) { filter_ = filter; }
   const std::shared_ptr<EventData> getEventData() const { return std::atomic_load(&event_data_); }
+  double mergeSeconds() const { return merge_ns_ / 1e9; }
   bool hasSegment(int n) const { return segments_.find(n) != segments_.end(); }
 
   Route route_;
   int segment_cache_limit_ = MIN_SEGMENTS_CACHE;
+  size_t memory_budget_ = 0;  // bytes held by cached segments, 0 to limit by segment_cache_limit_
 
 private:
   void manageSegmentCache();
-  void loadSegmentsInRange(SegmentMap::iterator begin, SegmentMap::iterator cur, SegmentMap::iterator end);
+  std::pair<SegmentMap::iterator, SegmentMap::iterator> budgetedRange(SegmentMap::iterator cur);
+  void loadSegmentsInRange(SegmentMap::iterator begin, SegmentMap::iterator end);
   bool mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end);
 
-  std::vector<bool> filters_;
+  ServiceFilter filter_;
   uint32_t flags_;
 
   std::mutex mutex_;
@@ -52,7 +137,9 @@ private:
 
   SegmentMap segments_;
   std::shared_ptr<EventData> event_data_;
+  std::shared_ptr<PrefetchScheduler> scheduler_;  // shared with the segments, which cancel their jobs on destruction
   std::function<void()> onSegmentMergedCallback_ = nullptr;
   std::function<void(int, const std::string&)> onBenchmarkEvent_ = nullptr;
   std::set<int> merged_segments_;
+  std::atomic<uint64_t> merge_ns_ = 0;  // total time spent merging segments
 };
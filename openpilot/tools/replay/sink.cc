@@ -0,0 +1,75 @@
+#include "tools/replay/sink.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "common/util.h"
+#include "tools/replay/util.h"
+
+std::unique_ptr<ReplaySink> ReplaySink::create(const std::string &spec) {
+  if (spec == "null") {
+    return std::unique_ptr<ReplaySink>(new ReplaySink("null"));
+  }
+  if (spec == "ring" || util::starts_with(spec, "ring:")) {
+    const int mb = spec == "ring" ? 64 : std::atoi(spec.c_str() + 5);
+    if (mb <= 0) return nullptr;
+    return std::make_unique<MemoryRingSink>((size_t)mb * 1024 * 1024);
+  }
+  if (util::starts_with(spec, "file:") && spec.size() > 5) {
+    const std::string path = spec.substr(5);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+      rError("failed to open %s", path.c_str());
+      return nullptr;
+    }
+    return std::make_unique<FileSink>(path, f);
+  }
+  return nullptr;
+}
+
+void ReplaySink::sendEvent(const char *service, const Event &event) {
+  ++events_;
+  event_bytes_ += event.data.size() * sizeof(capnp::word);
+  writeEvent(service, event);
+}
+
+void ReplaySink::sendFrame(CameraType type, VisionBuf *buf, const VisionIpcBufExtra &extra) {
+  ++frames_;
+  frame_bytes_ += buf->len;
+  writeFrame(type, buf, extra);
+}
+
+// MemoryRingSink
+
+void MemoryRingSink::writeEvent(const char *service, const Event &event) {
+  auto bytes = event.data.asBytes();
+  write(bytes.begin(), bytes.size());
+}
+
+void MemoryRingSink::writeFrame(CameraType type, VisionBuf *buf, const VisionIpcBufExtra &extra) {
+  write((const uint8_t *)buf->addr, buf->len);
+}
+
+void MemoryRingSink::write(const uint8_t *data, size_t size) {
+  std::lock_guard lock(mutex_);
+  while (size > 0) {
+    const size_t n = std::min(size, ring_.size() - pos_);
+    memcpy(ring_.data() + pos_, data, n);
+    pos_ = (pos_ + n) % ring_.size();
+    data += n;
+    size -= n;
+  }
+}
+
+// FileSink
+
+void FileSink::writeEvent(const char *service, const Event &event) {
+  if (!file_) return;
+
+  auto bytes = event.data.asBytes();
+  if (fwrite(bytes.begin(), 1, bytes.size(), file_.get()) != bytes.size()) {
+    rWarning("failed to write to the sink file, dropping the remaining events");
+    file_.reset();
+  }
+}
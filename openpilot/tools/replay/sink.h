@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "msgq/visionipc/visionipc.h"
+#include "msgq/visionipc/visionbuf.h"
+#include "tools/replay/logreader.h"
+
+// Receives the output of replay in place of msgq and VisionIPC, so the pipeline from segment
+// loading through event scheduling and frame decoding can be measured without sockets or clients.
+// The base sink only counts what it is sent.
+class ReplaySink {
+public:
+  struct Stats {
+    uint64_t events = 0;
+    uint64_t event_bytes = 0;
+    uint64_t frames = 0;
+    uint64_t frame_bytes = 0;
+  };
+
+  virtual ~ReplaySink() = default;
+  // Creates a sink from "null", "ring[:<mb>]" or "file:<path>". Returns nullptr for an invalid spec.
+  static std::unique_ptr<ReplaySink> create(const std::string &spec);
+
+  // Called from the stream thread, in log order
+  void sendEvent(const char *service, const Event &event);
+  // Called from the camera threads with the decoded frame
+  void sendFrame(CameraType type, VisionBuf *buf, const VisionIpcBufExtra &extra);
+  Stats stats() const { return {events_, event_bytes_, frames_, frame_bytes_}; }
+  const std::string &name() const { return name_; }
+
+protected:
+  ReplaySink(const std::string &name) : name_(name) {}
+  virtual void writeEvent(const char *service, const Event &event) {}
+  virtual void writeFrame(CameraType type, VisionBuf *buf, const VisionIpcBufExtra &extra) {}
+
+private:
+  const std::string name_;
+  std::atomic<uint64_t> events_ = 0, event_bytes_ = 0, frames_ = 0, frame_bytes_ = 0;
+};
+
+// Copies events and frames into a fixed-size ring, standing in for the copy into a socket buffer
+class MemoryRingSink : public ReplaySink {
+public:
+  MemoryRingSink(size_t size) : ReplaySink("ring"), ring_(size) {}
+
+protected:
+  void writeEvent(const char *service, const Event &event) override;
+  void writeFrame(CameraType type, VisionBuf *buf, const VisionIpcBufExtra &extra) override;
+  void write(const uint8_t *data, size_t size);
+
+  std::mutex mutex_;
+  std::vector<uint8_t> ring_;
+  size_t pos_ = 0;
+};
+
+// Writes the events as an uncompressed log that replay and LogReader can read back. Frames are only counted.
+class FileSink : public ReplaySink {
+public:
+  FileSink(const std::string &path, FILE *f) : ReplaySink("file:" + path), file_(f, &fclose) {}
+
+protected:
+  void writeEvent(const char *service, const Event &event) override;
+
+  std::unique_ptr<FILE, decltype(&fclose)> file_;
+};
@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#include "common/hardware/hw.h"
+#include "common/prefix.h"
+#include "common/tests/native_test.h"
+#include "common/util.h"
+#include "tools/replay/cache_manager.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+const int64_t SECOND_NS = 1000000000LL;
+const uint64_t ENTRY_SIZE = 1000;
+
+std::string cacheRoot() { return Path::download_cache_root(); }
+
+bool exists(const std::string &name) { return util::file_exists(cacheRoot() + name); }
+
+timespec ago(int64_t seconds) {
+  auto now = std::chrono::system_clock::now() - std::chrono::seconds(seconds);
+  int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+  return {.tv_sec = (time_t)(ns / SECOND_NS), .tv_nsec = (long)(ns % SECOND_NS)};
+}
+
+// an entry last used and last written the given number of seconds ago
+void writeEntry(const std::string &name, int64_t used_ago, int64_t written_ago) {
+  const std::string path = cacheRoot() + name;
+  std::ofstream(path) << std::string(ENTRY_SIZE, 'x');
+  const timespec times[2] = {ago(used_ago), ago(written_ago)};
+  REQUIRE(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+CacheManager::Stats pruneWithQuota(uint64_t quota) {
+  auto &cache = CacheManager::instance();
+  const auto before = cache.stats();
+  cache.setQuota(quota);
+  cache.prune();
+  auto after = cache.stats();
+  after.evicted_files -= before.evicted_files;
+  after.evicted_bytes -= before.evicted_bytes;
+  return after;
+}
+
+void test_lru_order() {
+  writeEntry("a", 300, 300);
+  writeEntry("b", 100, 400);  // used after it was written
+  writeEntry("c", 200, 200);
+
+  // fits, nothing is evicted
+  auto stats = pruneWithQuota(3 * ENTRY_SIZE);
+  CHECK(stats.evicted_files == 0);
+  CHECK(stats.disk_usage == 3 * ENTRY_SIZE);
+
+  // the least recently used entries go first
+  stats = pruneWithQuota(2 * ENTRY_SIZE + ENTRY_SIZE / 2);
+  CHECK(stats.evicted_files == 1);
+  CHECK(stats.evicted_bytes == ENTRY_SIZE);
+  CHECK(stats.disk_usage == 2 * ENTRY_SIZE);
+  CHECK(!exists("a") && exists("b") && exists("c"));
+
+  // touching an entry makes it the most recently used, without changing its mtime
+  uint64_t size = 0;
+  int64_t mtime_ns = 0, touched_mtime_ns = 0;
+  REQUIRE(fileStat(cacheRoot() + "c", size, mtime_ns));
+  CacheManager::instance().touch(cacheRoot() + "c");
+  REQUIRE(fileStat(cacheRoot() + "c", size, touched_mtime_ns));
+  CHECK(touched_mtime_ns == mtime_ns);
+
+  stats = pruneWithQuota(ENTRY_SIZE + ENTRY_SIZE / 2);
+  CHECK(stats.evicted_files == 1);
+  CHECK(!exists("b") && exists("c"));
+  REQUIRE(unlink((cacheRoot() + "c").c_str()) == 0);
+}
+
+void test_eviction_age() {
+  // in use by the process that just fetched it
+  writeEntry("young", 10, 10);
+  writeEntry("old", 120, 120);
+  // temporary files of a download or a sidecar being written, only removed once they're a day old
+  writeEntry("tmpabc123", 3600, 3600);
+  writeEntry("events_0123.tmp456", 3600, 3600);
+  writeEntry("tmpdead", 25 * 3600, 25 * 3600);
+
+  auto stats = pruneWithQuota(1);
+  CHECK(stats.evicted_files == 2);
+  CHECK(!exists("old") && !exists("tmpdead"));
+  CHECK(exists("young") && exists("tmpabc123") && exists("events_0123.tmp456"));
+  CHECK(stats.disk_usage == 3 * ENTRY_SIZE);
+  for (const char *name : {"young", "tmpabc123", "events_0123.tmp456"}) {
+    REQUIRE(unlink((cacheRoot() + name).c_str()) == 0);
+  }
+}
+
+void test_prune_locked() {
+  writeEntry("a", 300, 300);
+
+  // another process is pruning, this one skips it
+  const std::string lock_file = cacheRoot() + ".replay_cache.lock";
+  int fd = open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  REQUIRE(fd >= 0);
+  REQUIRE(flock(fd, LOCK_EX | LOCK_NB) == 0);
+  auto stats = pruneWithQuota(1);
+  CHECK(stats.evicted_files == 0);
+  CHECK(exists("a"));
+
+  flock(fd, LOCK_UN);
+  close(fd);
+  stats = pruneWithQuota(1);
+  CHECK(stats.evicted_files == 1);
+  CHECK(!exists("a"));
+}
+
+void test_record_download() {
+  auto &cache = CacheManager::instance();
+  cache.setQuota(0);
+  const auto before = cache.stats();
+
+  // written before the request: served from the cache
+  writeEntry("cached", 300, 300);
+  cache.recordDownload(cacheRoot() + "cached", std::chrono::system_clock::now());
+  // written by the request
+  const auto requested = std::chrono::system_clock::now() - std::chrono::seconds(1);
+  writeEntry("fetched", 0, 0);
+  cache.recordDownload(cacheRoot() + "fetched", requested);
+
+  const auto after = cache.stats();
+  CHECK(after.hits == before.hits + 1);
+  CHECK(after.misses == before.misses + 1);
+}
+
+void test_cache_manager() {
+  // the cache root of the prefix, removed with it
+  unsetenv("COMMA_CACHE");
+  OpenpilotPrefix prefix;
+  REQUIRE(util::create_directories(cacheRoot(), 0775));
+
+  test_lru_order();
+  test_eviction_age();
+  test_prune_locked();
+  test_record_download();
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_cache_manager);
+}
@@ -0,0 +1,222 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/tests/native_test.h"
+#include "common/hardware/hw.h"
+#include "common/util.h"
+#include "system/loggerd/zstd_seekable.h"
+#include "tools/replay/cache_manager.h"
+#include "tools/replay/filereader.h"
+#include "tools/replay/logreader.h"
+
+namespace {
+
+const uint64_t START_TIME = 1000000000ULL;
+
+std::string serialize(MessageBuilder &msg) {
+  auto bytes = msg.toBytes();
+  return std::string((const char *)bytes.begin(), bytes.size());
+}
+
+std::string buildLog(int car_states) {
+  std::string log;
+  for (int i = 0; i < car_states; ++i) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    // out of order, the reader sorts them
+    event.setLogMonoTime(START_TIME + (car_states - i) * 10000000ULL);
+    event.initCarState().setVEgo(i);
+    log += serialize(msg);
+  }
+
+  MessageBuilder selfdrive_msg;
+  auto selfdrive = selfdrive_msg.initEvent();
+  selfdrive.setLogMonoTime(START_TIME);
+  selfdrive.initSelfdriveState().setEnabled(true);
+  log += serialize(selfdrive_msg);
+
+  MessageBuilder idx_msg;
+  auto idx_event = idx_msg.initEvent();
+  idx_event.setLogMonoTime(START_TIME + 5000000ULL);
+  auto idx = idx_event.initNarrowRoadEncodeIdx();
+  idx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+  idx.setSegmentNum(3);
+  idx.setTimestampSof(START_TIME + 4000000ULL);
+  log += serialize(idx_msg);
+  return log;
+}
+
+void writeLog(const std::string &path, const std::string &log) {
+  CHECK(util::write_file(path.c_str(), (void *)log.data(), log.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0);
+}
+
+size_t fileSize(const std::string &path) {
+  struct stat st = {};
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+void checkSameEvents(const std::vector<Event> &a, const std::vector<Event> &b) {
+  REQUIRE(a.size() == b.size());
+  for (size_t i = 0; i < a.size(); ++i) {
+    CHECK(a[i].which == b[i].which);
+    CHECK(a[i].mono_time == b[i].mono_time);
+    CHECK(a[i].eidx_segnum == b[i].eidx_segnum);
+    REQUIRE(a[i].data.size() == b[i].data.size());
+    CHECK(memcmp(a[i].data.begin(), b[i].data.begin(), a[i].data.size() * sizeof(capnp::word)) == 0);
+  }
+}
+
+void test_event_cache(const std::string &dir) {
+  const std::string log_file = dir + "/rlog";
+  writeLog(log_file, buildLog(20));
+  const std::string cache_file = cacheSidecarPath("events_", log_file);
+
+  LogReader parsed;
+  REQUIRE(parsed.load(log_file, nullptr, true));
+  CHECK(parsed.events.size() == 23);  // 20 carStates, selfdriveState, the encodeIdx and its frame
+  CHECK(std::is_sorted(parsed.events.begin(), parsed.events.end()));
+  REQUIRE(fileSize(cache_file) > 0);
+
+  // the second load maps the cache instead of parsing the log
+  LogReader cached;
+  REQUIRE(cached.load(log_file, nullptr, true));
+  CHECK(cached.decompressed_size() == fileSize(cache_file));
+  checkSameEvents(parsed.events, cached.events);
+
+  // a filtered reader serves its subset from the same cache
+  ServiceFilter filter;
+  filter.services.resize(cereal::Event::Which::NARROW_ROAD_ENCODE_IDX + 1);
+  filter.services[cereal::Event::Which::CAR_STATE] = true;
+  LogReader filtered(filter);
+  REQUIRE(filtered.load(log_file, nullptr, true));
+  CHECK(filtered.events.size() == 20);
+  for (const Event &e : filtered.events) {
+    CHECK(e.which == cereal::Event::Which::CAR_STATE);
+  }
+
+  // only the messages a filtered reader kept count towards its memory usage
+  ServiceFilter selfdrive_filter;
+  selfdrive_filter.services.resize(cereal::Event::Which::SELFDRIVE_STATE + 1);
+  selfdrive_filter.services[cereal::Event::Which::SELFDRIVE_STATE] = true;
+  LogReader selfdrive_only(selfdrive_filter);
+  REQUIRE(selfdrive_only.load(log_file, nullptr, true));
+  REQUIRE(selfdrive_only.events.size() == 1);
+  const size_t selfdrive_bytes = selfdrive_only.events[0].data.size() * sizeof(capnp::word);
+  CHECK(selfdrive_only.memoryUsage() >= selfdrive_bytes);
+  // not the whole mapped cache, which is mostly carStates
+  CHECK(selfdrive_only.memoryUsage() < fileSize(cache_file) / 2);
+  CHECK(cached.memoryUsage() > selfdrive_only.memoryUsage());
+
+  // rewriting the log invalidates the cache
+  writeLog(log_file, buildLog(30));
+  LogReader rewritten;
+  REQUIRE(rewritten.load(log_file, nullptr, true));
+  CHECK(rewritten.events.size() == 33);
+  CHECK(rewritten.decompressed_size() == fileSize(log_file));
+}
+
+void test_download_cache() {
+  // a log served from the download cache, the event cache stays valid across sessions
+  const std::string cache_root = Path::download_cache_root();
+  REQUIRE(util::create_directories(cache_root, 0775));
+  const std::string log_file = cache_root + "rlog_download";
+  writeLog(log_file, buildLog(20));
+  const std::string cache_file = cacheSidecarPath("events_", log_file);
+
+  uint64_t size = 0;
+  int64_t mtime_ns = 0, touched_mtime_ns = 0;
+  REQUIRE(fileStat(log_file, size, mtime_ns));
+  for (int i = 0; i < 2; ++i) {
+    const uint64_t hits = CacheManager::instance().stats().hits;
+    CacheManager::instance().recordDownload(log_file, std::chrono::system_clock::now());
+    CHECK(CacheManager::instance().stats().hits == hits + 1);
+    REQUIRE(fileStat(log_file, size, touched_mtime_ns));
+    CHECK(touched_mtime_ns == mtime_ns);
+
+    LogReader reader;
+    REQUIRE(reader.load(log_file, nullptr, true));
+    CHECK(reader.events.size() == 23);
+    // parsed the first time, mapped from the event cache the second
+    CHECK(reader.decompressed_size() == fileSize(i == 0 ? log_file : cache_file));
+  }
+}
+
+std::string compressFrame(const std::string &data) {
+  std::string out(ZSTD_compressBound(data.size()), '\0');
+  size_t size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 3);
+  REQUIRE(!ZSTD_isError(size));
+  out.resize(size);
+  return out;
+}
+
+void test_zstd_decompress_file(const std::string &dir) {
+  // the first frame's content size is only part of a multi frame log
+  const std::string first = buildLog(2000), second = buildLog(500);
+  const std::string frame1 = compressFrame(first), frame2 = compressFrame(second);
+  const std::string multi_file = dir + "/multi.zst";
+  writeLog(multi_file, frame1 + frame2);
+  std::string data = zstd_decompress_file(multi_file);
+  CHECK(data == first + second);
+  CHECK(data.capacity() == data.size());
+
+  // seekable logs are sized from their seek table
+  std::vector<SeekableFrame> frames(2);
+  frames[0] = {.offset = 0, .compressed_size = (uint32_t)frame1.size(), .decompressed_size = (uint32_t)first.size()};
+  frames[1] = {.offset = frame1.size(), .compressed_size = (uint32_t)frame2.size(), .decompressed_size = (uint32_t)second.size()};
+  const std::string seekable_file = dir + "/seekable.zst";
+  writeLog(seekable_file, frame1 + frame2 + zstd_seekable_footer(frames));
+  data = zstd_decompress_file(seekable_file);
+  CHECK(data == first + second);
+  CHECK(data.capacity() == data.size());
+}
+
+void test_migrated_events() {
+  MessageBuilder msg;
+  auto event = msg.initEvent();
+  event.setLogMonoTime(START_TIME);
+  event.initControlsState().getDeprecated().setEnabled(true);
+  std::string log = serialize(msg);
+
+  LogReader reader;
+  REQUIRE(reader.load(log.data(), log.size()));
+  REQUIRE(reader.events.size() == 2);
+  const Event &migrated = reader.events.back().which == cereal::Event::Which::SELFDRIVE_STATE ? reader.events.back()
+                                                                                                : reader.events.front();
+  REQUIRE(migrated.which == cereal::Event::Which::SELFDRIVE_STATE);
+
+  // the event spans exactly the migrated message
+  capnp::FlatArrayMessageReader migrated_reader(migrated.data);
+  CHECK(migrated_reader.getEnd() == migrated.data.end());
+  auto migrated_event = migrated_reader.getRoot<cereal::Event>();
+  CHECK(migrated_event.getLogMonoTime() == START_TIME);
+  CHECK(migrated_event.getSelfdriveState().getEnabled());
+}
+
+void test_logreader() {
+  char dir_template[] = "/tmp/test_logreader_XXXXXX";
+  const std::string dir = mkdtemp(dir_template);
+  setenv("COMMA_CACHE", (dir + "/cache/").c_str(), 1);
+
+  test_event_cache(dir);
+  test_download_cache();
+  test_zstd_decompress_file(dir);
+  test_migrated_events();
+  std::filesystem::remove_all(dir);
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_logreader);
+}
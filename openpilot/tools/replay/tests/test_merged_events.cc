@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "common/tests/native_test.h"
+#include "tools/replay/seg_mgr.h"
+
+namespace {
+
+const cereal::Event::Which SERVICES[] = {cereal::Event::Which::CAN, cereal::Event::Which::CAR_STATE,
+                                         cereal::Event::Which::SELFDRIVE_STATE};
+
+// sorted events of a segment, eidx_segnum tells the events apart
+std::vector<Event> makeRun(int segment, int count, uint64_t start, std::mt19937 &gen) {
+  std::uniform_int_distribution<int> step(0, 3), service(0, 2);
+  std::vector<Event> events;
+  uint64_t mono_time = start;
+  for (int i = 0; i < count; ++i) {
+    mono_time += step(gen);
+    events.emplace_back(SERVICES[service(gen)], mono_time, kj::ArrayPtr<const capnp::word>(), segment * 1000 + i);
+  }
+  std::stable_sort(events.begin(), events.end());
+  return events;
+}
+
+std::vector<int> ids(MergedEvents::iterator first, const MergedEvents::iterator &last) {
+  std::vector<int> result;
+  for (; first != last; ++first) result.push_back(first->eidx_segnum);
+  return result;
+}
+
+std::vector<int> ids(std::vector<Event>::const_iterator first, std::vector<Event>::const_iterator last) {
+  std::vector<int> result;
+  for (; first != last; ++first) result.push_back(first->eidx_segnum);
+  return result;
+}
+
+void test_merged_events() {
+  MergedEvents empty;
+  CHECK(empty.empty());
+  CHECK(empty.begin() == empty.end());
+
+  // overlapping segments, with events of equal time and service across and within them
+  std::mt19937 gen(5);
+  std::vector<std::vector<Event>> runs;
+  runs.push_back(makeRun(0, 200, 0, gen));
+  runs.push_back(makeRun(1, 0, 0, gen));
+  runs.push_back(makeRun(2, 150, 250, gen));
+  runs.push_back(makeRun(3, 100, 100, gen));
+  runs.push_back(makeRun(4, 1, 1000, gen));
+
+  MergedEvents merged;
+  std::vector<Event> expected;
+  for (const auto &run : runs) {
+    merged.add(run.data(), run.data() + run.size());
+    expected.insert(expected.end(), run.begin(), run.end());
+  }
+  // a stable sort of the segments in order, on ties the earlier segment comes first
+  std::stable_sort(expected.begin(), expected.end());
+
+  CHECK(merged.size() == expected.size());
+  CHECK(!merged.empty());
+  CHECK(ids(merged.begin(), merged.end()) == ids(expected.begin(), expected.end()));
+
+  // upper_bound starts after every event not greater than the given one, in all segments
+  for (uint64_t mono_time : {(uint64_t)0, (uint64_t)1, (uint64_t)120, (uint64_t)300, (uint64_t)500, expected.back().mono_time, (uint64_t)100000}) {
+    for (auto which : SERVICES) {
+      const Event e(which, mono_time, kj::ArrayPtr<const capnp::word>());
+      auto expected_first = std::upper_bound(expected.begin(), expected.end(), e);
+      CHECK(ids(merged.upper_bound(e), merged.end()) == ids(expected_first, expected.cend()));
+    }
+  }
+  CHECK(merged.upper_bound(expected.back()) == merged.end());
+  for (const Event &e : expected) {
+    auto it = merged.upper_bound(e);
+    CHECK(it == merged.end() || e < *it);
+  }
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_merged_events);
+}
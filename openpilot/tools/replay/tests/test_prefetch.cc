@@ -0,0 +1,125 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common/tests/native_test.h"
+#include "tools/replay/prefetch.h"
+
+namespace {
+
+// holds a worker until it's opened
+struct Gate {
+  std::promise<void> promise;
+  std::shared_future<void> future = promise.get_future().share();
+  void open() { promise.set_value(); }
+  void wait() const { future.wait(); }
+};
+
+// blocks the single worker of a pool, and returns once it's running
+void blockPool(PrefetchScheduler &scheduler, PrefetchScheduler::Pool pool, const void *owner, const Gate &gate) {
+  std::promise<void> started;
+  scheduler.submit(pool, owner, 0, [&started, &gate]() {
+    started.set_value();
+    gate.wait();
+  });
+  started.get_future().wait();
+}
+
+// waits for the jobs queued on a pool before this one
+void drain(PrefetchScheduler &scheduler, PrefetchScheduler::Pool pool, const void *owner) {
+  std::promise<void> done;
+  scheduler.submit(pool, owner, -1000, [&done]() { done.set_value(); });
+  done.get_future().wait();
+}
+
+void test_priority() {
+  PrefetchScheduler scheduler(1, 1);
+  const int owner = 0;
+  Gate gate;
+  blockPool(scheduler, PrefetchScheduler::IO, &owner, gate);
+
+  std::mutex lock;
+  std::vector<int> order;
+  scheduler.setCursor(5);
+  for (int seg = 0; seg < 10; ++seg) {
+    scheduler.submit(PrefetchScheduler::IO, &owner, seg, [&lock, &order, seg]() {
+      std::lock_guard lk(lock);
+      order.push_back(seg);
+    });
+  }
+  gate.open();
+  // behind the cursor: the last of all the queued jobs
+  drain(scheduler, PrefetchScheduler::IO, &owner);
+
+  // closest to the cursor first, segments behind it count double, ties in submission order
+  CHECK(order == std::vector<int>({5, 6, 4, 7, 8, 3, 9, 2, 1, 0}));
+}
+
+void test_cancel_queued() {
+  PrefetchScheduler scheduler(1, 1);
+  const int owner = 0, cancelled = 0;
+  Gate gate;
+  blockPool(scheduler, PrefetchScheduler::IO, &owner, gate);
+
+  std::atomic<int> runs = 0, released = 0;
+  for (int seg = 0; seg < 3; ++seg) {
+    // what a job owns, like the temporary file of a download
+    std::shared_ptr<int> resource(new int(seg), [&released](int *p) {
+      ++released;
+      delete p;
+    });
+    scheduler.submit(PrefetchScheduler::IO, &cancelled, seg, [&runs, resource]() { runs += *resource >= 0; });
+  }
+  // nothing of it is running, so this doesn't wait
+  scheduler.cancel(&cancelled);
+  // the dropped jobs released what they owned
+  CHECK(released == 3);
+  gate.open();
+  drain(scheduler, PrefetchScheduler::IO, &owner);
+  CHECK(runs == 0);
+}
+
+void test_cancel_running() {
+  PrefetchScheduler scheduler(1, 1);
+  const int owner = 0, cancelled = 0;
+  Gate cpu_gate, io_gate;
+  blockPool(scheduler, PrefetchScheduler::CPU, &owner, cpu_gate);
+
+  // a running IO job that queues its CPU stage on return
+  std::promise<void> started;
+  std::atomic<bool> finished = false, cpu_stage_ran = false;
+  scheduler.submit(PrefetchScheduler::IO, &cancelled, 1, [&]() {
+    started.set_value();
+    io_gate.wait();
+    scheduler.submit(PrefetchScheduler::CPU, &cancelled, 1, [&cpu_stage_ran]() { cpu_stage_ran = true; });
+    finished = true;
+  });
+  started.get_future().wait();
+
+  auto cancel = std::async(std::launch::async, [&]() { scheduler.cancel(&cancelled); });
+  // waits for the running job
+  CHECK(cancel.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+  io_gate.open();
+  cancel.get();
+  CHECK(finished);
+
+  // and drops the stage it queued
+  cpu_gate.open();
+  drain(scheduler, PrefetchScheduler::CPU, &owner);
+  CHECK(!cpu_stage_ran);
+}
+
+void test_prefetch() {
+  test_priority();
+  test_cancel_queued();
+  test_cancel_running();
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_prefetch);
+}
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/tests/native_test.h"
+#include "tools/replay/timeline.h"
+
+namespace {
+
+const uint64_t ROUTE_START = 1000000000ULL;
+const int STATES_PER_SEGMENT = 10;  // one selfdriveState a second
+
+struct State {
+  bool enabled = false;
+  cereal::SelfdriveState::AlertSize alert_size = cereal::SelfdriveState::AlertSize::NONE;
+  cereal::SelfdriveState::AlertStatus alert_status = cereal::SelfdriveState::AlertStatus::NORMAL;
+  std::string text1, text2;
+};
+
+State engaged(bool enabled = true) { return State{.enabled = enabled}; }
+
+State alert(bool enabled, cereal::SelfdriveState::AlertStatus status, const std::string &text1) {
+  return State{.enabled = enabled, .alert_size = cereal::SelfdriveState::AlertSize::MID, .alert_status = status,
+               .text1 = text1, .text2 = "details"};
+}
+
+uint64_t monoTime(int segment, int i) { return ROUTE_START + (segment * STATES_PER_SEGMENT + i) * 1000000000ULL; }
+
+std::string serialize(MessageBuilder &msg) {
+  auto bytes = msg.toBytes();
+  return std::string((const char *)bytes.begin(), bytes.size());
+}
+
+// the selfdriveStates of a segment, an empty list logs carStates instead
+std::string buildSegment(int segment, const std::vector<State> &states, const std::vector<int> &bookmarks = {}) {
+  std::string log;
+  for (int i = 0; i < STATES_PER_SEGMENT; ++i) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(monoTime(segment, i));
+    if (states.empty()) {
+      event.initCarState().setVEgo(i);
+    } else {
+      const State &s = states[i];
+      auto state = event.initSelfdriveState();
+      state.setEnabled(s.enabled);
+      state.setAlertSize(s.alert_size);
+      state.setAlertStatus(s.alert_status);
+      state.setAlertText1(s.text1);
+      state.setAlertText2(s.text2);
+    }
+    log += serialize(msg);
+  }
+  for (int i : bookmarks) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(monoTime(segment, i) + 500000000ULL);
+    event.initUserBookmark();
+    log += serialize(msg);
+  }
+  return log;
+}
+
+std::vector<State> repeat(const State &s, int count) { return std::vector<State>(count, s); }
+
+std::vector<State> concat(std::initializer_list<std::vector<State>> parts) {
+  std::vector<State> states;
+  for (const auto &p : parts) states.insert(states.end(), p.begin(), p.end());
+  return states;
+}
+
+using EntryKey = std::tuple<double, double, TimelineType, std::string, std::string>;
+
+std::vector<EntryKey> entryKeys(const Timeline &timeline) {
+  std::vector<EntryKey> keys;
+  for (const auto &e : *timeline.getEntries()) {
+    keys.emplace_back(e.start_time, e.end_time, e.type, e.text1, e.text2);
+  }
+  // entries starting at the same time may come in any order
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+void test_timeline() {
+  using Status = cereal::SelfdriveState::AlertStatus;
+  std::vector<std::string> segments = {
+    // engages, and a warning starts that continues into the next segment
+    buildSegment(0, concat({repeat(engaged(false), 3), repeat(engaged(), 5), repeat(alert(true, Status::USER_PROMPT, "steer"), 2)})),
+    // the warning ends, an info alert runs up to the boundary
+    buildSegment(1, concat({repeat(alert(true, Status::USER_PROMPT, "steer"), 3), repeat(engaged(), 4),
+                            repeat(alert(true, Status::NORMAL, "lane change"), 3)}), {5}),
+    // where its text changes
+    buildSegment(2, concat({repeat(alert(true, Status::NORMAL, "lane change done"), 2), repeat(engaged(), 8)})),
+    // no selfdriveState, the engagement continues through it
+    buildSegment(3, {}, {1, 7}),
+    // disengages with a critical alert
+    buildSegment(4, concat({repeat(engaged(), 4), repeat(alert(false, Status::CRITICAL, "take control"), 3),
+                            repeat(engaged(false), 3)})),
+    buildSegment(5, repeat(engaged(false), STATES_PER_SEGMENT), {2}),
+  };
+
+  std::vector<std::unique_ptr<LogReader>> logs;
+  for (const auto &data : segments) {
+    logs.emplace_back(std::make_unique<LogReader>());
+    REQUIRE(logs.back()->load(data.data(), data.size()));
+  }
+
+  // the whole route in one serial scan
+  std::string route_data;
+  for (const auto &data : segments) route_data += data;
+  LogReader route_log;
+  REQUIRE(route_log.load(route_data.data(), route_data.size()));
+  Timeline serial;
+  serial.addSegment(0, &route_log, ROUTE_START);
+  const auto expected = entryKeys(serial);
+  REQUIRE(!expected.empty());
+  // the engagement of segments 0 to 4 is a single entry
+  CHECK(std::count_if(expected.begin(), expected.end(), [](auto &k) { return std::get<2>(k) == TimelineType::Engaged; }) == 1);
+
+  // segments finishing out of order are merged once the ones before them are in
+  Timeline merged;
+  for (int n : {3, 1, 5}) {
+    merged.addSegment(n, logs[n].get(), ROUTE_START);
+  }
+  CHECK(merged.getEntries()->empty());
+  merged.addSegment(0, logs[0].get(), ROUTE_START);
+  CHECK(!merged.getEntries()->empty());
+  for (int n : {4, 2}) {
+    merged.addSegment(n, logs[n].get(), ROUTE_START);
+  }
+  CHECK(entryKeys(merged) == expected);
+
+  // a segment that failed to load is like one without selfdriveState
+  Timeline missing_segment, missing_serial;
+  for (int n = 0; n < (int)logs.size(); ++n) {
+    missing_segment.addSegment(n, n == 3 ? nullptr : logs[n].get(), ROUTE_START);
+  }
+  std::string without_bookmarks;
+  for (int n = 0; n < (int)segments.size(); ++n) {
+    if (n != 3) without_bookmarks += segments[n];
+  }
+  LogReader without_log;
+  REQUIRE(without_log.load(without_bookmarks.data(), without_bookmarks.size()));
+  missing_serial.addSegment(0, &without_log, ROUTE_START);
+  CHECK(entryKeys(missing_segment) == entryKeys(missing_serial));
+}
+
+}  // namespace
+
+int main() {
+  return run_native_test(test_timeline);
+}
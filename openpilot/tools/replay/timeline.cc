@@ -2,9 +2,46 @@
 
 #include <algorithm>
 #include <array>
+#include <string>
 
 #include "openpilot/cereal/gen/cpp/log.capnp.h"
 
+namespace {
+
+void updateEngagementStatus(std::vector<Timeline::Entry> &entries, const cereal::SelfdriveState::Reader &cs,
+                            std::optional<size_t> &idx, double seconds) {
+  if (idx) entries[*idx].end_time = seconds;
+  if (cs.getEnabled()) {
+    if (!idx) {
+      idx = entries.size();
+      entries.emplace_back(Timeline::Entry{seconds, seconds, TimelineType::Engaged});
+    }
+  } else {
+    idx.reset();
+  }
+}
+
+void updateAlertStatus(std::vector<Timeline::Entry> &entries, const cereal::SelfdriveState::Reader &cs,
+                       std::optional<size_t> &idx, double seconds) {
+  static auto alert_types = std::array{TimelineType::AlertInfo, TimelineType::AlertWarning, TimelineType::AlertCritical};
+
+  Timeline::Entry *entry = idx ? &entries[*idx] : nullptr;
+  if (entry) entry->end_time = seconds;
+  if (cs.getAlertSize() != cereal::SelfdriveState::AlertSize::NONE) {
+    auto type = alert_types[(int)cs.getAlertStatus()];
+    std::string text1 = cs.getAlertText1().cStr();
+    std::string text2 = cs.getAlertText2().cStr();
+    if (!entry || entry->type != type || entry->text1 != text1 || entry->text2 != text2) {
+      idx = entries.size();
+      entries.emplace_back(Timeline::Entry{seconds, seconds, type, text1, text2});  // Start a new entry
+    }
+  } else {
+    idx.reset();
+  }
+}
+
+}  // namespace
+
 Timeline::~Timeline() {
   should_exit_.store(true);
   if (thread_.joinable()) {
@@ -18,94 +55,172 @@ void Timeline::initialize(const Route &route, uint64_t route_start_ts, bool loca
 }
 
 std::optional<uint64_t> Timeline::find(double cur_ts, FindFlag flag) const {
-  for (const auto &entry : *getEntries()) {
-    if (entry.type == TimelineType::Engaged) {
-      if (flag == FindFlag::nextEngagement && entry.start_time > cur_ts) {
-        return entry.start_time;
-      } else if (flag == FindFlag::nextDisEngagement && entry.end_time > cur_ts) {
-        return entry.end_time;
-      }
-    } else if (entry.start_time > cur_ts) {
-      if ((flag == FindFlag::nextUserBookmark && entry.type == TimelineType::UserBookmark) ||
-          (flag == FindFlag::nextInfo && entry.type == TimelineType::AlertInfo) ||
-          (flag == FindFlag::nextWarning && entry.type == TimelineType::AlertWarning) ||
-          (flag == FindFlag::nextCritical && entry.type == TimelineType::AlertCritical)) {
-        return entry.start_time;
-      }
+  const auto index = std::atomic_load(&index_);
+  const auto &entries = index->entries;
+  auto next_start = [&](TimelineType type) -> std::optional<uint64_t> {
+    const auto &ids = index->by_type[(int)type];
+    auto it = std::partition_point(ids.begin(), ids.end(), [&](size_t i) { return entries[i].start_time <= cur_ts; });
+    if (it == ids.end()) return std::nullopt;
+    return entries[*it].start_time;
+  };
+
+  switch (flag) {
+    case FindFlag::nextEngagement: return next_start(TimelineType::Engaged);
+    case FindFlag::nextDisEngagement: {
+      // engagements never overlap, so their end times are sorted as well
+      const auto &ids = index->by_type[(int)TimelineType::Engaged];
+      auto it = std::partition_point(ids.begin(), ids.end(), [&](size_t i) { return entries[i].end_time <= cur_ts; });
+      if (it == ids.end()) return std::nullopt;
+      return entries[*it].end_time;
     }
+    case FindFlag::nextUserBookmark: return next_start(TimelineType::UserBookmark);
+    case FindFlag::nextInfo: return next_start(TimelineType::AlertInfo);
+    case FindFlag::nextWarning: return next_start(TimelineType::AlertWarning);
+    case FindFlag::nextCritical: return next_start(TimelineType::AlertCritical);
   }
   return std::nullopt;
 }
 
 std::optional<Timeline::Entry> Timeline::findAlertAtTime(double target_time) const {
-  for (const auto &entry : *getEntries()) {
-    if (entry.start_time > target_time) break;
-    if (entry.end_time >= target_time && entry.type >= TimelineType::AlertInfo) {
-      return entry;
-    }
-  }
+  const auto index = std::atomic_load(&index_);
+  const auto &alerts = index->alerts;
+  // the earliest started alert that is still active at target_time
+  size_t started = std::partition_point(alerts.begin(), alerts.end(), [&](size_t i) {
+    return index->entries[i].start_time <= target_time;
+  }) - alerts.begin();
+  size_t i = std::lower_bound(index->alert_end_max.begin(), index->alert_end_max.begin() + started, target_time) -
+             index->alert_end_max.begin();
+  if (i < started) return index->entries[alerts[i]];
   return std::nullopt;
 }
 
 void Timeline::buildTimeline(const Route &route, uint64_t route_start_ts, bool local_cache,
                              std::function<void(std::shared_ptr<LogReader>)> callback) {
-  std::optional<size_t> current_engaged_idx, current_alert_idx;
-
+  std::vector<std::string> qlogs;
   for (const auto &segment : route.segments()) {
-    if (should_exit_) break;
+    qlogs.push_back(segment.second.qlog);
+  }
 
-    auto log = std::make_shared<LogReader>();
-    if (!log->load(segment.second.qlog, &should_exit_, local_cache) || log->events.empty()) {
-      continue;  // Skip if log loading fails or no events
-    }
+  std::atomic<size_t> next_segment = 0;
+
+  auto worker = [&]() {
+    while (!should_exit_) {
+      const size_t n = next_segment++;
+      if (n >= qlogs.size()) break;
 
-    for (const Event &e : log->events) {
-      double seconds = (e.mono_time - route_start_ts) / 1e9;
-      if (e.which == cereal::Event::Which::SELFDRIVE_STATE) {
-        capnp::FlatArrayMessageReader reader(e.data);
-        auto cs = reader.getRoot<cereal::Event>().getSelfdriveState();
-        updateEngagementStatus(cs, current_engaged_idx, seconds);
-        updateAlertStatus(cs, current_alert_idx, seconds);
-      } else if (e.which == cereal::Event::Which::USER_BOOKMARK) {
-        staging_entries_.emplace_back(Entry{seconds, seconds, TimelineType::UserBookmark});
+      auto log = std::make_shared<LogReader>();
+      const bool loaded = log->load(qlogs[n], &should_exit_, local_cache) && !log->events.empty();
+      addSegment(n, loaded ? log.get() : nullptr, route_start_ts);
+
+      if (loaded) {
+        callback(log);  // Notify the callback once the log is processed
       }
     }
+  };
+
+  const size_t num_workers = std::min<size_t>(std::clamp(std::thread::hardware_concurrency(), 1u, 4u), qlogs.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_workers; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
 
-    // Sort and finalize the timeline entries
-    auto entries = std::make_shared<std::vector<Entry>>(staging_entries_);
-    std::sort(entries->begin(), entries->end(), [](auto &a, auto &b) { return a.start_time < b.start_time; });
-    std::atomic_store(&timeline_entries_, std::move(entries));
+void Timeline::addSegment(size_t n, const LogReader *log, uint64_t route_start_ts) {
+  SegmentSpans spans = log ? extractSpans(*log, route_start_ts) : SegmentSpans{};
 
-    callback(log);  // Notify the callback once the log is processed
+  std::lock_guard lk(merge_lock_);
+  pending_.emplace(n, std::move(spans));
+  const size_t merged_before = next_merge_;
+  for (auto it = pending_.begin(); it != pending_.end() && it->first == next_merge_; it = pending_.erase(it)) {
+    mergeSpans(std::move(it->second));
+    ++next_merge_;
+  }
+  if (next_merge_ != merged_before) {
+    publishIndex();
   }
 }
 
-void Timeline::updateEngagementStatus(const cereal::SelfdriveState::Reader &cs, std::optional<size_t> &idx, double seconds) {
-  if (idx) staging_entries_[*idx].end_time = seconds;
-  if (cs.getEnabled()) {
-    if (!idx) {
-      idx = staging_entries_.size();
-      staging_entries_.emplace_back(Entry{seconds, seconds, TimelineType::Engaged});
+Timeline::SegmentSpans Timeline::extractSpans(const LogReader &log, uint64_t route_start_ts) const {
+  SegmentSpans spans;
+  for (const Event &e : log.events) {
+    double seconds = (e.mono_time - route_start_ts) / 1e9;
+    if (e.which == cereal::Event::Which::SELFDRIVE_STATE) {
+      capnp::FlatArrayMessageReader reader(e.data);
+      auto cs = reader.getRoot<cereal::Event>().getSelfdriveState();
+      const bool first = !spans.first_state_time;
+      updateEngagementStatus(spans.entries, cs, spans.open_engaged, seconds);
+      updateAlertStatus(spans.entries, cs, spans.open_alert, seconds);
+      if (first) {
+        spans.first_state_time = seconds;
+        spans.first_engaged = spans.open_engaged;
+        spans.first_alert = spans.open_alert;
+      }
+    } else if (e.which == cereal::Event::Which::USER_BOOKMARK) {
+      spans.entries.emplace_back(Entry{seconds, seconds, TimelineType::UserBookmark});
     }
-  } else {
-    idx.reset();
   }
+  return spans;
 }
 
-void Timeline::updateAlertStatus(const cereal::SelfdriveState::Reader &cs, std::optional<size_t> &idx, double seconds) {
-  static auto alert_types = std::array{TimelineType::AlertInfo, TimelineType::AlertWarning, TimelineType::AlertCritical};
+void Timeline::mergeSpans(SegmentSpans &&spans) {
+  // where each of the segment's entries ends up in staging_entries_
+  std::vector<std::optional<size_t>> joined(spans.entries.size());
 
-  Entry *entry = idx ? &staging_entries_[*idx] : nullptr;
-  if (entry) entry->end_time = seconds;
-  if (cs.getAlertSize() != cereal::SelfdriveState::AlertSize::NONE) {
-    auto type = alert_types[(int)cs.getAlertStatus()];
-    std::string text1 = cs.getAlertText1().cStr();
-    std::string text2 = cs.getAlertText2().cStr();
-    if (!entry || entry->type != type || entry->text1 != text1 || entry->text2 != text2) {
-      idx = staging_entries_.size();
-      staging_entries_.emplace_back(Entry{seconds, seconds, type, text1, text2});  // Start a new entry
+  if (spans.first_state_time) {
+    // the first selfdriveState of the segment ends the spans left open by the previous segments,
+    // or continues them if it opened the same span again
+    if (open_engaged_) {
+      auto &prev = staging_entries_[*open_engaged_];
+      prev.end_time = *spans.first_state_time;
+      if (spans.first_engaged) {
+        prev.end_time = spans.entries[*spans.first_engaged].end_time;
+        joined[*spans.first_engaged] = open_engaged_;
+      }
+    }
+    if (open_alert_) {
+      auto &prev = staging_entries_[*open_alert_];
+      prev.end_time = *spans.first_state_time;
+      if (spans.first_alert) {
+        const auto &e = spans.entries[*spans.first_alert];
+        if (prev.type == e.type && prev.text1 == e.text1 && prev.text2 == e.text2) {
+          prev.end_time = e.end_time;
+          joined[*spans.first_alert] = open_alert_;
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < spans.entries.size(); ++i) {
+    if (!joined[i]) {
+      joined[i] = staging_entries_.size();
+      staging_entries_.push_back(std::move(spans.entries[i]));
+    }
+  }
+
+  // a segment without selfdriveState leaves the open spans as they are
+  if (spans.first_state_time) {
+    open_engaged_ = spans.open_engaged ? joined[*spans.open_engaged] : std::nullopt;
+    open_alert_ = spans.open_alert ? joined[*spans.open_alert] : std::nullopt;
+  }
+}
+
+void Timeline::publishIndex() {
+  auto index = std::make_shared<Index>();
+  index->entries = staging_entries_;
+  auto &entries = index->entries;
+  std::stable_sort(entries.begin(), entries.end(), [](auto &a, auto &b) { return a.start_time < b.start_time; });
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    index->by_type[(int)entries[i].type].push_back(i);
+    if (entries[i].type >= TimelineType::AlertInfo) {
+      double end_max = index->alerts.empty() ? entries[i].end_time : std::max(index->alert_end_max.back(), entries[i].end_time);
+      index->alerts.push_back(i);
+      index->alert_end_max.push_back(end_max);
     }
-  } else {
-    idx.reset();
   }
+  std::atomic_store(&index_, std::move(index));
 }
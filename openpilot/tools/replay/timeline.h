@@ -1,6 +1,9 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <map>
+#include <mutex>
 #include <optional>
 #include <thread>
 #include <vector>
@@ -20,27 +23,53 @@ public:
     std::string text2;
   };
 
-  Timeline() : timeline_entries_(std::make_shared<std::vector<Entry>>()) {}
+  Timeline() : index_(std::make_shared<Index>()) {}
   ~Timeline();
 
   void initialize(const Route &route, uint64_t route_start_ts, bool local_cache,
                   std::function<void(std::shared_ptr<LogReader>)> callback);
+  // Adds the spans of the n-th segment, null if it failed to load. Spans continue across segment
+  // boundaries, so a segment is merged once all the segments before it are added.
+  void addSegment(size_t n, const LogReader *log, uint64_t route_start_ts);
   std::optional<uint64_t> find(double cur_ts, FindFlag flag) const;
   std::optional<Entry> findAlertAtTime(double target_time) const;
-  const std::shared_ptr<std::vector<Entry>> getEntries() const { return std::atomic_load(&timeline_entries_); }
+  const std::shared_ptr<std::vector<Entry>> getEntries() const {
+    auto index = std::atomic_load(&index_);
+    return std::shared_ptr<std::vector<Entry>>(index, &index->entries);
+  }
 
 private:
+  // Spans extracted from a single segment
+  struct SegmentSpans {
+    std::vector<Entry> entries;
+    std::optional<double> first_state_time;            // time of the first selfdriveState
+    std::optional<size_t> first_engaged, first_alert;  // spans opened by the first selfdriveState
+    std::optional<size_t> open_engaged, open_alert;    // spans still open at the end of the segment
+  };
+
+  // Immutable snapshot of the timeline with sorted per-type lookups
+  struct Index {
+    std::vector<Entry> entries;  // sorted by start time
+    std::array<std::vector<size_t>, (int)TimelineType::UserBookmark + 1> by_type;
+    std::vector<size_t> alerts;          // entries with type >= AlertInfo
+    std::vector<double> alert_end_max;   // running max of the alerts' end times
+  };
+
   void buildTimeline(const Route &route, uint64_t route_start_ts, bool local_cache,
                      std::function<void(std::shared_ptr<LogReader>)> callback);
-  void updateEngagementStatus(const cereal::SelfdriveState::Reader &cs, std::optional<size_t> &idx, double seconds);
-  void updateAlertStatus(const cereal::SelfdriveState::Reader &cs, std::optional<size_t> &idx, double seconds);
+  SegmentSpans extractSpans(const LogReader &log, uint64_t route_start_ts) const;
+  void mergeSpans(SegmentSpans &&spans);
+  void publishIndex();
 
   std::thread thread_;
   std::atomic<bool> should_exit_ = false;
 
-  // Temporarily holds entries before they are sorted and finalized
+  std::mutex merge_lock_;
+  std::map<size_t, SegmentSpans> pending_;  // added segments waiting for the ones before them
+  size_t next_merge_ = 0;
+  // Merged entries of the segments processed so far, unsorted
   std::vector<Entry> staging_entries_;
+  std::optional<size_t> open_engaged_, open_alert_;
 
-  // Final sorted timeline entries
-  std::shared_ptr<std::vector<Entry>> timeline_entries_;
+  std::shared_ptr<Index> index_;
 };
@@ -1,10 +1,14 @@
 #include "tools/replay/util.h"
 
+#include <sys/stat.h>
+
 #include <cassert>
+#include <climits>
 #include <cstdarg>
 #include <cstring>
 #include <iostream>
 #include <mutex>
+#include "common/hardware/hw.h"
 #include "common/timing.h"
 #include "common/util.h"
 
@@ -73,6 +77,17 @@ void precise_nano_sleep(int64_t nanoseconds, std::atomic<bool> &interrupt_reques
   }
 }
 
+void precise_sleep_until(uint64_t deadline_nanos, std::atomic<bool> &interrupt_requested) {
+  // wakeups from a sleep can be late by tens of microseconds, spin through the final stretch
+  constexpr int64_t SPIN_NANOS = 200 * 1000;
+  int64_t remaining = (int64_t)(deadline_nanos - nanos_since_boot());
+  if (remaining > SPIN_NANOS) {
+    precise_nano_sleep(remaining - SPIN_NANOS, interrupt_requested);
+  }
+  while (!interrupt_requested && nanos_since_boot() < deadline_nanos) {
+  }
+}
+
 std::vector<std::string> split(std::string_view source, char delimiter) {
   std::vector<std::string> fields;
   size_t last = 0;
@@ -86,6 +101,33 @@ std::vector<std::string> split(std::string_view source, char delimiter) {
   return fields;
 }
 
+std::string cacheSidecarPath(const std::string &prefix, const std::string &file) {
+  char real_path[PATH_MAX];
+  std::string path = realpath(file.c_str(), real_path) ? real_path : file;
+  uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a of the path
+  for (unsigned char c : path) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+
+  std::string dir = Path::download_cache_root();
+  if (!dir.empty() && dir.back() != '/') dir += "/";
+  return dir + prefix + util::string_format("%016llx", (unsigned long long)hash);
+}
+
+bool fileStat(const std::string &file, uint64_t &size, int64_t &mtime_ns, int64_t *atime_ns) {
+  struct stat st = {};
+  if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+  size = st.st_size;
+#ifdef __APPLE__
+  mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+  if (atime_ns) *atime_ns = (int64_t)st.st_atimespec.tv_sec * 1000000000LL + st.st_atimespec.tv_nsec;
+#else
+  mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  if (atime_ns) *atime_ns = (int64_t)st.st_atim.tv_sec * 1000000000LL + st.st_atim.tv_nsec;
+#endif
+  return true;
+}
+
 std::string extractFileName(const std::string &file) {
   size_t queryPos = file.find_first_of("?");
   std::string path = (queryPos != std::string::npos) ? file.substr(0, queryPos) : file;
@@ -101,6 +143,7 @@ void *MonotonicBuffer::allocate(size_t bytes, size_t alignment) {
   if (p == nullptr) {
     available = next_buffer_size = std::max(next_buffer_size, bytes);
     current_buf = buffers.emplace_back(std::aligned_alloc(alignment, next_buffer_size));
+    capacity_ += next_buffer_size;
     next_buffer_size *= growth_factor;
     p = current_buf;
   }
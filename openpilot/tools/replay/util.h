@@ -37,20 +37,29 @@ public:
   ~MonotonicBuffer();
   void *allocate(size_t bytes, size_t alignment = 16ul);
   void deallocate(void *p) {}
+  size_t capacity() const { return capacity_; }
 
 private:
   void *current_buf = nullptr;
   size_t next_buffer_size = 0;
   size_t available = 0;
+  size_t capacity_ = 0;
   std::deque<void *> buffers;
   static constexpr float growth_factor = 1.5;
 };
 
 void precise_nano_sleep(int64_t nanoseconds, std::atomic<bool> &interrupt_requested);
+// Sleeps until the nanos_since_boot() deadline, spinning for the last part to avoid wakeup jitter.
+void precise_sleep_until(uint64_t deadline_nanos, std::atomic<bool> &interrupt_requested);
 std::string getUrlWithoutQuery(const std::string &url);
 std::string formattedDataSize(size_t size);
 std::string extractFileName(const std::string& file);
 std::vector<std::string> split(std::string_view source, char delimiter);
+// Path of a sidecar file in the download cache for a local file, keyed by the file's real path.
+std::string cacheSidecarPath(const std::string &prefix, const std::string &file);
+// Size and modification time of a regular file, stored in sidecars to detect a changed file.
+// The access time is what the download cache evicts by.
+bool fileStat(const std::string &file, uint64_t &size, int64_t &mtime_ns, int64_t *atime_ns = nullptr);
 
 template <typename Iterable>
 std::string join(const Iterable& elements, const std::string& separator) {